@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: ISC
+
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+int
+arena_init(Arena *arena, size_t size, unsigned max_regions)
+{
+  memset(arena, 0, sizeof(Arena));
+
+  void *base = NULL;
+  size = arena_round(size ? size : 1);
+  if (posix_memalign(&base, ARENA_ALIGN, size))
+  {
+    return 1;
+  }
+
+  arena->regions = (ArenaRegion *)calloc(max_regions + 1, sizeof(ArenaRegion));
+  if (!arena->regions)
+  {
+    free(base);
+    return 1;
+  }
+
+  /* Touch every page now so the render never takes a page fault */
+  memset(base, 0, size);
+  arena->base = (unsigned char *)base;
+  arena->size = size;
+  arena->max_regions = max_regions;
+  arena->locked = !mlock(base, size);
+  return 0;
+}
+
+void *
+arena_alloc(Arena *arena, size_t size, const char *kind, const char *name)
+{
+  size = arena_round(size);
+  if (arena->used + size > arena->size ||
+      arena->n_regions == arena->max_regions)
+  {
+    return NULL;
+  }
+
+  ArenaRegion *region = &arena->regions[arena->n_regions++];
+  region->kind = kind;
+  region->name = name;
+  region->offset = arena->used;
+  region->size = size;
+
+  void *ptr = arena->base + arena->used;
+  arena->used += size;
+  return ptr;
+}
+
+void
+arena_print_layout(const Arena *arena, FILE *stream)
+{
+  fprintf(stream,
+          "Arena: %zu bytes at %p, %u regions, %zu bytes used, %s\n",
+          arena->size,
+          (void *)arena->base,
+          arena->n_regions,
+          arena->used,
+          arena->locked ? "locked" : "not locked");
+
+  for (unsigned i = 0; i < arena->n_regions; ++i)
+  {
+    const ArenaRegion *region = &arena->regions[i];
+    fprintf(stream,
+            "  %8zu  %8zu  %-8s %s\n",
+            region->offset,
+            region->size,
+            region->kind,
+            region->name ? region->name : "");
+  }
+}
+
+void
+arena_free(Arena *arena)
+{
+  if (arena->base)
+  {
+    if (arena->locked)
+    {
+      munlock(arena->base, arena->size);
+    }
+    free(arena->base);
+  }
+
+  free(arena->regions);
+  memset(arena, 0, sizeof(Arena));
+}
@@ -0,0 +1,68 @@
+// SPDX-License-Identifier: ISC
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/** Alignment of every arena allocation, a cache line and a SIMD vector */
+#define ARENA_ALIGN 64
+
+/** A named region of an arena, for the layout report */
+typedef struct
+{
+  const char *kind; ///< What the region holds ("audio", "atom", ...)
+  const char *name; ///< Port symbol or other name
+  size_t offset;    ///< Offset from the start of the arena
+  size_t size;      ///< Size in bytes, rounded up to ARENA_ALIGN
+} ArenaRegion;
+
+/**
+   A single preallocated, zeroed and locked block of memory.
+
+   All buffers are carved out of the arena with a bump allocator before the
+   plugin is activated, so nothing is allocated while rendering, and every
+   buffer starts on its own cache line so no two ports share one.
+*/
+typedef struct
+{
+  unsigned char *base;  ///< Start of the arena
+  size_t size;          ///< Total size in bytes
+  size_t used;          ///< Bytes allocated so far
+  bool locked;          ///< True iff mlock() succeeded
+  ArenaRegion *regions; ///< Allocated regions, in order
+  unsigned n_regions;   ///< Number of allocated regions
+  unsigned max_regions; ///< Capacity of regions
+} Arena;
+
+/** Return `size` rounded up to ARENA_ALIGN. */
+static inline size_t
+arena_round(size_t size)
+{
+  return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+/**
+   Allocate, zero and lock an arena of `size` bytes for `max_regions` regions.
+
+   Failing to lock the memory is not an error, see Arena::locked.  Returns
+   zero on success.
+*/
+int
+arena_init(Arena *arena, size_t size, unsigned max_regions);
+
+/** Return a new aligned region of `size` bytes, or NULL if full. */
+void *
+arena_alloc(Arena *arena, size_t size, const char *kind, const char *name);
+
+/** Print the arena layout to `stream`. */
+void
+arena_print_layout(const Arena *arena, FILE *stream);
+
+/** Unlock and free an arena. */
+void
+arena_free(Arena *arena);
+
+#endif // ARENA_H
@@ -0,0 +1,531 @@
+// SPDX-License-Identifier: ISC
+
+/**
+   Host overhead benchmark.
+
+   Measures, for a matrix of block sizes, the throughput of the plugin and
+   the latency distribution of individual lilv_instance_run() calls, and for
+   a matrix of block sizes and channel counts, the time spent interleaving
+   and writing blocks with libsndfile.  Results are printed as CSV, one row
+   per measurement, so runs of different host versions can be compared.
+*/
+
+#include "lilv/lilv.h"
+
+#include "lv2/atom/atom.h"
+#include "lv2/core/lv2.h"
+#include "lv2/midi/midi.h"
+#include "lv2/urid/urid.h"
+
+#include "lv2_evbuf.h"
+#include "pcm_convert.h"
+#include "urid_map.h"
+
+#include <algorithm>
+
+#include <math.h>
+#include <sndfile.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SAMPLE_RATE 44100
+#define PLUGINS_URI "https://github.com/apiel/lilv-midi-example/plugins/"
+
+/** In-tree plugins benchmarked by default, see the plugins directory */
+static const char *const default_plugins[] = {
+    PLUGINS_URI "passthrough",
+    PLUGINS_URI "gain",
+    PLUGINS_URI "sine",
+    PLUGINS_URI "synth",
+};
+
+static const uint32_t block_sizes[] = {32, 64, 128, 256, 512, 1024, 2048,
+                                       4096, 8192};
+static const uint32_t channel_counts[] = {1, 2, 8};
+
+#define N_BLOCK_SIZES (sizeof(block_sizes) / sizeof(block_sizes[0]))
+#define N_CHANNEL_COUNTS (sizeof(channel_counts) / sizeof(channel_counts[0]))
+#define MAX_BLOCK_SIZE 8192
+#define MAX_CHANNELS 8
+
+/** Return a monotonic timestamp in nanoseconds. */
+static uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000U + (uint64_t)ts.tv_nsec;
+}
+
+/** Return the `p` quantile of sorted samples. */
+static uint64_t
+quantile(const uint64_t *sorted, size_t n, double p)
+{
+  const size_t i = (size_t)(p * (double)(n - 1) + 0.5);
+  return sorted[i < n ? i : n - 1];
+}
+
+static void
+print_header(void)
+{
+  printf("test,plugin,block_size,channels,frames,seconds,frames_per_sec,"
+         "mean_ns,p50_ns,p90_ns,p99_ns,max_ns\n");
+}
+
+/** Print one result row, sorting `samples` of per-call nanoseconds. */
+static void
+print_row(const char *test,
+          const char *plugin,
+          uint32_t block_size,
+          uint32_t channels,
+          int64_t frames,
+          uint64_t *samples,
+          size_t n_samples)
+{
+  std::sort(samples, samples + n_samples);
+
+  uint64_t total = 0;
+  for (size_t i = 0; i < n_samples; ++i)
+  {
+    total += samples[i];
+  }
+
+  const double seconds = (double)total * 1e-9;
+  printf("%s,%s,%u,%u,%ld,%.6f,%.0f,%.0f,%lu,%lu,%lu,%lu\n",
+         test,
+         plugin,
+         block_size,
+         channels,
+         (long)frames,
+         seconds,
+         (double)frames / seconds,
+         (double)total / (double)n_samples,
+         (unsigned long)quantile(samples, n_samples, 0.5),
+         (unsigned long)quantile(samples, n_samples, 0.9),
+         (unsigned long)quantile(samples, n_samples, 0.99),
+         (unsigned long)samples[n_samples - 1]);
+}
+
+/** Plugin under test with a buffer for every port */
+typedef struct
+{
+  LilvWorld *world;
+  const LilvPlugin *plugin;
+  URIDMap *map;
+  LV2_URID_Map map_feature_data;
+  LV2_Feature map_feature;
+  const LV2_Feature *features[2];
+  uint32_t n_ports;
+  float *controls;      ///< Default value of every port
+  float *audio;         ///< MAX_BLOCK_SIZE frames for every port
+  LV2_Evbuf **evbufs;   ///< Event buffer of every atom port, or NULL
+  bool *is_input;       ///< True iff the port is an input
+  bool *is_midi;        ///< True iff the port is a MIDI input
+  uint32_t n_audio_out; ///< Number of audio outputs
+  LV2_URID atom_Chunk;
+  LV2_URID atom_Sequence;
+  LV2_URID midi_MidiEvent;
+} Bench;
+
+/** Connect every port of `instance` to its buffer. */
+static void
+connect_ports(Bench *b, LilvInstance *instance)
+{
+  LilvNode *lv2_AudioPort = lilv_new_uri(b->world, LV2_CORE__AudioPort);
+  LilvNode *lv2_CVPort = lilv_new_uri(b->world, LV2_CORE__CVPort);
+  LilvNode *lv2_ControlPort = lilv_new_uri(b->world, LV2_CORE__ControlPort);
+
+  for (uint32_t p = 0; p < b->n_ports; ++p)
+  {
+    const LilvPort *port = lilv_plugin_get_port_by_index(b->plugin, p);
+    if (lilv_port_is_a(b->plugin, port, lv2_ControlPort))
+    {
+      lilv_instance_connect_port(instance, p, &b->controls[p]);
+    }
+    else if (lilv_port_is_a(b->plugin, port, lv2_AudioPort) ||
+             lilv_port_is_a(b->plugin, port, lv2_CVPort))
+    {
+      lilv_instance_connect_port(
+          instance, p, b->audio + (size_t)p * MAX_BLOCK_SIZE);
+    }
+    else if (b->evbufs[p])
+    {
+      lilv_instance_connect_port(
+          instance, p, lv2_evbuf_get_buffer(b->evbufs[p]));
+    }
+    else
+    {
+      lilv_instance_connect_port(instance, p, NULL);
+    }
+  }
+
+  lilv_node_free(lv2_ControlPort);
+  lilv_node_free(lv2_CVPort);
+  lilv_node_free(lv2_AudioPort);
+}
+
+/** Reset event buffers, with a note on in the MIDI inputs if `note`. */
+static void
+reset_events(Bench *b, bool note)
+{
+  static const uint8_t note_on[3] = {LV2_MIDI_MSG_NOTE_ON, 60, 100};
+  for (uint32_t p = 0; p < b->n_ports; ++p)
+  {
+    if (b->evbufs[p])
+    {
+      lv2_evbuf_reset(b->evbufs[p], b->is_input[p]);
+      if (note && b->is_midi[p])
+      {
+        LV2_Evbuf_Iterator iter = lv2_evbuf_begin(b->evbufs[p]);
+        lv2_evbuf_write(
+            &iter, 0, 0, b->midi_MidiEvent, sizeof(note_on), note_on);
+      }
+    }
+  }
+}
+
+/** Time every lilv_instance_run() call over n_frames for each block size. */
+static int
+bench_run(Bench *b, const char *uri, int64_t n_frames)
+{
+  uint64_t *samples =
+      (uint64_t *)malloc(((size_t)n_frames / block_sizes[0] + 1) *
+                         sizeof(uint64_t));
+
+  for (size_t s = 0; s < N_BLOCK_SIZES; ++s)
+  {
+    const uint32_t block_size = block_sizes[s];
+    LilvInstance *instance =
+        lilv_plugin_instantiate(b->plugin, SAMPLE_RATE, b->features);
+    if (!instance)
+    {
+      fprintf(stderr, "error: Failed to instantiate <%s>\n", uri);
+      free(samples);
+      return 1;
+    }
+
+    connect_ports(b, instance);
+    lilv_instance_activate(instance);
+
+    size_t n_samples = 0;
+    for (int64_t offset = 0; offset < n_frames; offset += block_size)
+    {
+      const int64_t remaining = n_frames - offset;
+      const uint32_t n =
+          remaining < block_size ? (uint32_t)remaining : block_size;
+
+      reset_events(b, offset == 0);
+      const uint64_t start = now_ns();
+      lilv_instance_run(instance, n);
+      samples[n_samples++] = now_ns() - start;
+    }
+
+    lilv_instance_deactivate(instance);
+    lilv_instance_free(instance);
+    print_row(
+        "run", uri, block_size, b->n_audio_out, n_frames, samples, n_samples);
+  }
+
+  free(samples);
+  return 0;
+}
+
+/**
+   Time interleaving and writing n_frames of audio for each block size and
+   channel count, separately, to a PCM24 WAV file at `path`.
+
+   This is done twice: once interleaving floats and letting
+   sf_writef_float() convert them, and once converting in the host with
+   pcm_interleave() and writing with sf_write_raw().
+*/
+static int
+bench_write(const char *path, int64_t n_frames)
+{
+  const uint32_t max_channels = channel_counts[N_CHANNEL_COUNTS - 1];
+  float *planar =
+      (float *)malloc((size_t)MAX_BLOCK_SIZE * max_channels * sizeof(float));
+  float *block =
+      (float *)malloc((size_t)MAX_BLOCK_SIZE * max_channels * sizeof(float));
+  uint8_t *pcm = (uint8_t *)malloc((size_t)MAX_BLOCK_SIZE * max_channels * 3);
+  const float *channels[MAX_CHANNELS];
+  uint64_t *interleave_ns =
+      (uint64_t *)malloc(((size_t)n_frames / block_sizes[0] + 1) *
+                         sizeof(uint64_t));
+  uint64_t *write_ns =
+      (uint64_t *)malloc(((size_t)n_frames / block_sizes[0] + 1) *
+                         sizeof(uint64_t));
+
+  for (size_t i = 0; i < (size_t)MAX_BLOCK_SIZE * max_channels; ++i)
+  {
+    planar[i] = 0.5f * sinf((float)i * 0.01f);
+  }
+  for (uint32_t ch = 0; ch < max_channels; ++ch)
+  {
+    channels[ch] = planar + (size_t)ch * MAX_BLOCK_SIZE;
+  }
+
+  int st = 0;
+  for (size_t c = 0; !st && c < N_CHANNEL_COUNTS; ++c)
+  {
+    for (size_t s = 0; !st && s < N_BLOCK_SIZES; ++s)
+    {
+      const uint32_t n_channels = channel_counts[c];
+      const uint32_t block_size = block_sizes[s];
+
+      SF_INFO fmt = {0, SAMPLE_RATE, (int)n_channels,
+                     SF_FORMAT_WAV | SF_FORMAT_PCM_24, 0, 0};
+      SNDFILE *file = sf_open(path, SFM_WRITE, &fmt);
+      if (!file)
+      {
+        fprintf(stderr, "error: Failed to open %s\n", path);
+        st = 1;
+        break;
+      }
+
+      size_t n_samples = 0;
+      for (int64_t offset = 0; offset < n_frames; offset += block_size)
+      {
+        const int64_t remaining = n_frames - offset;
+        const uint32_t n =
+            remaining < block_size ? (uint32_t)remaining : block_size;
+
+        const uint64_t t0 = now_ns();
+        for (uint32_t ch = 0; ch < n_channels; ++ch)
+        {
+          const float *src = planar + (size_t)ch * MAX_BLOCK_SIZE;
+          for (uint32_t f = 0; f < n; ++f)
+          {
+            block[(size_t)f * n_channels + ch] = src[f];
+          }
+        }
+        const uint64_t t1 = now_ns();
+        if (sf_writef_float(file, block, n) != n)
+        {
+          st = 1;
+        }
+        const uint64_t t2 = now_ns();
+
+        interleave_ns[n_samples] = t1 - t0;
+        write_ns[n_samples++] = t2 - t1;
+      }
+
+      sf_close(file);
+      print_row("interleave", "", block_size, n_channels, n_frames,
+                interleave_ns, n_samples);
+      print_row("write", "", block_size, n_channels, n_frames,
+                write_ns, n_samples);
+
+      /* The same again, converting to PCM in the host like demo does */
+      if (st || !(file = sf_open(path, SFM_WRITE, &fmt)))
+      {
+        fprintf(stderr, "error: Failed to open %s\n", path);
+        st = 1;
+        break;
+      }
+
+      n_samples = 0;
+      for (int64_t offset = 0; offset < n_frames; offset += block_size)
+      {
+        const int64_t remaining = n_frames - offset;
+        const uint32_t n =
+            remaining < block_size ? (uint32_t)remaining : block_size;
+        const sf_count_t n_bytes = (sf_count_t)n * n_channels * 3;
+
+        const uint64_t t0 = now_ns();
+        pcm_interleave(channels, n_channels, n, PCM_S24, pcm);
+        const uint64_t t1 = now_ns();
+        if (sf_write_raw(file, pcm, n_bytes) != n_bytes)
+        {
+          st = 1;
+        }
+        const uint64_t t2 = now_ns();
+
+        interleave_ns[n_samples] = t1 - t0;
+        write_ns[n_samples++] = t2 - t1;
+      }
+
+      sf_close(file);
+      print_row("convert", pcm_kernel_name(), block_size, n_channels,
+                n_frames, interleave_ns, n_samples);
+      print_row("write_raw", "", block_size, n_channels, n_frames,
+                write_ns, n_samples);
+    }
+  }
+
+  unlink(path);
+  free(write_ns);
+  free(interleave_ns);
+  free(pcm);
+  free(block);
+  free(planar);
+  return st;
+}
+
+/** Load the plugin and allocate a buffer for every port. */
+static int
+bench_init(Bench *b, const char *uri)
+{
+  LilvNode *plugin_uri = lilv_new_uri(b->world, uri);
+  b->plugin = lilv_plugins_get_by_uri(lilv_world_get_all_plugins(b->world),
+                                      plugin_uri);
+  lilv_node_free(plugin_uri);
+  if (!b->plugin)
+  {
+    fprintf(stderr, "error: Plugin <%s> not found\n", uri);
+    return 1;
+  }
+
+  b->map = urid_map_new(4096);
+  b->map_feature_data.handle = b->map;
+  b->map_feature_data.map = urid_map_uri;
+  b->map_feature.URI = LV2_URID__map;
+  b->map_feature.data = &b->map_feature_data;
+  b->features[0] = &b->map_feature;
+  b->features[1] = NULL;
+  b->atom_Chunk = urid_map_uri(b->map, LV2_ATOM__Chunk);
+  b->atom_Sequence = urid_map_uri(b->map, LV2_ATOM__Sequence);
+  b->midi_MidiEvent = urid_map_uri(b->map, LV2_MIDI__MidiEvent);
+
+  b->n_ports = lilv_plugin_get_num_ports(b->plugin);
+  b->controls = (float *)calloc(b->n_ports, sizeof(float));
+  b->audio = (float *)calloc((size_t)b->n_ports * MAX_BLOCK_SIZE,
+                             sizeof(float));
+  b->evbufs = (LV2_Evbuf **)calloc(b->n_ports, sizeof(LV2_Evbuf *));
+  b->is_input = (bool *)calloc(b->n_ports, sizeof(bool));
+  b->is_midi = (bool *)calloc(b->n_ports, sizeof(bool));
+  lilv_plugin_get_port_ranges_float(b->plugin, NULL, NULL, b->controls);
+
+  LilvNode *lv2_InputPort = lilv_new_uri(b->world, LV2_CORE__InputPort);
+  LilvNode *lv2_AudioPort = lilv_new_uri(b->world, LV2_CORE__AudioPort);
+  LilvNode *atom_AtomPort = lilv_new_uri(b->world, LV2_ATOM__AtomPort);
+  LilvNode *midi_MidiEvent = lilv_new_uri(b->world, LV2_MIDI__MidiEvent);
+  for (uint32_t p = 0; p < b->n_ports; ++p)
+  {
+    const LilvPort *port = lilv_plugin_get_port_by_index(b->plugin, p);
+    b->controls[p] = isnan(b->controls[p]) ? 0.0f : b->controls[p];
+    b->is_input[p] = lilv_port_is_a(b->plugin, port, lv2_InputPort);
+    if (lilv_port_is_a(b->plugin, port, lv2_AudioPort) && !b->is_input[p])
+    {
+      ++b->n_audio_out;
+    }
+    else if (lilv_port_is_a(b->plugin, port, atom_AtomPort))
+    {
+      b->evbufs[p] = lv2_evbuf_new(8192, b->atom_Chunk, b->atom_Sequence);
+      b->is_midi[p] = b->is_input[p] &&
+                      lilv_port_supports_event(b->plugin, port, midi_MidiEvent);
+    }
+  }
+  lilv_node_free(midi_MidiEvent);
+  lilv_node_free(atom_AtomPort);
+  lilv_node_free(lv2_AudioPort);
+  lilv_node_free(lv2_InputPort);
+
+  return 0;
+}
+
+static void
+bench_free(Bench *b)
+{
+  for (uint32_t p = 0; b->evbufs && p < b->n_ports; ++p)
+  {
+    lv2_evbuf_free(b->evbufs[p]);
+  }
+  free(b->is_midi);
+  free(b->is_input);
+  free(b->evbufs);
+  free(b->audio);
+  free(b->controls);
+  urid_map_free(b->map);
+}
+
+static int
+print_usage(int status)
+{
+  fprintf(status ? stderr : stdout,
+          "Usage: bench [OPTION]... [PLUGIN_URI]...\n"
+          "Benchmark host overhead with each PLUGIN_URI (default the "
+          "in-tree plugins).\n\n"
+          "  -d SECONDS     Audio to render per measurement (default 10)\n"
+          "  -o FILE        Scratch file for write tests "
+          "(default /tmp/lv2-bench.wav)\n"
+          "  -W             Skip the write path tests\n"
+          "  -h             Display this help and exit\n");
+  return status;
+}
+
+int
+main(int argc, char **argv)
+{
+  const char *scratch_path = "/tmp/lv2-bench.wav";
+  double seconds = 10.0;
+  bool write_tests = true;
+
+  int a = 1;
+  for (; a < argc && argv[a][0] == '-'; ++a)
+  {
+    if (!strcmp(argv[a], "-h"))
+    {
+      return print_usage(0);
+    }
+    else if (!strcmp(argv[a], "-W"))
+    {
+      write_tests = false;
+    }
+    else if (a + 1 == argc)
+    {
+      return print_usage(1);
+    }
+    else if (!strcmp(argv[a], "-d"))
+    {
+      seconds = atof(argv[++a]);
+    }
+    else if (!strcmp(argv[a], "-o"))
+    {
+      scratch_path = argv[++a];
+    }
+    else
+    {
+      return print_usage(1);
+    }
+  }
+
+  if (seconds <= 0.0)
+  {
+    return print_usage(1);
+  }
+
+  const char *const *uris = (const char *const *)argv + a;
+  size_t n_uris = (size_t)(argc - a);
+  if (!n_uris)
+  {
+    uris = default_plugins;
+    n_uris = sizeof(default_plugins) / sizeof(default_plugins[0]);
+  }
+
+  const int64_t n_frames = (int64_t)(seconds * SAMPLE_RATE);
+  LilvWorld *world = lilv_world_new();
+  lilv_world_load_all(world);
+
+  print_header();
+  int st = 0;
+  for (size_t i = 0; !st && i < n_uris; ++i)
+  {
+    Bench b;
+    memset(&b, 0, sizeof(b));
+    b.world = world;
+    st = bench_init(&b, uris[i]) || bench_run(&b, uris[i], n_frames);
+    bench_free(&b);
+  }
+
+  if (!st && write_tests)
+  {
+    st = bench_write(scratch_path, n_frames);
+  }
+
+  lilv_world_free(world);
+  return st;
+}
@@ -0,0 +1,238 @@
+// SPDX-License-Identifier: ISC
+
+#include "block_reader.h"
+
+#include "trace.h"
+
+#include <atomic>
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct BlockReaderImpl
+{
+  SNDFILE *file;
+  uint32_t n_channels;
+  uint32_t block_size;
+  uint32_t n_slots;
+  int64_t remaining;           ///< Frames left to read (reader thread)
+  float *interleaved;          ///< Block as read from the file
+  float *blocks;               ///< n_slots blocks of planar channels
+  float **channels;            ///< Channel pointers of every slot
+  uint32_t *n_frames;          ///< Frame count of each filled block
+  std::atomic<uint32_t> head;  ///< Next slot to fill (producer)
+  std::atomic<uint32_t> tail;  ///< Next slot to use (consumer)
+  std::atomic<bool> done;      ///< Consumer has finished
+  std::atomic<bool> failed;    ///< A read failed
+  sem_t filled;                ///< Posted for every filled block
+  sem_t free_slots;            ///< Posted for every released block
+  pthread_t thread;
+  bool started;
+  bool at_end;                 ///< Consumer has seen the end of the file
+  uint64_t n_blocks;
+  uint64_t n_stalls;
+};
+
+/** Deinterleave n_frames from the read buffer into the planar block. */
+static void
+deinterleave(const BlockReader *r, float *const *channels, uint32_t n_frames)
+{
+  const uint32_t n_channels = r->n_channels;
+  const float *src = r->interleaved;
+  if (n_channels == 2)
+  {
+    float *l = channels[0];
+    float *rr = channels[1];
+    for (uint32_t f = 0; f < n_frames; ++f)
+    {
+      l[f] = src[2 * f];
+      rr[f] = src[2 * f + 1];
+    }
+  }
+  else
+  {
+    for (uint32_t c = 0; c < n_channels; ++c)
+    {
+      float *dst = channels[c];
+      for (uint32_t f = 0; f < n_frames; ++f)
+      {
+        dst[f] = src[(size_t)f * n_channels + c];
+      }
+    }
+  }
+
+  /* A short block is padded with silence */
+  for (uint32_t c = 0; c < n_channels; ++c)
+  {
+    memset(channels[c] + n_frames,
+           0,
+           (r->block_size - n_frames) * sizeof(float));
+  }
+}
+
+static void *
+reader_thread(void *data)
+{
+  BlockReader *r = (BlockReader *)data;
+  trace_thread_name("reader");
+
+  for (bool end = false; !end;)
+  {
+    sem_wait(&r->free_slots);
+    if (r->done.load(std::memory_order_acquire))
+    {
+      break;
+    }
+
+    const uint32_t head = r->head.load(std::memory_order_relaxed);
+    const uint32_t slot = head % r->n_slots;
+    const sf_count_t want =
+        r->remaining < r->block_size ? r->remaining : r->block_size;
+    const uint64_t t0 = trace_begin();
+    const sf_count_t got =
+        want ? sf_readf_float(r->file, r->interleaved, want) : 0;
+    trace_end(t0, "read file", NULL);
+    if (got < want && sf_error(r->file))
+    {
+      r->failed.store(true, std::memory_order_release);
+    }
+
+    deinterleave(r, r->channels + (size_t)slot * r->n_channels, (uint32_t)got);
+    r->remaining -= got;
+    r->n_frames[slot] = (uint32_t)got;
+    end = !got || r->failed.load(std::memory_order_relaxed);
+
+    r->head.store(head + 1, std::memory_order_release);
+    sem_post(&r->filled);
+  }
+
+  return NULL;
+}
+
+BlockReader *
+block_reader_new(SNDFILE *file,
+                 uint32_t n_channels,
+                 uint32_t block_size,
+                 uint32_t n_slots,
+                 int64_t n_frames)
+{
+  BlockReader *r = new BlockReader();
+  r->file = file;
+  r->n_channels = n_channels ? n_channels : 1;
+  r->block_size = block_size;
+  r->n_slots = n_slots ? n_slots : 1;
+  r->remaining = n_frames;
+
+  const size_t block_floats = (size_t)block_size * r->n_channels;
+  void *blocks = NULL;
+  if (!posix_memalign(&blocks, 64, r->n_slots * block_floats * sizeof(float)))
+  {
+    r->blocks = (float *)blocks;
+  }
+  r->interleaved = (float *)calloc(block_floats, sizeof(float));
+  r->channels = (float **)calloc((size_t)r->n_slots * r->n_channels,
+                                 sizeof(float *));
+  r->n_frames = (uint32_t *)calloc(r->n_slots, sizeof(uint32_t));
+  r->head.store(0);
+  r->tail.store(0);
+  r->done.store(false);
+  r->failed.store(false);
+  sem_init(&r->filled, 0, 0);
+  sem_init(&r->free_slots, 0, r->n_slots);
+
+  if (!r->blocks || !r->interleaved || !r->channels || !r->n_frames)
+  {
+    block_reader_free(r);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < (size_t)r->n_slots * r->n_channels; ++i)
+  {
+    r->channels[i] = r->blocks + i * block_size;
+  }
+
+  if (pthread_create(&r->thread, NULL, reader_thread, r))
+  {
+    block_reader_free(r);
+    return NULL;
+  }
+
+  r->started = true;
+  return r;
+}
+
+const float *const *
+block_reader_acquire(BlockReader *r, uint32_t *n_frames)
+{
+  const uint32_t tail = r->tail.load(std::memory_order_relaxed);
+  const uint32_t slot = tail % r->n_slots;
+  if (!r->at_end)
+  {
+    if (sem_trywait(&r->filled))
+    {
+      const uint64_t t0 = trace_begin();
+      ++r->n_stalls;
+      sem_wait(&r->filled);
+      trace_end(t0, "wait for reader", NULL);
+    }
+
+    if (r->failed.load(std::memory_order_acquire))
+    {
+      return NULL;
+    }
+
+    r->at_end = !r->n_frames[slot];
+    r->n_blocks += r->at_end ? 0 : 1;
+  }
+
+  *n_frames = r->at_end ? 0 : r->n_frames[slot];
+  return r->channels + (size_t)slot * r->n_channels;
+}
+
+void
+block_reader_release(BlockReader *r)
+{
+  if (!r->at_end)
+  {
+    r->tail.store(r->tail.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_release);
+    sem_post(&r->free_slots);
+  }
+}
+
+void
+block_reader_finish(BlockReader *r, BlockReaderStats *stats)
+{
+  if (r->started)
+  {
+    r->done.store(true, std::memory_order_release);
+    sem_post(&r->free_slots);
+    pthread_join(r->thread, NULL);
+    r->started = false;
+  }
+
+  if (stats)
+  {
+    stats->n_slots = r->n_slots;
+    stats->n_blocks = r->n_blocks;
+    stats->n_stalls = r->n_stalls;
+  }
+}
+
+void
+block_reader_free(BlockReader *r)
+{
+  if (r)
+  {
+    block_reader_finish(r, NULL);
+    sem_destroy(&r->free_slots);
+    sem_destroy(&r->filled);
+    free(r->n_frames);
+    free(r->channels);
+    free(r->interleaved);
+    free(r->blocks);
+    delete r;
+  }
+}
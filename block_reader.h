@@ -0,0 +1,63 @@
+// SPDX-License-Identifier: ISC
+
+#ifndef BLOCK_READER_H
+#define BLOCK_READER_H
+
+#include <sndfile.h>
+#include <stdint.h>
+
+/**
+   Asynchronous sound file reader.
+
+   A dedicated thread reads ahead of the render thread, deinterleaving each
+   block into preallocated planar buffers in a single-producer/single-
+   consumer ring, so reads overlap with processing.  Memory use is fixed by
+   the ring, whatever the length of the file.  The render thread only waits
+   when the ring is empty, which is counted in the statistics.
+*/
+typedef struct BlockReaderImpl BlockReader;
+
+/** Reader statistics, valid after block_reader_finish(). */
+typedef struct
+{
+  uint32_t n_slots;  ///< Ring depth in blocks
+  uint64_t n_blocks; ///< Total number of blocks read
+  uint64_t n_stalls; ///< Times the render thread found the ring empty
+} BlockReaderStats;
+
+/**
+   Create a reader for up to n_frames frames of `file` and start its thread.
+
+   The reader owns `file` until block_reader_finish() returns, the caller
+   must not touch it in the meantime.
+*/
+BlockReader *
+block_reader_new(SNDFILE *file,
+                 uint32_t n_channels,
+                 uint32_t block_size,
+                 uint32_t n_slots,
+                 int64_t n_frames);
+
+/**
+   Return the planar channels of the next block, waiting if it is not ready.
+
+   The number of frames read is stored in `n_frames`, the rest of the block
+   is silence, and it is zero at the end of the file.  Returns NULL if a
+   read failed.
+*/
+const float *const *
+block_reader_acquire(BlockReader *reader, uint32_t *n_frames);
+
+/** Return the block returned by block_reader_acquire() to the reader. */
+void
+block_reader_release(BlockReader *reader);
+
+/** Stop the reader thread and get statistics. */
+void
+block_reader_finish(BlockReader *reader, BlockReaderStats *stats);
+
+/** Free a reader (after block_reader_finish()). */
+void
+block_reader_free(BlockReader *reader);
+
+#endif // BLOCK_READER_H
@@ -0,0 +1,175 @@
+// SPDX-License-Identifier: ISC
+
+#include "block_writer.h"
+
+#include "trace.h"
+
+#include <atomic>
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdlib.h>
+
+struct BlockWriterImpl
+{
+  SNDFILE *file;
+  uint32_t frame_size;         ///< Bytes per interleaved frame
+  uint32_t block_size;
+  uint32_t n_slots;
+  uint8_t *blocks;             ///< n_slots blocks of raw PCM
+  uint32_t *n_frames;          ///< Frame count of each queued block
+  std::atomic<uint32_t> head;  ///< Next slot to fill (producer)
+  std::atomic<uint32_t> tail;  ///< Next slot to write (consumer)
+  std::atomic<bool> done;      ///< Producer has finished
+  std::atomic<bool> failed;    ///< A write failed
+  sem_t filled;                ///< Posted for every committed block
+  sem_t free_slots;            ///< Posted for every written block
+  pthread_t thread;
+  bool started;
+  uint32_t high_water;
+  uint64_t n_blocks;
+  uint64_t n_stalls;
+};
+
+static void *
+writer_thread(void *data)
+{
+  BlockWriter *w = (BlockWriter *)data;
+  trace_thread_name("writer");
+
+  for (;;)
+  {
+    sem_wait(&w->filled);
+
+    const uint32_t tail = w->tail.load(std::memory_order_relaxed);
+    if (tail == w->head.load(std::memory_order_acquire))
+    {
+      if (w->done.load(std::memory_order_acquire))
+      {
+        break;
+      }
+      continue;
+    }
+
+    const uint32_t slot = tail % w->n_slots;
+    const uint8_t *block =
+        w->blocks + (size_t)slot * w->block_size * w->frame_size;
+    const sf_count_t n = (sf_count_t)w->n_frames[slot] * w->frame_size;
+    const uint64_t t0 = trace_begin();
+    if (!w->failed.load(std::memory_order_relaxed) &&
+        sf_write_raw(w->file, block, n) != n)
+    {
+      w->failed.store(true, std::memory_order_release);
+    }
+    trace_end(t0, "write file", NULL);
+
+    w->tail.store(tail + 1, std::memory_order_release);
+    sem_post(&w->free_slots);
+  }
+
+  return NULL;
+}
+
+BlockWriter *
+block_writer_new(SNDFILE *file,
+                 uint32_t frame_size,
+                 uint32_t block_size,
+                 uint32_t n_slots)
+{
+  BlockWriter *w = new BlockWriter();
+  w->file = file;
+  w->frame_size = frame_size ? frame_size : 1;
+  w->block_size = block_size;
+  w->n_slots = n_slots ? n_slots : 1;
+  w->blocks = (uint8_t *)calloc((size_t)w->n_slots * block_size, w->frame_size);
+  w->n_frames = (uint32_t *)calloc(w->n_slots, sizeof(uint32_t));
+  w->head.store(0);
+  w->tail.store(0);
+  w->done.store(false);
+  w->failed.store(false);
+  sem_init(&w->filled, 0, 0);
+  sem_init(&w->free_slots, 0, w->n_slots);
+
+  if (!w->blocks || !w->n_frames ||
+      pthread_create(&w->thread, NULL, writer_thread, w))
+  {
+    block_writer_free(w);
+    return NULL;
+  }
+
+  w->started = true;
+  return w;
+}
+
+void *
+block_writer_acquire(BlockWriter *w)
+{
+  if (sem_trywait(&w->free_slots))
+  {
+    const uint64_t t0 = trace_begin();
+    ++w->n_stalls;
+    sem_wait(&w->free_slots);
+    trace_end(t0, "wait for writer", NULL);
+  }
+
+  if (w->failed.load(std::memory_order_acquire))
+  {
+    sem_post(&w->free_slots);
+    return NULL;
+  }
+
+  const uint32_t slot = w->head.load(std::memory_order_relaxed) % w->n_slots;
+  return w->blocks + (size_t)slot * w->block_size * w->frame_size;
+}
+
+void
+block_writer_commit(BlockWriter *w, uint32_t n_frames)
+{
+  const uint32_t head = w->head.load(std::memory_order_relaxed);
+  w->n_frames[head % w->n_slots] = n_frames;
+  w->head.store(head + 1, std::memory_order_release);
+  sem_post(&w->filled);
+
+  const uint32_t depth = head + 1 - w->tail.load(std::memory_order_acquire);
+  if (depth > w->high_water)
+  {
+    w->high_water = depth;
+  }
+  ++w->n_blocks;
+}
+
+int
+block_writer_finish(BlockWriter *w, BlockWriterStats *stats)
+{
+  if (w->started)
+  {
+    w->done.store(true, std::memory_order_release);
+    sem_post(&w->filled);
+    pthread_join(w->thread, NULL);
+    w->started = false;
+  }
+
+  if (stats)
+  {
+    stats->n_slots = w->n_slots;
+    stats->high_water = w->high_water;
+    stats->n_blocks = w->n_blocks;
+    stats->n_stalls = w->n_stalls;
+  }
+
+  return w->failed.load(std::memory_order_acquire) ? 1 : 0;
+}
+
+void
+block_writer_free(BlockWriter *w)
+{
+  if (w)
+  {
+    block_writer_finish(w, NULL);
+    sem_destroy(&w->free_slots);
+    sem_destroy(&w->filled);
+    free(w->n_frames);
+    free(w->blocks);
+    delete w;
+  }
+}
@@ -0,0 +1,66 @@
+// SPDX-License-Identifier: ISC
+
+#ifndef BLOCK_WRITER_H
+#define BLOCK_WRITER_H
+
+#include <sndfile.h>
+#include <stdint.h>
+
+/**
+   Asynchronous sound file writer.
+
+   The render thread fills preallocated blocks of interleaved PCM in a
+   single-producer/single-consumer ring, and a dedicated thread drains them
+   to the file with sf_write_raw(), so the render thread never waits on the
+   filesystem.  It only waits when the ring is full, which is counted in the
+   statistics.
+*/
+typedef struct BlockWriterImpl BlockWriter;
+
+/** Writer statistics, valid after block_writer_finish(). */
+typedef struct
+{
+  uint32_t n_slots;    ///< Ring depth in blocks
+  uint32_t high_water; ///< Maximum number of blocks queued at once
+  uint64_t n_blocks;   ///< Total number of blocks written
+  uint64_t n_stalls;   ///< Times the render thread found the ring full
+} BlockWriterStats;
+
+/**
+   Create a writer and start its thread.
+
+   Blocks hold block_size frames of frame_size bytes, already in the file's
+   sample format.  The writer owns `file` until block_writer_finish()
+   returns, the caller must not touch it in the meantime.
+*/
+BlockWriter *
+block_writer_new(SNDFILE *file,
+                 uint32_t frame_size,
+                 uint32_t block_size,
+                 uint32_t n_slots);
+
+/**
+   Return the next free block to fill, waiting if the ring is full.
+
+   Returns NULL if the writer thread has failed.
+*/
+void *
+block_writer_acquire(BlockWriter *writer);
+
+/** Queue the block returned by block_writer_acquire() for writing. */
+void
+block_writer_commit(BlockWriter *writer, uint32_t n_frames);
+
+/**
+   Flush all queued blocks and stop the writer thread.
+
+   Returns zero on success, or non-zero if any write failed.
+*/
+int
+block_writer_finish(BlockWriter *writer, BlockWriterStats *stats);
+
+/** Free a writer (after block_writer_finish()). */
+void
+block_writer_free(BlockWriter *writer);
+
+#endif // BLOCK_WRITER_H
@@ -3,15 +3,38 @@
 
 #include "lilv/lilv.h"
 
+#include "lv2/atom/atom.h"
 #include "lv2/core/lv2.h"
+#include "lv2/midi/midi.h"
+#include "lv2/resize-port/resize-port.h"
+#include "lv2/state/state.h"
+#include "lv2/urid/urid.h"
+#include "lv2/worker/worker.h"
 
-// #include <lv2/core/lv2_util.h>
-// #include <lv2/lv2plug.in/ns/ext/atom/atom.h>
-// #include <lv2/lv2plug.in/ns/ext/atom/util.h>
-// #include <lv2/lv2plug.in/ns/ext/midi/midi.h>
-// #include <lv2/lv2plug.in/ns/lv2core/lv2.h>
+#include "arena.h"
+#include "block_reader.h"
+#include "block_writer.h"
+#include "graph.h"
+#include "lv2_evbuf.h"
+#include "pcm_convert.h"
+#include "pcm_stream.h"
+#include "perf_counters.h"
+#include "pipeline.h"
+#include "plugin_index.h"
+#include "plugin_worker.h"
+#include "run_timer.h"
+#include "trace.h"
+#include "urid_map.h"
+#include "wav_map.h"
 
+#include <algorithm>
+#include <atomic>
+
+#include <dlfcn.h>
+#include <errno.h>
 #include <math.h>
+#include <pthread.h>
+#include <signal.h>
 #include <sndfile.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -19,6 +42,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #if defined(__GNUC__)
 #define LILV_LOG_FUNC(fmt, arg1) __attribute__((format(printf, fmt, arg1)))
@@ -27,6 +52,19 @@
 #endif
 
 #define SAMPLE_RATE 44100
+#define DEFAULT_BLOCK_SIZE 1024
+#define MIN_BLOCK_SIZE 32
+#define MAX_BLOCK_SIZE 8192
+#define DEFAULT_WRITE_SLOTS 16
+#define READ_SLOTS 8
+#define DEFAULT_EVBUF_SIZE 8192
+#define WORKER_RING_SIZE 8192
+#define RAMP_STEP 64
+#define MAX_NOTES 16
+#define URID_MAP_CAPACITY 4096
+#define MAX_BATCH_THREADS 256
+#define TRACE_SPANS 65536
+#define GRAPH_OUTPUT ((unsigned)-1)
 
 /** Control port value set from the command line */
 typedef struct Param
@@ -35,11 +73,14 @@ typedef struct Param
   float value;     ///< Control value
 } Param;
 
-/** Port type (only float ports are supported) */
+/** Port type (float ports and atom event ports are supported) */
 typedef enum
 {
   TYPE_CONTROL,
-  TYPE_AUDIO
+  TYPE_AUDIO,
+  TYPE_CV,
+  TYPE_EVENT,
+  TYPE_UNSUPPORTED
 } PortType;
 
 /** Runtime port information */
@@ -48,13 +89,141 @@ typedef struct
   const LilvPort *lilv_port; ///< Port description
   PortType type;             ///< Datatype
   uint32_t index;            ///< Port index
-  float value;               ///< Control value (if applicable)
+  float value;               ///< Default control value (if applicable)
+  float *control;            ///< Control value in the arena (if applicable)
+  float *buf;                ///< Planar audio/CV buffer (if applicable)
+  LV2_Evbuf *evbuf;          ///< Atom event buffer (if applicable)
+  uint32_t buf_size;         ///< Event buffer capacity in bytes
+  unsigned buf_id;           ///< Chain buffer of an audio port (chains)
   bool is_input;             ///< True iff an input port
   bool optional;             ///< True iff connection optional
+  bool supports_midi;        ///< True iff an event port that accepts MIDI
 } Port;
 
-/** Application state */
+/** A MIDI message to send to the plugin at a given frame */
+typedef struct
+{
+  int64_t frame;  ///< Time in frames from the start of the render
+  uint8_t msg[3]; ///< MIDI message
+} MidiEvent;
+
+/** How an automated control moves from one breakpoint to the next */
+typedef enum
+{
+  CURVE_STEP,        ///< Jump to the value at the breakpoint
+  CURVE_LINEAR,      ///< Linear ramp to the value at the breakpoint
+  CURVE_EXPONENTIAL, ///< Exponential ramp to the value at the breakpoint
+} Curve;
+
+/** A point of a control port's automation */
+typedef struct
+{
+  int64_t frame; ///< Time in frames from the start of the render
+  float value;   ///< Value at this time
+  Curve curve;   ///< How the value gets here from the previous point
+} Breakpoint;
+
+/** Automation of one control input port */
+typedef struct
+{
+  uint32_t port;      ///< Index of the control input port
+  Breakpoint *points; ///< Breakpoints, sorted by time
+  unsigned n_points;  ///< Number of breakpoints
+  unsigned next;      ///< Index of the next breakpoint to reach
+  Breakpoint start;   ///< Last breakpoint reached, where any ramp starts
+  int64_t next_frame; ///< Frame where the port value changes next
+} Lane;
+
+/** URIDs used by the host */
+typedef struct
+{
+  LV2_URID atom_Chunk;
+  LV2_URID atom_Sequence;
+  LV2_URID midi_MidiEvent;
+} URIDs;
+
+/** State of a plugin after a pre-roll, to restore into later instances */
+typedef struct
+{
+  const LilvPlugin *plugin; ///< Plugin the state was saved from
+  char *key;                ///< Control values it was pre-rolled with
+  LilvState *state;         ///< State saved after the pre-roll
+  double preroll_time;      ///< Time the pre-roll took in seconds
+} Snapshot;
+
+/** Snapshots shared by the jobs of a batch, guarded by the batch lock */
+typedef struct
+{
+  Snapshot *snapshots;  ///< One per plugin and set of control values
+  unsigned n_snapshots; ///< Number of snapshots
+  unsigned n_restored;  ///< Number of jobs that restored a snapshot
+  double restore_time;  ///< Total time spent restoring in seconds
+  double saved_time;    ///< Total pre-roll time saved by restoring
+} SnapshotCache;
+
+/** A block in flight through a pipelined chain, with its own buffers */
+typedef struct
+{
+  int64_t offset;    ///< Time in frames from the start of the render
+  uint32_t n_frames; ///< Number of frames in the block
+  float **bufs;      ///< Chain buffers, indexed by Port::buf_id
+  float **out;       ///< Output buffers of the chain, in channel order
+} PipeBlock;
+
+/** A graph node input that is the sum of several nodes' outputs */
+typedef struct
+{
+  float *dst;      ///< Input buffer the sum is written to
+  unsigned first;  ///< Index of the first source in LV2Apply::mix_srcs
+  unsigned n_srcs; ///< Number of sources
+} Mix;
+
+/** An activated instance kept ready by an InstancePool */
+typedef struct
+{
+  const LilvPlugin *plugin; ///< Plugin the instance is of
+  uint32_t sample_rate;     ///< Rate the instance was made for
+  LilvInstance *instance;   ///< Activated instance
+  PluginWorker *worker;     ///< Worker of the instance, or NULL
+} PooledInstance;
+
+/** Instances shared by the jobs of a batch, guarded by the batch lock */
 typedef struct
+{
+  LV2_URID_Map map;          ///< Map feature of every pooled instance
+  LV2_URID_Unmap unmap;      ///< Unmap feature of every pooled instance
+  LV2_Feature map_feature;
+  LV2_Feature unmap_feature;
+  PooledInstance *idle;      ///< Instances no job is using
+  unsigned n_idle;           ///< Number of idle instances
+  unsigned capacity;         ///< Most idle instances to keep
+  unsigned n_hits;           ///< Jobs that got an idle instance
+  unsigned n_misses;         ///< Jobs that had to instantiate
+  unsigned n_created;        ///< Instances made, ahead of time or on misses
+  double create_time;        ///< Time spent instantiating and activating
+  unsigned n_resets;         ///< Instances reset and kept on return
+  double reset_time;         ///< Time spent resetting returned instances
+} InstancePool;
+
+/** A phase of startup, timed by profile_startup() */
+typedef enum
+{
+  PHASE_WORLD_NEW,   ///< lilv_world_new()
+  PHASE_LOAD_WORLD,  ///< Parse bundle manifests, or the plugin index
+  PHASE_FIND_PLUGIN, ///< lilv_plugins_get_by_uri()
+  PHASE_PLUGIN_DATA, ///< Parse the plugin's own RDF data files
+  PHASE_PORTS,       ///< create_ports()
+  PHASE_FEATURES,    ///< init_features(), the URID map and any worker
+  PHASE_OPEN_OUTPUT, ///< Open an output file
+  PHASE_DLOPEN,      ///< Load the plugin binary
+  PHASE_INSTANTIATE, ///< lilv_plugin_instantiate(), without the dlopen()
+  PHASE_ACTIVATE,    ///< lilv_instance_activate()
+  PHASE_TEARDOWN,    ///< Free the instance and the world
+  N_PHASES
+} StartupPhase;
+
+/** Application state */
+typedef struct LV2ApplyImpl
 {
   LilvWorld *world;
   const LilvPlugin *plugin;
@@ -63,17 +232,100 @@ typedef struct
   const char *out_path;
   SNDFILE *in_file;
   SNDFILE *out_file;
+  uint32_t sample_rate;
+  unsigned n_in_channels;
+  unsigned n_out_channels;
   unsigned n_params;
   Param *params;
   unsigned n_ports;
   unsigned n_audio_in;
   unsigned n_audio_out;
   Port *ports;
+  uint32_t block_size; ///< Frames per lilv_instance_run() call
+  bool frame_mode;     ///< Run one interleaved frame at a time
+  int64_t n_frames;    ///< Total number of frames to render
+  Arena arena;         ///< Memory for every port buffer
+  bool print_layout;   ///< Print the arena layout after creating it
+  float **out_bufs;    ///< Planar buffer of each audio output, in order
+  PcmFormat format;    ///< Sample format of the output file
+  uint8_t *out_block;  ///< Interleaved PCM output block
+  float *frame_in;     ///< Interleaved input frame (frame mode)
+  float *frame_out;    ///< Interleaved output frame (frame mode)
+  uint32_t n_slots;    ///< Writer ring depth in blocks, 0 to write inline
+  BlockWriter *writer; ///< Asynchronous writer (owns out_file when set)
+  BlockReader *reader; ///< Read-ahead thread (owns in_file when set)
+  bool map_output;     ///< Write the output through a memory-mapped file
+  WavMap *wav_map;     ///< Mapped output file (instead of out_file)
+  bool raw_output;     ///< Write headerless PCM, to stdout if out_path is "-"
+  PcmStream *stream;   ///< Raw output stream (instead of out_file)
+  URIDMap *urid_map;
+  LV2_URID_Map map;
+  LV2_URID_Unmap unmap;
+  LV2_Feature map_feature;
+  LV2_Feature unmap_feature;
+  const LV2_Feature *features[4];
+  PluginWorker *worker;        ///< Worker, if the plugin uses one
+  bool active;                 ///< The instance is activated
+  InstancePool *pool;          ///< Ready instances shared by a batch
+  RunTimer *timer;             ///< Times every run, shared by all plugins
+  const char *timing_path;     ///< File to write the run timing to as JSON
+  bool count_perf;             ///< Count hardware events of every run
+  PerfTotals perf;             ///< Hardware event counts of this plugin
+  bool sync_worker;            ///< Do worker jobs in run(), deterministically
+  double preroll;              ///< Seconds to run before rendering
+  SnapshotCache *snapshots;    ///< Warm states shared by a batch
+  URIDs urids;
+  MidiEvent *events;           ///< Events to play, sorted by time
+  unsigned n_events;           ///< Number of events
+  unsigned next_event;         ///< Index of the next event to deliver
+  unsigned n_dropped_events;   ///< Events that did not fit an event buffer
+  Lane *lanes;                 ///< Automation of control ports
+  unsigned n_lanes;            ///< Number of automated control ports
+  int64_t next_change;         ///< Frame where an automated port changes
+  uint32_t buf_offset;         ///< Frame offset audio ports are connected at
+  uint8_t notes[MAX_NOTES];    ///< Notes to hold from the start
+  unsigned n_notes;            ///< Number of notes
+  const char *events_path;     ///< Event file to play, if any
+  char *job_line;              ///< Storage for the strings of a batch job
+  bool shared;                 ///< World and URID map are owned by a batch
+  bool quiet;                  ///< Do not print per-render statistics
+  pthread_mutex_t *lock;       ///< Serialises lilv calls in batch mode
+  struct LV2ApplyImpl *stages; ///< Plugins after this one in a chain
+  unsigned n_stages;           ///< Number of chained plugins
+  Arena chain_arena;           ///< Audio buffers of the chain or graph
+  struct LV2ApplyImpl *nodes;  ///< Plugins of a processing graph
+  unsigned n_nodes;            ///< Number of graph nodes
+  unsigned *edges;             ///< Graph connections, as (from, to) pairs
+  unsigned n_edges;            ///< Number of graph connections
+  Graph *graph;                ///< Schedule of the graph nodes
+  int64_t block_offset;        ///< Start of the block the graph is running
+  uint32_t block_frames;       ///< Length of the block the graph is running
+  const char *name;            ///< Name of a graph node
+  Mix *mixes;                  ///< Inputs summed from several graph nodes
+  unsigned n_mixes;            ///< Number of summed inputs
+  const float **mix_srcs;      ///< Source buffers of every mix, in order
+  unsigned n_pipe_groups;      ///< Threads to pipeline a chain over
+  unsigned n_pipe_blocks;      ///< Number of blocks in flight
+  PipeBlock *pipe_blocks;      ///< Blocks in flight through the pipeline
+  Pipeline *pipeline;          ///< Threads of a pipelined chain
+  Arena pipe_arena;            ///< Buffers of the blocks in flight
 } LV2Apply;
 
 static int
 fatal(LV2Apply *self, int status, const char *fmt, ...);
 
+static void
+pool_release(InstancePool *pool, LV2Apply *self);
+
+/** Return a monotonic timestamp in seconds. */
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
 /** Open a sound file with error handling. */
 static SNDFILE *
 sopen(LV2Apply *self, const char *path, int mode, SF_INFO *fmt)
@@ -99,13 +351,91 @@ sclose(const char *path, SNDFILE *file)
   }
 }
 
+/**
+   Take the lilv lock of a batch job, if it has one.
+
+   Lilv may lazily load plugin data and interns the nodes it makes in the
+   world, so the jobs of a batch take turns at every lilv call that is not
+   on an instance of their own.  The lock is recursive.
+*/
+static void
+lock_world(LV2Apply *self)
+{
+  if (self->lock)
+  {
+    pthread_mutex_lock(self->lock);
+  }
+}
+
+/** Release the lilv lock taken with lock_world(). */
+static void
+unlock_world(LV2Apply *self)
+{
+  if (self->lock)
+  {
+    pthread_mutex_unlock(self->lock);
+  }
+}
+
 /** Clean up all resources. */
 static int
 cleanup(int status, LV2Apply *self)
 {
+  graph_free(self->graph);
+  pipeline_free(self->pipeline);
+  block_writer_free(self->writer);
+  wav_map_free(self->wav_map);
+  pcm_stream_free(self->stream);
+  block_reader_free(self->reader);
   sclose(self->out_path, self->out_file);
+  sclose(self->in_path, self->in_file);
+  lock_world(self);
+
+  /* No work may run while the instance is deactivated or reset */
+  if (self->worker)
+  {
+    plugin_worker_finish(self->worker, NULL);
+  }
+  if (!status && self->pool && self->instance)
+  {
+    pool_release(self->pool, self);
+  }
+  if (self->instance && self->active)
+  {
+    lilv_instance_deactivate(self->instance);
+  }
+  plugin_worker_free(self->worker);
   lilv_instance_free(self->instance);
-  lilv_world_free(self->world);
+  unlock_world(self);
+  if (!self->shared)
+  {
+    lilv_world_free(self->world);
+    urid_map_free(self->urid_map);
+    run_timer_free(self->timer);
+  }
+  for (unsigned s = 0; s < self->n_stages; ++s)
+  {
+    cleanup(0, &self->stages[s]);
+  }
+  free(self->stages);
+  for (unsigned n = 0; n < self->n_nodes; ++n)
+  {
+    cleanup(0, &self->nodes[n]);
+  }
+  free(self->nodes);
+  free(self->edges);
+  free(self->mix_srcs);
+  free(self->mixes);
+  arena_free(&self->pipe_arena);
+  arena_free(&self->chain_arena);
+  arena_free(&self->arena);
+  free(self->job_line);
+  for (unsigned l = 0; l < self->n_lanes; ++l)
+  {
+    free(self->lanes[l].points);
+  }
+  free(self->lanes);
+  free(self->events);
   free(self->ports);
   free(self->params);
   return status;
@@ -124,13 +454,85 @@ fatal(LV2Apply *self, int status, const char *fmt, ...)
   return self ? cleanup(status, self) : status;
 }
 
+/** Return true if a plugin needs a worker for work:schedule. */
+static bool
+uses_worker(LilvWorld *world, const LilvPlugin *plugin)
+{
+  LilvNode *schedule = lilv_new_uri(world, LV2_WORKER__schedule);
+  LilvNode *iface = lilv_new_uri(world, LV2_WORKER__interface);
+  const bool uses = lilv_plugin_has_feature(plugin, schedule) ||
+                    lilv_plugin_has_extension_data(plugin, iface);
+  lilv_node_free(iface);
+  lilv_node_free(schedule);
+  return uses;
+}
+
+/** Set up the URID map and unmap features and map the host's URIDs. */
+static int
+init_features(LV2Apply *self)
+{
+  if (!self->urid_map && !(self->urid_map = urid_map_new(URID_MAP_CAPACITY)))
+  {
+    return fatal(self, 10, "Failed to allocate URID map\n");
+  }
+
+  self->map.handle = self->urid_map;
+  self->map.map = urid_map_uri;
+  self->unmap.handle = self->urid_map;
+  self->unmap.unmap = urid_unmap_uri;
+
+  self->map_feature.URI = LV2_URID__map;
+  self->map_feature.data = &self->map;
+  self->unmap_feature.URI = LV2_URID__unmap;
+  self->unmap_feature.data = &self->unmap;
+
+  self->features[0] = &self->map_feature;
+  self->features[1] = &self->unmap_feature;
+  self->features[2] = NULL;
+  self->features[3] = NULL;
+
+  /* Plugins that schedule work get a worker of their own, or a pooled one */
+  if (self->plugin && !self->worker && !self->pool)
+  {
+    lock_world(self);
+    const bool needs_worker = uses_worker(self->world, self->plugin);
+    unlock_world(self);
+    if (needs_worker &&
+        !(self->worker =
+              plugin_worker_new(WORKER_RING_SIZE, !self->sync_worker)))
+    {
+      return fatal(self, 10, "Failed to start worker\n");
+    }
+  }
+  if (self->worker)
+  {
+    self->features[2] = plugin_worker_feature(self->worker);
+  }
+
+  self->urids.atom_Chunk = urid_map_uri(self->urid_map, LV2_ATOM__Chunk);
+  self->urids.atom_Sequence = urid_map_uri(self->urid_map, LV2_ATOM__Sequence);
+  self->urids.midi_MidiEvent =
+      urid_map_uri(self->urid_map, LV2_MIDI__MidiEvent);
+  return 0;
+}
+
+/** Return the graph node name of a plugin, or its URI. */
+static const char *
+plugin_name(const LV2Apply *self)
+{
+  return self->name ? self->name
+                    : lilv_node_as_string(lilv_plugin_get_uri(self->plugin));
+}
+
 /**
    Create port structures from data (via create_port()) for all ports.
 */
 static int
 create_ports(LV2Apply *self)
 {
+  const uint64_t t0 = trace_begin();
   LilvWorld *world = self->world;
+  lock_world(self);
   const uint32_t n_ports = lilv_plugin_get_num_ports(self->plugin);
 
   self->n_ports = n_ports;
@@ -144,8 +546,12 @@ create_ports(LV2Apply *self)
   LilvNode *lv2_OutputPort = lilv_new_uri(world, LV2_CORE__OutputPort);
   LilvNode *lv2_AudioPort = lilv_new_uri(world, LV2_CORE__AudioPort);
   LilvNode *lv2_ControlPort = lilv_new_uri(world, LV2_CORE__ControlPort);
+  LilvNode *lv2_CVPort = lilv_new_uri(world, LV2_CORE__CVPort);
   LilvNode *lv2_connectionOptional =
       lilv_new_uri(world, LV2_CORE__connectionOptional);
+  LilvNode *atom_AtomPort = lilv_new_uri(world, LV2_ATOM__AtomPort);
+  LilvNode *midi_MidiEvent = lilv_new_uri(world, LV2_MIDI__MidiEvent);
+  LilvNode *rsz_minimumSize = lilv_new_uri(world, LV2_RESIZE_PORT__minimumSize);
 
   for (uint32_t i = 0; i < n_ports; ++i)
   {
@@ -166,6 +572,7 @@ create_ports(LV2Apply *self)
     else if (!lilv_port_is_a(self->plugin, lport, lv2_OutputPort) &&
              !port->optional)
     {
+      unlock_world(self);
       return fatal(self, 1, "Port %u is neither input nor output\n", i);
     }
 
@@ -186,155 +593,3644 @@ create_ports(LV2Apply *self)
         ++self->n_audio_out;
       }
     }
-    // else if (!port->optional)
-    // {
-    //   return fatal(self, 1, "Port %u has unsupported type\n", i);
-    // }
+    else if (lilv_port_is_a(self->plugin, lport, lv2_CVPort))
+    {
+      port->type = TYPE_CV;
+    }
+    else if (lilv_port_is_a(self->plugin, lport, atom_AtomPort))
+    {
+      port->type = TYPE_EVENT;
+      port->supports_midi =
+          lilv_port_supports_event(self->plugin, lport, midi_MidiEvent);
+      port->buf_size = DEFAULT_EVBUF_SIZE;
+
+      LilvNode *min_size = lilv_port_get(self->plugin, lport, rsz_minimumSize);
+      if (min_size && lilv_node_is_int(min_size) &&
+          lilv_node_as_int(min_size) > (int)port->buf_size)
+      {
+        port->buf_size = (uint32_t)lilv_node_as_int(min_size);
+      }
+      lilv_node_free(min_size);
+    }
+    else
+    {
+      port->type = TYPE_UNSUPPORTED;
+    }
   }
 
+  lilv_node_free(rsz_minimumSize);
+  lilv_node_free(midi_MidiEvent);
+  lilv_node_free(atom_AtomPort);
   lilv_node_free(lv2_connectionOptional);
+  lilv_node_free(lv2_CVPort);
   lilv_node_free(lv2_ControlPort);
   lilv_node_free(lv2_AudioPort);
   lilv_node_free(lv2_OutputPort);
   lilv_node_free(lv2_InputPort);
+  unlock_world(self);
   free(values);
 
+  trace_end(t0, "create ports", plugin_name(self));
   return 0;
 }
 
-// void note(LV2_Atom_Sequence *output_midi, bool on = true)
-// {
-//   LV2_Atom_Event event;
-//   event.time.frames = 0; // frame;
-//   event.body.type = 0;   // urids.midi_MidiEvent;
-//   event.body.size = 3;
+/** Return the symbol of a port, for reports. */
+static const char *
+port_symbol(const LV2Apply *self, const Port *port)
+{
+  const LilvNode *sym = lilv_port_get_symbol(self->plugin, port->lilv_port);
+  return lilv_node_as_string(sym);
+}
+
+/**
+   Allocate every port buffer from a single arena.
+
+   This is done once after create_ports(), and every buffer gets its own
+   cache-line aligned region, so nothing is allocated after activation and
+   no two ports share a cache line.  Audio and CV ports get a planar buffer
+   of block_size frames, control ports a single float initialised to the
+   default, and atom ports an event buffer.
+*/
+static int
+create_arena(LV2Apply *self)
+{
+  const size_t block_bytes = (size_t)self->block_size * sizeof(float);
+  const uint32_t n_out = self->n_audio_out ? self->n_audio_out : 1;
+  const uint32_t n_in = self->n_audio_in ? self->n_audio_in : 1;
 
-//   uint8_t *msg = (uint8_t *)LV2_ATOM_BODY(&event.body);
+  size_t size = arena_round(n_out * sizeof(float *)) +
+                arena_round(block_bytes * n_out) +
+                arena_round(n_in * sizeof(float)) +
+                arena_round(n_out * sizeof(float));
+  for (uint32_t p = 0; p < self->n_ports; ++p)
+  {
+    const Port *port = &self->ports[p];
+    if (port->type == TYPE_CONTROL)
+    {
+      size += arena_round(sizeof(float));
+    }
+    else if (port->type == TYPE_AUDIO || port->type == TYPE_CV)
+    {
+      size += arena_round(block_bytes);
+    }
+    else if (port->type == TYPE_EVENT)
+    {
+      size += arena_round(lv2_evbuf_footprint(port->buf_size));
+    }
+  }
 
-//   msg[0] = on ? LV2_MIDI_MSG_NOTE_ON : LV2_MIDI_MSG_NOTE_OFF;
-//   msg[1] = 60; // plugin->last_midi_note;
-//   msg[2] = 128;
+  Arena *arena = &self->arena;
+  if (arena_init(arena, size, self->n_ports + 4))
+  {
+    return fatal(self, 10, "Failed to allocate %zu byte arena\n", size);
+  }
 
-//   // uint32_t capacity = output_midi->atom.size;
-//   uint32_t capacity = 1;
-//   lv2_atom_sequence_append_event(output_midi, capacity, &event);
-// }
+  if (!arena->locked && !self->quiet)
+  {
+    fprintf(stderr, "warning: Failed to lock %zu byte arena\n", size);
+  }
 
-int main(int argc, char **argv)
+  /* Every allocation fits, since the arena was sized for exactly these */
+  self->out_bufs =
+      (float **)arena_alloc(arena, n_out * sizeof(float *), "ptrs", "out_bufs");
+  for (uint32_t p = 0, o = 0; p < self->n_ports; ++p)
+  {
+    Port *port = &self->ports[p];
+    const char *sym = port_symbol(self, port);
+    if (port->type == TYPE_CONTROL)
+    {
+      port->control =
+          (float *)arena_alloc(arena, sizeof(float), "control", sym);
+      *port->control = port->value;
+    }
+    else if (port->type == TYPE_AUDIO || port->type == TYPE_CV)
+    {
+      port->buf = (float *)arena_alloc(
+          arena, block_bytes, port->type == TYPE_AUDIO ? "audio" : "cv", sym);
+      if (port->type == TYPE_AUDIO && !port->is_input)
+      {
+        self->out_bufs[o++] = port->buf;
+      }
+    }
+    else if (port->type == TYPE_EVENT)
+    {
+      port->evbuf =
+          lv2_evbuf_init(arena_alloc(arena,
+                                     lv2_evbuf_footprint(port->buf_size),
+                                     "atom",
+                                     sym),
+                         port->buf_size,
+                         self->urids.atom_Chunk,
+                         self->urids.atom_Sequence);
+    }
+  }
+  self->out_block = (uint8_t *)arena_alloc(
+      arena, block_bytes * n_out, "block", "interleaved output");
+  self->frame_in = (float *)arena_alloc(
+      arena, n_in * sizeof(float), "frame", "interleaved input");
+  self->frame_out = (float *)arena_alloc(
+      arena, n_out * sizeof(float), "frame", "interleaved output");
+
+  if (self->print_layout)
+  {
+    arena_print_layout(arena, stderr);
+  }
+
+  return 0;
+}
+
+/** Attach a worker to the instance it does work for. */
+static void
+attach_worker(PluginWorker *worker, LilvInstance *instance)
 {
-  LV2Apply self = {NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, 0, 0, 0, NULL};
+  plugin_worker_attach(
+      worker,
+      lilv_instance_get_handle(instance),
+      (const LV2_Worker_Interface *)lilv_instance_get_extension_data(
+          instance, LV2_WORKER__interface));
+}
 
-  /* Parse command line arguments */
-  const char *plugin_uri = NULL;
-  self.out_path = "out.wav";
-  plugin_uri = "http://tytel.org/helm";
+/** Set up the features of a pool, which map URIs with `urid_map`. */
+static void
+pool_init(InstancePool *pool, URIDMap *urid_map, unsigned capacity)
+{
+  memset(pool, 0, sizeof(InstancePool));
+  pool->map.handle = urid_map;
+  pool->map.map = urid_map_uri;
+  pool->unmap.handle = urid_map;
+  pool->unmap.unmap = urid_unmap_uri;
+  pool->map_feature.URI = LV2_URID__map;
+  pool->map_feature.data = &pool->map;
+  pool->unmap_feature.URI = LV2_URID__unmap;
+  pool->unmap_feature.data = &pool->unmap;
+  pool->capacity = capacity;
+}
 
-  /* Create world and plugin URI */
-  self.world = lilv_world_new();
-  LilvNode *uri = lilv_new_uri(self.world, plugin_uri);
-  if (!uri)
+/**
+   Make an activated instance of the plugin of `job` for the pool.
+
+   The instance gets the pool's own features and a worker of its own if it
+   needs one, so it does not depend on any job and can move between them.
+*/
+static bool
+pool_create(InstancePool *pool, const LV2Apply *job, PooledInstance *entry)
+{
+  const double start = now();
+  entry->plugin = job->plugin;
+  entry->sample_rate = job->sample_rate;
+  entry->worker = NULL;
+  if (uses_worker(job->world, job->plugin) &&
+      !(entry->worker = plugin_worker_new(WORKER_RING_SIZE, !job->sync_worker)))
   {
-    return fatal(&self, 2, "Invalid plugin URI <%s>\n", plugin_uri);
+    return false;
   }
 
-  /* Discover world */
-  lilv_world_load_all(self.world);
+  const LV2_Feature *features[4] = {
+      &pool->map_feature,
+      &pool->unmap_feature,
+      entry->worker ? plugin_worker_feature(entry->worker) : NULL,
+      NULL};
+  if (!(entry->instance = lilv_plugin_instantiate(
+            entry->plugin, entry->sample_rate, features)))
+  {
+    plugin_worker_free(entry->worker);
+    return false;
+  }
+  if (entry->worker)
+  {
+    attach_worker(entry->worker, entry->instance);
+  }
 
-  /* Get plugin */
-  const LilvPlugins *plugins = lilv_world_get_all_plugins(self.world);
-  const LilvPlugin *plugin = lilv_plugins_get_by_uri(plugins, uri);
-  lilv_node_free(uri);
-  if (!(self.plugin = plugin))
+  lilv_instance_activate(entry->instance);
+  ++pool->n_created;
+  pool->create_time += now() - start;
+  return true;
+}
+
+/** Deactivate and free an instance that leaves the pool for good. */
+static void
+pool_destroy(PooledInstance *entry)
+{
+  if (entry->worker)
   {
-    return fatal(&self, 3, "Plugin <%s> not found\n", plugin_uri);
+    plugin_worker_finish(entry->worker, NULL);
   }
+  lilv_instance_deactivate(entry->instance);
+  plugin_worker_free(entry->worker);
+  lilv_instance_free(entry->instance);
+}
 
-  /* Create port structures */
-  if (create_ports(&self))
+/** Make instances for the first jobs ahead of time, up to the capacity. */
+static void
+pool_fill(InstancePool *pool, const LV2Apply *jobs, unsigned n_jobs)
+{
+  PooledInstance *idle =
+      (PooledInstance *)calloc(pool->capacity, sizeof(PooledInstance));
+  if (!idle)
   {
-    return 5;
+    return;
   }
 
-  /* Set control values */
-  for (unsigned i = 0; i < self.n_params; ++i)
+  pool->idle = idle;
+  for (unsigned i = 0; i < n_jobs && pool->n_idle < pool->capacity; ++i)
   {
-    const Param *param = &self.params[i];
-    LilvNode *sym = lilv_new_string(self.world, param->sym);
-    const LilvPort *port = lilv_plugin_get_port_by_symbol(plugin, sym);
-    lilv_node_free(sym);
-    if (!port)
+    if (pool_create(pool, &jobs[i], &pool->idle[pool->n_idle]))
     {
-      return fatal(&self, 7, "Unknown port `%s'\n", param->sym);
+      ++pool->n_idle;
     }
+  }
+}
+
+/**
+   Give a job an activated instance from the pool, making one on a miss.
 
-    self.ports[lilv_port_get_index(plugin, port)].value = param->value;
+   The job takes over the instance's worker, which starts afresh without
+   any work or responses of the previous job, and its instance is already
+   active, so set_active() will not activate it again.
+*/
+static bool
+pool_acquire(InstancePool *pool, LV2Apply *self)
+{
+  PooledInstance entry;
+  unsigned i = 0;
+  while (i < pool->n_idle && (pool->idle[i].plugin != self->plugin ||
+                              pool->idle[i].sample_rate != self->sample_rate))
+  {
+    ++i;
   }
 
-  /* Open output file */
-  SF_INFO out_fmt = {0, 0, 0, 0, 0, 0};
-  out_fmt.format = (SF_FORMAT_WAV | SF_FORMAT_PCM_24);
-  out_fmt.samplerate = SAMPLE_RATE;
-  out_fmt.frames = (SAMPLE_RATE * 4); /* 4 seconds */
-  out_fmt.channels = self.n_audio_out;
-  if (!(self.out_file = sopen(&self, self.out_path, SFM_WRITE, &out_fmt)))
+  if (i < pool->n_idle)
   {
-    free(self.ports);
-    return 8;
+    entry = pool->idle[i];
+    pool->idle[i] = pool->idle[--pool->n_idle];
+    ++pool->n_hits;
+    if (entry.worker && plugin_worker_reset(entry.worker))
+    {
+      pool_destroy(&entry);
+      return false;
+    }
   }
+  else
+  {
+    ++pool->n_misses;
+    if (!pool_create(pool, self, &entry))
+    {
+      return false;
+    }
+  }
+
+  self->instance = entry.instance;
+  self->worker = entry.worker;
+  self->features[2] = entry.worker ? plugin_worker_feature(entry.worker) : NULL;
+  self->active = true;
+  return true;
+}
+
+/**
+   Reset the instance of a finished job and keep it for another job.
+
+   The reset deactivates and activates the instance again, which the LV2
+   specification defines as resetting it to its initial state.  Its worker
+   has already been stopped by cleanup(), and is started again by
+   pool_acquire().  If the pool is full, the instance is left to the job,
+   which frees it.
+*/
+static void
+pool_release(InstancePool *pool, LV2Apply *self)
+{
+  if (!pool->idle || pool->n_idle == pool->capacity)
+  {
+    return;
+  }
+
+  const double start = now();
+  if (self->active)
+  {
+    lilv_instance_deactivate(self->instance);
+  }
+  lilv_instance_activate(self->instance);
+  pool->reset_time += now() - start;
+  ++pool->n_resets;
+
+  PooledInstance *entry = &pool->idle[pool->n_idle++];
+  entry->plugin = self->plugin;
+  entry->sample_rate = self->sample_rate;
+  entry->instance = self->instance;
+  entry->worker = self->worker;
+  self->instance = NULL;
+  self->worker = NULL;
+  self->active = false;
+}
+
+/**
+   Instantiate the plugin, and attach its worker if it has one.
+
+   A batch job with a pool takes an instance from it instead.
+*/
+static bool
+instantiate(LV2Apply *self)
+{
+  const uint64_t t0 = trace_begin();
+  lock_world(self);
+  if (self->pool)
+  {
+    const bool acquired = pool_acquire(self->pool, self);
+    unlock_world(self);
+    trace_end(t0, "take pooled instance", plugin_name(self));
+    return acquired;
+  }
+
+  self->instance =
+      lilv_plugin_instantiate(self->plugin, self->sample_rate, self->features);
+  unlock_world(self);
+  if (self->instance && self->worker)
+  {
+    attach_worker(self->worker, self->instance);
+  }
+
+  trace_end(t0, "instantiate", plugin_name(self));
+  return self->instance;
+}
 
-  /* Instantiate plugin and connect ports */
-  const uint32_t n_ports = lilv_plugin_get_num_ports(plugin);
-  float in_buf[self.n_audio_in > 0 ? self.n_audio_in : 1];
-  float out_buf[self.n_audio_out > 0 ? self.n_audio_out : 1];
-  self.instance = lilv_plugin_instantiate(self.plugin, SAMPLE_RATE, NULL);
-  for (uint32_t p = 0, i = 0, o = 0; p < n_ports; ++p)
+/** Connect every control, CV and event port, and NULL to unsupported ones. */
+static void
+connect_control_ports(LV2Apply *self)
+{
+  for (uint32_t p = 0; p < self->n_ports; ++p)
   {
-    if (self.ports[p].type == TYPE_CONTROL)
+    Port *port = &self->ports[p];
+    if (port->type == TYPE_CONTROL)
     {
-      lilv_instance_connect_port(self.instance, p, &self.ports[p].value);
+      lilv_instance_connect_port(self->instance, p, port->control);
     }
-    else if (self.ports[p].type == TYPE_AUDIO)
+    else if (port->type == TYPE_CV)
     {
-      if (self.ports[p].is_input)
-      {
-        lilv_instance_connect_port(self.instance, p, in_buf + i++);
-      }
-      else
-      {
-        lilv_instance_connect_port(self.instance, p, out_buf + o++);
-      }
+      lilv_instance_connect_port(self->instance, p, port->buf);
     }
-    else
+    else if (port->type == TYPE_EVENT)
+    {
+      lilv_instance_connect_port(
+          self->instance, p, lv2_evbuf_get_buffer(port->evbuf));
+    }
+    else if (port->type == TYPE_UNSUPPORTED)
     {
-      lilv_instance_connect_port(self.instance, p, NULL);
+      lilv_instance_connect_port(self->instance, p, NULL);
     }
   }
+}
 
-// maybe https://github.com/lv2/lilv/issues/26
-// https://github.com/drobilla/jalv/blob/master/src/lv2_evbuf.c#L154
-
-  // LV2_Atom_Sequence *output_midi;
-  // lilv_instance_connect_port(self.instance, 0, &output_midi);
-  // printf("output_midi  atom size: %d\n", output_midi->atom.size); 
+/**
+   Prepare event buffers for a run of n_frames starting at `offset`.
 
-  /* Ports are now connected to buffers in interleaved format, so we can run
-     a single frame at a time and avoid having to interleave buffers to
-     read/write from/to sndfile. */
+   Every pending event in the block is written to all MIDI input ports,
+   stamped with its frame offset within the block.  Output buffers are reset
+   to their full capacity for the plugin to write to.
+*/
+static void
+fill_event_buffers(LV2Apply *self, int64_t offset, uint32_t n_frames)
+{
+  const unsigned first_event = self->next_event;
+  unsigned end_event = first_event;
+  while (end_event < self->n_events &&
+         self->events[end_event].frame < offset + n_frames)
+  {
+    ++end_event;
+  }
 
-  lilv_instance_activate(self.instance);
+  for (uint32_t p = 0; p < self->n_ports; ++p)
+  {
+    Port *port = &self->ports[p];
+    if (port->type != TYPE_EVENT)
+    {
+      continue;
+    }
 
-  // note(output_midi, true);
+    lv2_evbuf_reset(port->evbuf, port->is_input);
+    if (!port->is_input || !port->supports_midi)
+    {
+      continue;
+    }
 
-  // 1000 samples
-  for (int64_t i = 0; i < out_fmt.frames; ++i)
-  {
-    lilv_instance_run(self.instance, 1);
-    if (sf_writef_float(self.out_file, out_buf, 1) != 1)
+    LV2_Evbuf_Iterator iter = lv2_evbuf_begin(port->evbuf);
+    for (unsigned e = first_event; e < end_event; ++e)
     {
-      return fatal(&self, 9, "Failed to write to output file\n");
+      const MidiEvent *ev = &self->events[e];
+      const int64_t frame = ev->frame > offset ? ev->frame - offset : 0;
+      if (!lv2_evbuf_write(&iter,
+                           (uint32_t)frame,
+                           0,
+                           self->urids.midi_MidiEvent,
+                           sizeof(ev->msg),
+                           ev->msg))
+      {
+        /* Reported after the render, printing here could block */
+        self->n_dropped_events += end_event - e;
+        break;
+      }
     }
   }
-  lilv_instance_deactivate(self.instance);
 
-  return cleanup(0, &self);
+  self->next_event = end_event;
+}
+
+/** Append a MIDI event, events are sorted later by sort_events(). */
+static int
+add_midi_event(LV2Apply *self, int64_t frame, const uint8_t msg[3])
+{
+  MidiEvent *events = (MidiEvent *)realloc(
+      self->events, (self->n_events + 1) * sizeof(MidiEvent));
+  if (!events)
+  {
+    return fatal(self, 10, "Failed to allocate events\n");
+  }
+
+  MidiEvent *ev = &(self->events = events)[self->n_events++];
+  ev->frame = frame;
+  memcpy(ev->msg, msg, sizeof(ev->msg));
+  return 0;
+}
+
+/**
+   Append a breakpoint to the automation lane of a control port.
+
+   Breakpoints are sorted later by sort_events().
+*/
+static int
+add_breakpoint(
+    LV2Apply *self, int64_t frame, uint32_t port, float value, Curve curve)
+{
+  unsigned l = 0;
+  while (l < self->n_lanes && self->lanes[l].port != port)
+  {
+    ++l;
+  }
+
+  if (l == self->n_lanes)
+  {
+    Lane *lanes =
+        (Lane *)realloc(self->lanes, (self->n_lanes + 1) * sizeof(Lane));
+    if (!lanes)
+    {
+      return fatal(self, 10, "Failed to allocate events\n");
+    }
+
+    memset(&lanes[l], 0, sizeof(Lane));
+    lanes[l].port = port;
+    self->lanes = lanes;
+    ++self->n_lanes;
+  }
+
+  Lane *lane = &self->lanes[l];
+  Breakpoint *points = (Breakpoint *)realloc(
+      lane->points, (lane->n_points + 1) * sizeof(Breakpoint));
+  if (!points)
+  {
+    return fatal(self, 10, "Failed to allocate events\n");
+  }
+
+  Breakpoint *point = &(lane->points = points)[lane->n_points++];
+  point->frame = frame;
+  point->value = value;
+  point->curve = curve;
+  return 0;
+}
+
+/** Sort all events by time, keeping the given order of simultaneous ones. */
+static void
+sort_events(LV2Apply *self)
+{
+  std::stable_sort(self->events,
+                   self->events + self->n_events,
+                   [](const MidiEvent &a, const MidiEvent &b)
+                   { return a.frame < b.frame; });
+  for (unsigned l = 0; l < self->n_lanes; ++l)
+  {
+    Lane *lane = &self->lanes[l];
+    std::stable_sort(lane->points,
+                     lane->points + lane->n_points,
+                     [](const Breakpoint &a, const Breakpoint &b)
+                     { return a.frame < b.frame; });
+  }
+}
+
+/**
+   Schedule each note to be played from the start of the render and released
+   halfway through.
+*/
+static int
+create_note_events(LV2Apply *self, const uint8_t *notes, unsigned n_notes)
+{
+  for (unsigned i = 0; i < n_notes; ++i)
+  {
+    const uint8_t on[3] = {LV2_MIDI_MSG_NOTE_ON, notes[i], 100};
+    const uint8_t off[3] = {LV2_MIDI_MSG_NOTE_OFF, notes[i], 0};
+    if (add_midi_event(self, 0, on) ||
+        add_midi_event(self, self->n_frames / 2, off))
+    {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/** Parse an event time, in frames or in seconds with an "s" suffix. */
+static bool
+parse_time(const char *str, uint32_t sample_rate, int64_t *frame)
+{
+  char *end = NULL;
+  const double t = strtod(str, &end);
+  if (end == str || t < 0.0)
+  {
+    return false;
+  }
+
+  if (*end == 's' && !end[1])
+  {
+    *frame = (int64_t)llround(t * sample_rate);
+    return true;
+  }
+
+  *frame = (int64_t)t;
+  return !*end && (double)*frame == t;
+}
+
+/**
+   Load a time-stamped event stream from a text file.
+
+   Each line is a time, in frames or in seconds with an "s" suffix, followed
+   by one event:
+
+     TIME note NOTE VELOCITY     Note on (velocity 0 is a note off)
+     TIME off NOTE               Note off
+     TIME midi STATUS DATA DATA  Raw 3-byte MIDI message
+     TIME set SYMBOL VALUE       Set a control input port
+     TIME ramp SYMBOL VALUE [exp]
+                                 Ramp a control input port from its last
+                                 value, linearly or exponentially, to reach
+                                 VALUE at TIME
+
+   Blank lines and lines starting with '#' are ignored.  Events may be in any
+   order.
+*/
+static int
+load_events(LV2Apply *self, const char *path)
+{
+  FILE *fd = fopen(path, "r");
+  if (!fd)
+  {
+    return fatal(self, 11, "Failed to open event file %s\n", path);
+  }
+
+  char line[1024];
+  for (unsigned l = 1; fgets(line, sizeof(line), fd); ++l)
+  {
+    char time[64];
+    char kind[16];
+    char arg[256];
+    char val[64];
+    char val2[64];
+    const int n = sscanf(line, " %63s %15s %255s %63s %63s",
+                         time, kind, arg, val, val2);
+    if (n <= 0 || time[0] == '#')
+    {
+      continue;
+    }
+
+    int64_t frame = 0;
+    uint8_t msg[3] = {0, 0, 0};
+    int st = 0;
+    if (n < 3 || !parse_time(time, self->sample_rate, &frame))
+    {
+      st = -1;
+    }
+    else if (!strcmp(kind, "note") && n >= 4)
+    {
+      msg[0] = LV2_MIDI_MSG_NOTE_ON;
+      msg[1] = (uint8_t)(strtol(arg, NULL, 0) & 0x7F);
+      msg[2] = (uint8_t)(strtol(val, NULL, 0) & 0x7F);
+      st = add_midi_event(self, frame, msg);
+    }
+    else if (!strcmp(kind, "off"))
+    {
+      msg[0] = LV2_MIDI_MSG_NOTE_OFF;
+      msg[1] = (uint8_t)(strtol(arg, NULL, 0) & 0x7F);
+      st = add_midi_event(self, frame, msg);
+    }
+    else if (!strcmp(kind, "midi") && n == 5)
+    {
+      msg[0] = (uint8_t)strtol(arg, NULL, 0);
+      msg[1] = (uint8_t)(strtol(val, NULL, 0) & 0x7F);
+      msg[2] = (uint8_t)(strtol(val2, NULL, 0) & 0x7F);
+      st = add_midi_event(self, frame, msg);
+    }
+    else if ((!strcmp(kind, "set") || !strcmp(kind, "ramp")) && n >= 4)
+    {
+      lock_world(self);
+      LilvNode *sym = lilv_new_string(self->world, arg);
+      const LilvPort *port = lilv_plugin_get_port_by_symbol(self->plugin, sym);
+      lilv_node_free(sym);
+      unlock_world(self);
+
+      const uint32_t index = port ? lilv_port_get_index(self->plugin, port) : 0;
+      if (!port || self->ports[index].type != TYPE_CONTROL ||
+          !self->ports[index].is_input)
+      {
+        fclose(fd);
+        return fatal(self, 7, "%s:%u: Unknown control port `%s'\n",
+                     path, l, arg);
+      }
+      const Curve curve = kind[0] == 's'              ? CURVE_STEP
+                          : n == 5 && !strcmp(val2, "exp") ? CURVE_EXPONENTIAL
+                                                           : CURVE_LINEAR;
+      st = add_breakpoint(self, frame, index, (float)atof(val), curve);
+    }
+    else
+    {
+      st = -1;
+    }
+
+    if (st)
+    {
+      fclose(fd);
+      return st > 0 ? st : fatal(self, 11, "%s:%u: Invalid event\n", path, l);
+    }
+  }
+
+  fclose(fd);
+  return 0;
+}
+
+/** Start every automation lane from the value its port has now. */
+static void
+start_lanes(LV2Apply *self)
+{
+  for (unsigned l = 0; l < self->n_lanes; ++l)
+  {
+    Lane *lane = &self->lanes[l];
+    lane->next = 0;
+    lane->start.frame = 0;
+    lane->start.value = *self->ports[lane->port].control;
+    lane->start.curve = CURVE_STEP;
+    lane->next_frame = 0;
+  }
+
+  self->next_change = self->n_lanes ? 0 : INT64_MAX;
+}
+
+/** Return the value of a ramp from `from` to `to` at `frame`. */
+static float
+ramp_value(const Breakpoint *from, const Breakpoint *to, int64_t frame)
+{
+  const double t =
+      (double)(frame - from->frame) / (double)(to->frame - from->frame);
+  if (to->curve == CURVE_EXPONENTIAL && from->value * to->value > 0.0f)
+  {
+    return (float)(from->value * pow(to->value / from->value, t));
+  }
+
+  return (float)(from->value + (to->value - from->value) * t);
+}
+
+/**
+   Set every automated port that changes at `frame` to its value there.
+
+   A lane is only touched when it changes: at a breakpoint, or every
+   RAMP_STEP frames during a ramp, which holds the value of its first frame
+   for that long.  The earliest next change of any lane is kept in
+   next_change, so blocks without automation pay for a single comparison.
+*/
+static void
+update_lanes(LV2Apply *self, int64_t frame)
+{
+  int64_t next_change = INT64_MAX;
+  for (unsigned l = 0; l < self->n_lanes; ++l)
+  {
+    Lane *lane = &self->lanes[l];
+    if (lane->next_frame <= frame)
+    {
+      while (lane->next < lane->n_points &&
+             lane->points[lane->next].frame <= frame)
+      {
+        lane->start = lane->points[lane->next++];
+      }
+
+      const Breakpoint *end =
+          lane->next < lane->n_points ? &lane->points[lane->next] : NULL;
+      float *control = self->ports[lane->port].control;
+      if (end && end->curve != CURVE_STEP)
+      {
+        *control = ramp_value(&lane->start, end, frame);
+        lane->next_frame = std::min(end->frame, frame + RAMP_STEP);
+      }
+      else
+      {
+        *control = lane->start.value;
+        lane->next_frame = end ? end->frame : INT64_MAX;
+      }
+    }
+
+    next_change = std::min(next_change, lane->next_frame);
+  }
+
+  self->next_change = next_change;
+}
+
+/** Connect every port to its own planar buffer in the arena. */
+static void
+connect_block_buffers(LV2Apply *self)
+{
+  connect_control_ports(self);
+  for (uint32_t p = 0; p < self->n_ports; ++p)
+  {
+    const Port *port = &self->ports[p];
+    if (port->type == TYPE_AUDIO)
+    {
+      lilv_instance_connect_port(self->instance, p, port->buf);
+    }
+  }
+}
+
+/** Connect every audio port to its planar buffer at a frame offset. */
+static void
+connect_audio_at(LV2Apply *self, uint32_t frame_offset)
+{
+  for (uint32_t p = 0; p < self->n_ports; ++p)
+  {
+    const Port *port = &self->ports[p];
+    if (port->type == TYPE_AUDIO)
+    {
+      lilv_instance_connect_port(
+          self->instance, p, port->buf + frame_offset);
+    }
+  }
+
+  self->buf_offset = frame_offset;
+}
+
+/**
+   Connect the audio inputs to the next block from the reader.
+
+   File channels go to the input ports in order, and repeat if the plugin has
+   more inputs than the file has channels, so a mono file feeds both sides of
+   a stereo effect.  Past the end of the file, the blocks are silent.
+*/
+static int
+connect_input_block(LV2Apply *self)
+{
+  uint32_t n_read = 0;
+  const float *const *in = block_reader_acquire(self->reader, &n_read);
+  if (!in)
+  {
+    return 1;
+  }
+
+  for (uint32_t p = 0, i = 0; p < self->n_ports; ++p)
+  {
+    Port *port = &self->ports[p];
+    if (port->type == TYPE_AUDIO && port->is_input)
+    {
+      port->buf = (float *)in[i++ % self->n_in_channels];
+    }
+  }
+
+  connect_audio_at(self, 0);
+  return 0;
+}
+
+/**
+   Run the plugin once for n_frames.
+
+   Worker responses are delivered first, so work scheduled in one run is
+   answered at the start of a later one.
+*/
+static void
+run_instance(LV2Apply *self, uint32_t n_frames)
+{
+  if (self->worker)
+  {
+    plugin_worker_emit_responses(self->worker);
+  }
+
+  PerfSample counts;
+  const bool counted = self->count_perf && perf_sample(&counts);
+  const uint64_t t0 = trace_begin();
+  if (self->timer)
+  {
+    const RunStamp start = run_timer_stamp();
+    lilv_instance_run(self->instance, n_frames);
+    run_timer_record(self->timer, &start, n_frames, self->sample_rate);
+  }
+  else
+  {
+    lilv_instance_run(self->instance, n_frames);
+  }
+  trace_end(t0, "run", t0 ? plugin_name(self) : NULL);
+  if (counted)
+  {
+    perf_count(&self->perf, &counts);
+  }
+
+  if (self->worker)
+  {
+    plugin_worker_end_run(self->worker);
+  }
+}
+
+/**
+   Run the plugin for one block of n_frames starting at `offset`.
+
+   MIDI events are delivered at their exact frame through the atom sequence
+   timestamps, so they never split the block.  A control change can only take
+   effect between runs, so the block is split at every frame where an
+   automated port changes, see update_lanes(), with the audio ports
+   reconnected to the remainder of the buffers.
+*/
+static void
+run_block(LV2Apply *self, int64_t offset, uint32_t n_frames)
+{
+  uint32_t done = 0;
+  while (done < n_frames)
+  {
+    const int64_t frame = offset + done;
+    if (frame >= self->next_change)
+    {
+      update_lanes(self, frame);
+    }
+
+    uint32_t n = n_frames - done;
+    if (self->next_change < offset + n_frames)
+    {
+      n = (uint32_t)(self->next_change - frame);
+    }
+
+    if (self->buf_offset != done)
+    {
+      connect_audio_at(self, done);
+    }
+
+    fill_event_buffers(self, offset + done, n);
+    run_instance(self, n);
+    done += n;
+  }
+}
+
+/**
+   Run every chained plugin after this one for the same block.
+
+   They have no events of their own, and their audio ports are always
+   connected to the start of the chain buffers, see assign_chain_buffers().
+*/
+static void
+run_chain(LV2Apply *self, int64_t offset, uint32_t n_frames)
+{
+  for (unsigned s = 0; s < self->n_stages; ++s)
+  {
+    LV2Apply *stage = &self->stages[s];
+    fill_event_buffers(stage, offset, n_frames);
+    run_instance(stage, n_frames);
+  }
+}
+
+/** Sum the sources of every input that is fed by several graph nodes. */
+static void
+mix_inputs(const LV2Apply *self, uint32_t n_frames)
+{
+  for (unsigned m = 0; m < self->n_mixes; ++m)
+  {
+    const Mix *mix = &self->mixes[m];
+    const float *const *srcs = self->mix_srcs + mix->first;
+    float *dst = mix->dst;
+    memcpy(dst, srcs[0], n_frames * sizeof(float));
+    for (unsigned s = 1; s < mix->n_srcs; ++s)
+    {
+      const float *src = srcs[s];
+      for (uint32_t f = 0; f < n_frames; ++f)
+      {
+        dst[f] += src[f];
+      }
+    }
+  }
+}
+
+/**
+   Run graph node `n` for the block being rendered, on any thread.
+
+   The graph only starts a node once every node feeding it has finished, so
+   its inputs are complete, see setup_graph().
+*/
+static void
+run_node(void *data, unsigned n)
+{
+  const LV2Apply *self = (const LV2Apply *)data;
+  LV2Apply *node = &self->nodes[n];
+  mix_inputs(node, self->block_frames);
+  run_block(node, self->block_offset, self->block_frames);
+}
+
+/**
+   Run pipeline group `group` of a chain for one block in flight.
+
+   The plugins are split into groups of consecutive plugins, and each block
+   in flight has its own copy of the chain buffers, so a group connects its
+   plugins to the buffers of the block it runs.  Group 0 runs the first
+   plugin with its events and input, on the render thread.
+*/
+static void
+run_pipe_group(void *data, unsigned group, unsigned token)
+{
+  LV2Apply *self = (LV2Apply *)data;
+  const PipeBlock *block = &self->pipe_blocks[token];
+  const unsigned n_plugins = self->n_stages + 1;
+  const unsigned begin = group * n_plugins / self->n_pipe_groups;
+  const unsigned end = (group + 1) * n_plugins / self->n_pipe_groups;
+  for (unsigned s = begin; s < end; ++s)
+  {
+    LV2Apply *plugin = s ? &self->stages[s - 1] : self;
+    for (uint32_t p = 0; p < plugin->n_ports; ++p)
+    {
+      /* The first plugin's inputs are its own, or the reader's */
+      Port *port = &plugin->ports[p];
+      if (port->type == TYPE_AUDIO && (s || !port->is_input))
+      {
+        port->buf = block->bufs[port->buf_id];
+      }
+    }
+
+    connect_audio_at(plugin, 0);
+    if (s)
+    {
+      fill_event_buffers(plugin, block->offset, block->n_frames);
+      run_instance(plugin, block->n_frames);
+    }
+    else
+    {
+      run_block(plugin, block->offset, block->n_frames);
+    }
+  }
+}
+
+/**
+   Interleave and convert one block of planar output, and write it.
+
+   The block is converted to the file's PCM format in one pass, straight
+   into a slot of the writer's ring if it is running, and written with
+   sf_write_raw() so libsndfile does no conversion of its own.  With a
+   mapped output file, it is converted straight into the file, and with a
+   raw stream, into pages that are spliced into the pipe.
+*/
+static int
+write_block(LV2Apply *self, const float *const *bufs, uint32_t n)
+{
+  void *out = self->out_block;
+  if (self->stream)
+  {
+    out = pcm_stream_acquire(self->stream);
+  }
+  else if ((self->wav_map && !(out = wav_map_acquire(self->wav_map, n))) ||
+           (self->writer && !(out = block_writer_acquire(self->writer))))
+  {
+    return fatal(self, 9, "Failed to write to output file\n");
+  }
+
+  const uint64_t t0 = trace_begin();
+  pcm_interleave(bufs, self->n_out_channels, n, self->format, out);
+
+  const sf_count_t n_bytes =
+      (sf_count_t)n * self->n_out_channels * pcm_sample_size(self->format);
+  if (self->stream)
+  {
+    if (pcm_stream_commit(self->stream, n))
+    {
+      return fatal(self, 9, "Failed to write to output stream\n");
+    }
+  }
+  else if (self->wav_map)
+  {
+    wav_map_commit(self->wav_map, n);
+  }
+  else if (self->writer)
+  {
+    block_writer_commit(self->writer, n);
+  }
+  else if (sf_write_raw(self->out_file, out, n_bytes) != n_bytes)
+  {
+    return fatal(self, 9, "Failed to write to output file\n");
+  }
+
+  trace_end(t0, "write block", NULL);
+  return 0;
+}
+
+/**
+   Write the blocks that have come out of the pipeline.
+
+   This waits for the oldest block in flight `n_wait` times, and then writes
+   any others that are already done.
+*/
+static int
+write_pipe_blocks(LV2Apply *self, unsigned n_wait)
+{
+  unsigned token = 0;
+  for (unsigned i = 0; pipeline_pop(self->pipeline, &token, i < n_wait); ++i)
+  {
+    const PipeBlock *block = &self->pipe_blocks[token];
+    const int st = write_block(self, block->out, block->n_frames);
+    if (st)
+    {
+      return st;
+    }
+  }
+
+  return 0;
+}
+
+/**
+   Run the plugin for n_frames and throw the output away.
+
+   The pre-roll covers the frames just before zero, where there are no
+   events, so the render starts from a plugin that has settled.
+*/
+static void
+preroll(LV2Apply *self, int64_t n_frames)
+{
+  for (int64_t offset = -n_frames; offset < 0;
+       offset += self->block_size)
+  {
+    const uint32_t n =
+        -offset < self->block_size ? (uint32_t)-offset : self->block_size;
+    if (self->graph)
+    {
+      self->block_offset = offset;
+      self->block_frames = n;
+      graph_run(self->graph);
+    }
+    else
+    {
+      run_block(self, offset, n);
+      run_chain(self, offset, n);
+    }
+  }
+}
+
+/** Stop the worker of the plugin and of every chained or graph one. */
+static void
+finish_workers(LV2Apply *self)
+{
+  if (self->worker)
+  {
+    plugin_worker_finish(self->worker, NULL);
+  }
+  for (unsigned s = 0; s < self->n_stages; ++s)
+  {
+    finish_workers(&self->stages[s]);
+  }
+  for (unsigned n = 0; n < self->n_nodes; ++n)
+  {
+    finish_workers(&self->nodes[n]);
+  }
+}
+
+/** Set the timer of the plugin and of every chained or graph one. */
+static void
+set_timer(LV2Apply *self, RunTimer *timer)
+{
+  self->timer = timer;
+  for (unsigned s = 0; s < self->n_stages; ++s)
+  {
+    self->stages[s].timer = timer;
+  }
+  for (unsigned n = 0; n < self->n_nodes; ++n)
+  {
+    self->nodes[n].timer = timer;
+  }
+}
+
+/** Return a string of the rate and control values of a job, to compare. */
+static char *
+params_key(const LV2Apply *self)
+{
+  size_t size = 32;
+  for (unsigned i = 0; i < self->n_params; ++i)
+  {
+    size += strlen(self->params[i].sym) + 32;
+  }
+
+  char *key = (char *)malloc(size);
+  if (!key)
+  {
+    return NULL;
+  }
+
+  size_t len = (size_t)snprintf(key, size, "%u ", self->sample_rate);
+  for (unsigned i = 0; i < self->n_params; ++i)
+  {
+    len += (size_t)snprintf(key + len,
+                            size - len,
+                            "%s=%.9g ",
+                            self->params[i].sym,
+                            self->params[i].value);
+  }
+
+  return key;
+}
+
+/** Return the snapshot of a plugin pre-rolled with `key`, or NULL. */
+static Snapshot *
+find_snapshot(SnapshotCache *cache, const LilvPlugin *plugin, const char *key)
+{
+  for (unsigned i = 0; i < cache->n_snapshots; ++i)
+  {
+    Snapshot *snapshot = &cache->snapshots[i];
+    if (snapshot->plugin == plugin && !strcmp(snapshot->key, key))
+    {
+      return snapshot;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+   Bring the plugin to a warm state before rendering.
+
+   This is a pre-roll, unless an earlier job of the batch already pre-rolled
+   the same plugin with the same control values.  The first such job saves
+   the state of its instance with lilv_state_new_from_instance() after the
+   pre-roll, and later jobs restore it instead of pre-rolling again.  Only
+   what the plugin saves through the LV2 state interface carries over, the
+   control values are each job's own, so a plugin without that interface
+   is pre-rolled by every job.
+*/
+static void
+warm_up(LV2Apply *self)
+{
+  SnapshotCache *cache = self->snapshots;
+  const bool has_state =
+      cache && self->instance &&
+      lilv_instance_get_extension_data(self->instance, LV2_STATE__interface);
+  char *key = has_state ? params_key(self) : NULL;
+  if (key)
+  {
+    pthread_mutex_lock(self->lock);
+    const Snapshot *snapshot = find_snapshot(cache, self->plugin, key);
+    if (snapshot)
+    {
+      const double start = now();
+      lilv_state_restore(
+          snapshot->state, self->instance, NULL, NULL, 0, self->features);
+      const double elapsed = now() - start;
+      ++cache->n_restored;
+      cache->restore_time += elapsed;
+      cache->saved_time += snapshot->preroll_time - elapsed;
+      pthread_mutex_unlock(self->lock);
+      free(key);
+      return;
+    }
+    pthread_mutex_unlock(self->lock);
+  }
+
+  const int64_t n_frames = (int64_t)(self->preroll * self->sample_rate);
+  const double start = now();
+  preroll(self, n_frames);
+  const double elapsed = now() - start;
+  if (!self->quiet)
+  {
+    fprintf(
+        stderr, "Pre-roll: %ld frames in %.3f s\n", (long)n_frames, elapsed);
+  }
+  if (!key)
+  {
+    return;
+  }
+
+  /* Save the warm state, unless another job got there first */
+  pthread_mutex_lock(self->lock);
+  Snapshot *snapshots = NULL;
+  if (!find_snapshot(cache, self->plugin, key) &&
+      (snapshots = (Snapshot *)realloc(
+           cache->snapshots, (cache->n_snapshots + 1) * sizeof(Snapshot))))
+  {
+    Snapshot *snapshot = &(cache->snapshots = snapshots)[cache->n_snapshots];
+    snapshot->state = lilv_state_new_from_instance(self->plugin,
+                                                   self->instance,
+                                                   &self->map,
+                                                   NULL,
+                                                   NULL,
+                                                   NULL,
+                                                   NULL,
+                                                   NULL,
+                                                   NULL,
+                                                   0,
+                                                   self->features);
+    if (snapshot->state)
+    {
+      snapshot->plugin = self->plugin;
+      snapshot->key = key;
+      snapshot->preroll_time = elapsed;
+      ++cache->n_snapshots;
+      key = NULL;
+    }
+  }
+  pthread_mutex_unlock(self->lock);
+  free(key);
+}
+
+/**
+   Render n_frames in blocks of block_size frames.
+
+   A graph runs every node for each block, on all of the graph's threads.  A
+   pipelined chain only runs the first group of plugins here, and the block
+   is written once it has come out of the last group, so the output lines up
+   with a serial render however many blocks are in flight.
+*/
+static int
+run_blocks(LV2Apply *self)
+{
+  for (int64_t offset = 0; offset < self->n_frames; offset += self->block_size)
+  {
+    const int64_t remaining = self->n_frames - offset;
+    const uint32_t n = remaining < self->block_size ? (uint32_t)remaining
+                                                    : self->block_size;
+
+    if (self->reader && connect_input_block(self))
+    {
+      return fatal(self, 9, "Failed to read from input file\n");
+    }
+
+    int st = 0;
+    if (self->pipeline)
+    {
+      /* Make room for this block if every one is in flight */
+      if ((st = write_pipe_blocks(self, pipeline_full(self->pipeline))))
+      {
+        return st;
+      }
+
+      const unsigned token =
+          (unsigned)(offset / self->block_size) % self->n_pipe_blocks;
+      self->pipe_blocks[token].offset = offset;
+      self->pipe_blocks[token].n_frames = n;
+      pipeline_run(self->pipeline, token);
+    }
+    else if (self->graph)
+    {
+      self->block_offset = offset;
+      self->block_frames = n;
+      graph_run(self->graph);
+      mix_inputs(self, n);
+      st = write_block(self, self->out_bufs, n);
+    }
+    else
+    {
+      run_block(self, offset, n);
+      run_chain(self, offset, n);
+      st = write_block(self, self->out_bufs, n);
+    }
+
+    if (st)
+    {
+      return st;
+    }
+
+    if (self->reader)
+    {
+      block_reader_release(self->reader);
+    }
+  }
+
+  /* Drain the pipeline */
+  if (self->pipeline)
+  {
+    const int st = write_pipe_blocks(self, self->n_pipe_blocks);
+    if (st)
+    {
+      return st;
+    }
+  }
+
+  if (self->reader)
+  {
+    BlockReaderStats stats;
+    block_reader_finish(self->reader, &stats);
+    if (!self->quiet)
+    {
+      fprintf(stderr,
+              "Reader: %u slots, %lu blocks, %lu stalls\n",
+              stats.n_slots,
+              (unsigned long)stats.n_blocks,
+              (unsigned long)stats.n_stalls);
+    }
+  }
+
+  if (self->stream)
+  {
+    PcmStreamStats stats;
+    if (pcm_stream_finish(self->stream, &stats))
+    {
+      return fatal(self, 9, "Failed to write to output stream\n");
+    }
+
+    if (!self->quiet)
+    {
+      fprintf(stderr,
+              "Stream: %lu bytes, %zu byte ring, %zu byte pipe, %lu stalls\n",
+              (unsigned long)stats.n_bytes,
+              stats.ring_size,
+              stats.pipe_size,
+              (unsigned long)stats.n_stalls);
+    }
+  }
+
+  if (self->wav_map)
+  {
+    WavMapStats stats;
+    if (wav_map_finish(self->wav_map, &stats))
+    {
+      return fatal(self, 9, "Failed to write to output file\n");
+    }
+
+    if (!self->quiet)
+    {
+      fprintf(stderr,
+              "Mapped output: %lu bytes%s, %lu writeback windows\n",
+              (unsigned long)stats.n_bytes,
+              stats.rf64 ? " (RF64)" : "",
+              (unsigned long)stats.n_flushes);
+    }
+  }
+
+  if (self->writer)
+  {
+    BlockWriterStats stats;
+    if (block_writer_finish(self->writer, &stats))
+    {
+      return fatal(self, 9, "Failed to write to output file\n");
+    }
+
+    if (self->quiet)
+    {
+      return 0;
+    }
+
+    fprintf(stderr,
+            "Writer: %u slots, high-water mark %u, %lu blocks, %lu stalls\n",
+            stats.n_slots,
+            stats.high_water,
+            (unsigned long)stats.n_blocks,
+            (unsigned long)stats.n_stalls);
+  }
+
+  return 0;
+}
+
+/**
+   Render n_frames one frame at a time.
+
+   Ports are connected to buffers in interleaved format, so we can run a
+   single frame at a time and avoid having to interleave buffers to
+   read/write from/to sndfile.  This is slow, and only kept as a baseline to
+   measure block rendering against.
+*/
+static int
+run_frames(LV2Apply *self)
+{
+  float *in_buf = self->frame_in;
+  float *out_buf = self->frame_out;
+  connect_control_ports(self);
+  for (uint32_t p = 0, i = 0, o = 0; p < self->n_ports; ++p)
+  {
+    if (self->ports[p].type == TYPE_AUDIO)
+    {
+      if (self->ports[p].is_input)
+      {
+        lilv_instance_connect_port(self->instance, p, in_buf + i++);
+      }
+      else
+      {
+        lilv_instance_connect_port(self->instance, p, out_buf + o++);
+      }
+    }
+  }
+
+  for (int64_t i = 0; i < self->n_frames; ++i)
+  {
+    if (self->in_file && sf_readf_float(self->in_file, in_buf, 1) != 1)
+    {
+      memset(in_buf, 0, self->n_audio_in * sizeof(float));
+    }
+
+    if (i >= self->next_change)
+    {
+      update_lanes(self, i);
+    }
+    fill_event_buffers(self, i, 1);
+    run_instance(self, 1);
+    if (sf_writef_float(self->out_file, out_buf, 1) != 1)
+    {
+      return fatal(self, 9, "Failed to write to output file\n");
+    }
+  }
+
+  return 0;
+}
+
+/** Return true if the first `n` of `ids` contain `id` more than `max` times. */
+static bool
+id_count_exceeds(const unsigned *ids, unsigned n, unsigned id, unsigned max)
+{
+  unsigned count = 0;
+  for (unsigned i = 0; i < n; ++i)
+  {
+    count += ids[i] == id;
+  }
+  return count > max;
+}
+
+/**
+   Assign an audio buffer to every port of every chained plugin.
+
+   Each plugin reads the outputs of the one before, repeating them if it has
+   more inputs, and writes each output in place over the input with the same
+   index unless it is lv2:inPlaceBroken.  Other outputs take the first buffer
+   that the plugin does not read, so a chain of any length only needs a few
+   buffers, which stay in cache.  Buffers are numbered while assigning, with
+   silence as 0 and the first plugin's outputs next, and allocated after.
+*/
+static int
+assign_chain_buffers(LV2Apply *self)
+{
+  const size_t block_bytes = (size_t)self->block_size * sizeof(float);
+  unsigned n_slots = 0;
+  for (unsigned s = 0; s < self->n_stages; ++s)
+  {
+    n_slots += self->stages[s].n_audio_in + self->stages[s].n_audio_out;
+  }
+
+  /* The ids of each plugin's inputs then outputs, then the first plugin's */
+  unsigned *ids =
+      (unsigned *)calloc(n_slots + self->n_audio_out + 1, sizeof(unsigned));
+  if (!ids)
+  {
+    return fatal(self, 10, "Failed to allocate chain buffers\n");
+  }
+
+  unsigned *prev = ids + n_slots;
+  unsigned n_prev = self->n_audio_out;
+  for (unsigned i = 0; i < n_prev; ++i)
+  {
+    prev[i] = i + 1;
+  }
+
+  LilvNode *in_place_broken =
+      lilv_new_uri(self->world, LV2_CORE__inPlaceBroken);
+  unsigned n_ids = n_prev + 1;
+  unsigned n_in_place = 0;
+  bool silence = false;
+  size_t peak = (size_t)(self->n_audio_in + self->n_audio_out) * block_bytes;
+  size_t naive = peak;
+  unsigned *in = ids;
+  for (unsigned s = 0; s < self->n_stages; ++s)
+  {
+    const LV2Apply *stage = &self->stages[s];
+    const unsigned n_in = stage->n_audio_in;
+    const unsigned n_out = stage->n_audio_out;
+    const bool in_place =
+        !lilv_plugin_has_feature(stage->plugin, in_place_broken);
+    unsigned *out = in + n_in;
+    for (unsigned i = 0; i < n_in; ++i)
+    {
+      in[i] = n_prev ? prev[i % n_prev] : 0;
+      silence = silence || !in[i];
+    }
+
+    bool used_in_place = false;
+    for (unsigned o = 0; o < n_out; ++o)
+    {
+      /* In place only over an input that no other input reads */
+      if (in_place && o < n_in && in[o] &&
+          !id_count_exceeds(in, n_in, in[o], 1))
+      {
+        out[o] = in[o];
+        used_in_place = true;
+        continue;
+      }
+
+      unsigned id = 1;
+      while (id < n_ids && (id_count_exceeds(in, n_in, id, 0) ||
+                            id_count_exceeds(out, o, id, 0)))
+      {
+        ++id;
+      }
+      out[o] = id;
+      n_ids += id == n_ids;
+    }
+
+    /* Count the distinct buffers this plugin touches */
+    unsigned n_touched = 0;
+    for (unsigned i = 0; i < n_in + n_out; ++i)
+    {
+      n_touched += !id_count_exceeds(in, i, in[i], 0);
+    }
+    if ((size_t)n_touched * block_bytes > peak)
+    {
+      peak = (size_t)n_touched * block_bytes;
+    }
+    naive += (size_t)(n_in + n_out) * block_bytes;
+    n_in_place += used_in_place;
+
+    prev = out;
+    n_prev = n_out;
+    in = out + n_out;
+  }
+  lilv_node_free(in_place_broken);
+
+  /* Allocate silence and the new buffers, the rest belong to the first */
+  const unsigned n_new = n_ids - self->n_audio_out;
+  Arena *arena = &self->chain_arena;
+  float **bufs = (float **)calloc(n_ids, sizeof(float *));
+  if (!bufs || arena_init(arena,
+                          n_new * arena_round(block_bytes) +
+                              arena_round(n_prev * sizeof(float *)),
+                          n_new + 1))
+  {
+    free(bufs);
+    free(ids);
+    return fatal(self, 10, "Failed to allocate chain buffers\n");
+  }
+
+  bufs[0] = (float *)arena_alloc(arena, block_bytes, "chain", "silence");
+  for (unsigned i = 1; i < n_ids; ++i)
+  {
+    bufs[i] = i <= self->n_audio_out
+                  ? self->out_bufs[i - 1]
+                  : (float *)arena_alloc(arena, block_bytes, "chain", "audio");
+  }
+
+  /* Connect the ports, inputs and outputs each in port order */
+  for (unsigned p = 0, o = 0; p < self->n_ports; ++p)
+  {
+    Port *port = &self->ports[p];
+    if (port->type == TYPE_AUDIO && !port->is_input)
+    {
+      port->buf_id = ++o;
+    }
+  }
+  in = ids;
+  for (unsigned s = 0; s < self->n_stages; ++s)
+  {
+    LV2Apply *stage = &self->stages[s];
+    unsigned *out = in + stage->n_audio_in;
+    for (unsigned p = 0, i = 0, o = 0; p < stage->n_ports; ++p)
+    {
+      Port *port = &stage->ports[p];
+      if (port->type == TYPE_AUDIO)
+      {
+        port->buf_id = port->is_input ? in[i++] : out[o++];
+        port->buf = bufs[port->buf_id];
+      }
+    }
+    in = out + stage->n_audio_out;
+  }
+
+  /* The output file gets the last plugin's outputs */
+  self->out_bufs = (float **)arena_alloc(
+      arena, n_prev * sizeof(float *), "ptrs", "chain out_bufs");
+  for (unsigned i = 0; i < n_prev; ++i)
+  {
+    self->out_bufs[i] = bufs[prev[i]];
+  }
+  self->n_out_channels = n_prev;
+
+  if (!self->quiet)
+  {
+    fprintf(stderr,
+            "Chain: %u plugins, %u in place, %u buffers of %zu bytes, "
+            "peak working set %zu bytes (%zu without reuse)\n",
+            self->n_stages + 1,
+            n_in_place,
+            n_ids - 1 + (silence ? 1 : 0),
+            block_bytes,
+            peak,
+            naive);
+  }
+
+  free(bufs);
+  free(ids);
+  return 0;
+}
+
+/** Set the control values given on the command line or in a job. */
+static int
+set_params(LV2Apply *self)
+{
+  for (unsigned i = 0; i < self->n_params; ++i)
+  {
+    const Param *param = &self->params[i];
+    lock_world(self);
+    LilvNode *sym = lilv_new_string(self->world, param->sym);
+    const LilvPort *port = lilv_plugin_get_port_by_symbol(self->plugin, sym);
+    lilv_node_free(sym);
+    unlock_world(self);
+    if (!port)
+    {
+      return fatal(self, 7, "Unknown port `%s'\n", param->sym);
+    }
+
+    *self->ports[lilv_port_get_index(self->plugin, port)].control =
+        param->value;
+  }
+
+  return 0;
+}
+
+/**
+   Set up every chained plugin after this one.
+
+   They share the world and URID map, get their own ports and arena for
+   control and event buffers like any plugin, and their audio buffers from
+   assign_chain_buffers().
+*/
+static int
+setup_chain(LV2Apply *self)
+{
+  for (unsigned s = 0; s < self->n_stages; ++s)
+  {
+    LV2Apply *stage = &self->stages[s];
+    stage->urid_map = self->urid_map;
+    if (init_features(stage) || create_ports(stage) || create_arena(stage))
+    {
+      /* The stage has cleaned up itself, every other one still needs to */
+      self->stages[s] = self->stages[--self->n_stages];
+      return cleanup(5, self);
+    }
+
+    if (!instantiate(stage))
+    {
+      return fatal(self, 6, "Failed to instantiate <%s>\n",
+                   lilv_node_as_uri(lilv_plugin_get_uri(stage->plugin)));
+    }
+  }
+
+  return assign_chain_buffers(self);
+}
+
+/**
+   Set up pipelining of the chain over n_pipe_groups threads.
+
+   Consecutive plugins are split into groups of about the same size, one per
+   thread, and twice as many blocks as groups are in flight so that every
+   group can be busy while finished blocks are written.  Each block has its
+   own copy of the buffers assign_chain_buffers() assigned, so the in-place
+   reuse within a block still holds.  In real time, this would delay the
+   output by a block per extra group.  A render instead only writes a block
+   once it leaves the last group, and drains the pipeline at the end, so the
+   output is not delayed at all.
+*/
+static int
+setup_pipeline(LV2Apply *self)
+{
+  const unsigned n_plugins = self->n_stages + 1;
+  const unsigned n_groups = std::min(self->n_pipe_groups, n_plugins);
+  const unsigned n_blocks = 2 * n_groups;
+  if (n_groups < self->n_pipe_groups)
+  {
+    fprintf(stderr,
+            "warning: Pipelining over %u threads, one per plugin\n",
+            n_groups);
+  }
+  self->n_pipe_groups = n_groups;
+  self->n_pipe_blocks = n_blocks;
+  if (n_groups < 2)
+  {
+    return 0;
+  }
+
+  /* Buffer ids run from silence (0) to the highest one any port uses */
+  unsigned n_ids = self->n_audio_out + 1;
+  for (unsigned s = 0; s < self->n_stages; ++s)
+  {
+    const LV2Apply *stage = &self->stages[s];
+    for (uint32_t p = 0; p < stage->n_ports; ++p)
+    {
+      if (stage->ports[p].type == TYPE_AUDIO)
+      {
+        n_ids = std::max(n_ids, stage->ports[p].buf_id + 1);
+      }
+    }
+  }
+
+  const size_t block_bytes = (size_t)self->block_size * sizeof(float);
+  const unsigned n_out = self->n_out_channels;
+  Arena *arena = &self->pipe_arena;
+  if (arena_init(arena,
+                 arena_round(n_blocks * sizeof(PipeBlock)) +
+                     arena_round(block_bytes) +
+                     n_blocks * (arena_round(n_ids * sizeof(float *)) +
+                                 arena_round(n_out * sizeof(float *)) +
+                                 (n_ids - 1) * arena_round(block_bytes)),
+                 2 + n_blocks * (n_ids + 1)))
+  {
+    return fatal(self, 10, "Failed to allocate pipeline buffers\n");
+  }
+
+  self->pipe_blocks = (PipeBlock *)arena_alloc(
+      arena, n_blocks * sizeof(PipeBlock), "pipe", "blocks");
+  float *silence = (float *)arena_alloc(arena, block_bytes, "pipe", "silence");
+  const LV2Apply *last = &self->stages[self->n_stages - 1];
+  for (unsigned b = 0; b < n_blocks; ++b)
+  {
+    PipeBlock *block = &self->pipe_blocks[b];
+    block->bufs = (float **)arena_alloc(
+        arena, n_ids * sizeof(float *), "ptrs", "pipe bufs");
+    block->bufs[0] = silence;
+    for (unsigned i = 1; i < n_ids; ++i)
+    {
+      block->bufs[i] =
+          (float *)arena_alloc(arena, block_bytes, "pipe", "audio");
+    }
+
+    block->out = (float **)arena_alloc(
+        arena, n_out * sizeof(float *), "ptrs", "pipe out");
+    for (uint32_t p = 0, o = 0; p < last->n_ports; ++p)
+    {
+      const Port *port = &last->ports[p];
+      if (port->type == TYPE_AUDIO && !port->is_input)
+      {
+        block->out[o++] = block->bufs[port->buf_id];
+      }
+    }
+  }
+
+  if (!(self->pipeline =
+            pipeline_new(n_groups, n_blocks, run_pipe_group, self)))
+  {
+    return fatal(self, 10, "Failed to start pipeline threads\n");
+  }
+
+  if (!self->quiet)
+  {
+    fprintf(stderr,
+            "Pipeline: %u groups of plugins on %u threads, %u blocks in "
+            "flight, %u blocks (%u frames) of latency compensated\n",
+            n_groups,
+            n_groups,
+            n_blocks,
+            n_groups - 1,
+            (n_groups - 1) * self->block_size);
+  }
+
+  return 0;
+}
+
+/**
+   Connect the inputs `ins` of graph node `to` to the nodes that feed it.
+
+   Every node connected to it feeds its outputs to the inputs in order,
+   repeating them if there are more inputs.  Inputs fed by a single node read
+   its output buffer directly, and inputs fed by several get the sum of them
+   in their own buffer, see mix_inputs().  Inputs fed by no node keep their
+   own silent buffer.  `to` is GRAPH_OUTPUT for the output of the graph.
+*/
+static int
+connect_inputs(LV2Apply *self,
+               LV2Apply *sink,
+               unsigned to,
+               float **ins,
+               unsigned n_ins)
+{
+  unsigned n_srcs = 0;
+  for (unsigned e = 0; e < self->n_edges; ++e)
+  {
+    const LV2Apply *from = &self->nodes[self->edges[2 * e]];
+    n_srcs += self->edges[2 * e + 1] == to && from->n_audio_out;
+  }
+
+  if (n_srcs > 1 && n_ins)
+  {
+    sink->mixes = (Mix *)calloc(n_ins, sizeof(Mix));
+    sink->mix_srcs =
+        (const float **)calloc((size_t)n_ins * n_srcs, sizeof(float *));
+    if (!sink->mixes || !sink->mix_srcs)
+    {
+      return 1;
+    }
+    sink->n_mixes = n_ins;
+  }
+
+  for (unsigned e = 0, s = 0; e < self->n_edges; ++e)
+  {
+    const LV2Apply *from = &self->nodes[self->edges[2 * e]];
+    if (self->edges[2 * e + 1] != to || !from->n_audio_out)
+    {
+      continue;
+    }
+
+    for (unsigned i = 0; i < n_ins; ++i)
+    {
+      float *buf = from->out_bufs[i % from->n_audio_out];
+      if (n_srcs == 1)
+      {
+        ins[i] = buf;
+      }
+      else
+      {
+        sink->mixes[i].dst = ins[i];
+        sink->mixes[i].first = i * n_srcs;
+        sink->mixes[i].n_srcs = n_srcs;
+        sink->mix_srcs[i * n_srcs + s] = buf;
+      }
+    }
+    ++s;
+  }
+
+  return 0;
+}
+
+/** Clean up after graph node `n`, which has cleaned up itself, failed. */
+static int
+fail_node(LV2Apply *self, unsigned n, int status)
+{
+  self->nodes[n] = self->nodes[--self->n_nodes];
+  return cleanup(status, self);
+}
+
+/**
+   Set up every node of the graph and connect their audio buffers.
+
+   Each node is set up like a single plugin, with its own ports, arena,
+   events and control values, and shares the world and URID map.  Nodes only
+   read the output buffers of the nodes that feed them and never write to
+   another node's buffers, so nodes on independent branches can run at the
+   same time.  The output file gets the sum of the output nodes.
+*/
+static int
+setup_graph(LV2Apply *self)
+{
+  if (init_features(self))
+  {
+    return 5;
+  }
+
+  for (unsigned n = 0; n < self->n_nodes; ++n)
+  {
+    LV2Apply *node = &self->nodes[n];
+    node->urid_map = self->urid_map;
+    if (init_features(node) || create_ports(node) || create_arena(node) ||
+        create_note_events(node, node->notes, node->n_notes) ||
+        (node->events_path && load_events(node, node->events_path)))
+    {
+      return fail_node(self, n, 5);
+    }
+    sort_events(node);
+    if (set_params(node))
+    {
+      return fail_node(self, n, 7);
+    }
+    start_lanes(node);
+
+    if (!instantiate(node))
+    {
+      return fatal(self, 6, "Failed to instantiate node `%s'\n", node->name);
+    }
+  }
+
+  /* Point each node's inputs at the outputs of the nodes that feed it */
+  unsigned n_mixed = 0;
+  for (unsigned n = 0; n < self->n_nodes; ++n)
+  {
+    LV2Apply *node = &self->nodes[n];
+    float **ins = (float **)calloc(node->n_audio_in + 1, sizeof(float *));
+    if (!ins)
+    {
+      return fatal(self, 10, "Failed to allocate graph buffers\n");
+    }
+
+    for (unsigned p = 0, i = 0; p < node->n_ports; ++p)
+    {
+      if (node->ports[p].type == TYPE_AUDIO && node->ports[p].is_input)
+      {
+        ins[i++] = node->ports[p].buf;
+      }
+    }
+
+    const int st = connect_inputs(self, node, n, ins, node->n_audio_in);
+    for (unsigned p = 0, i = 0; p < node->n_ports; ++p)
+    {
+      if (node->ports[p].type == TYPE_AUDIO && node->ports[p].is_input)
+      {
+        node->ports[p].buf = ins[i++];
+      }
+    }
+    free(ins);
+    if (st)
+    {
+      return fatal(self, 10, "Failed to allocate graph buffers\n");
+    }
+    n_mixed += node->n_mixes;
+  }
+
+  /* The output has as many channels as the widest output node */
+  unsigned n_outputs = 0;
+  self->n_out_channels = 0;
+  for (unsigned e = 0; e < self->n_edges; ++e)
+  {
+    const LV2Apply *from = &self->nodes[self->edges[2 * e]];
+    if (self->edges[2 * e + 1] == GRAPH_OUTPUT && from->n_audio_out)
+    {
+      ++n_outputs;
+      self->n_out_channels = std::max(self->n_out_channels, from->n_audio_out);
+    }
+  }
+  if (!self->n_out_channels)
+  {
+    return fatal(self, 8, "Graph output has no audio channels\n");
+  }
+
+  /* Summing several outputs needs buffers for the sums */
+  const size_t block_bytes = (size_t)self->block_size * sizeof(float);
+  const unsigned n_out = self->n_out_channels;
+  const unsigned n_sums = n_outputs > 1 ? n_out : 0;
+  Arena *arena = &self->chain_arena;
+  if (arena_init(arena,
+                 arena_round(n_out * sizeof(float *)) +
+                     n_sums * arena_round(block_bytes) +
+                     arena_round(block_bytes * n_out),
+                 n_sums + 2))
+  {
+    return fatal(self, 10, "Failed to allocate graph buffers\n");
+  }
+
+  self->out_bufs = (float **)arena_alloc(
+      arena, n_out * sizeof(float *), "ptrs", "graph out_bufs");
+  for (unsigned i = 0; i < n_sums; ++i)
+  {
+    self->out_bufs[i] =
+        (float *)arena_alloc(arena, block_bytes, "graph", "output sum");
+  }
+  self->out_block = (uint8_t *)arena_alloc(
+      arena, block_bytes * n_out, "block", "interleaved output");
+  if (connect_inputs(self, self, GRAPH_OUTPUT, self->out_bufs, n_out))
+  {
+    return fatal(self, 10, "Failed to allocate graph buffers\n");
+  }
+
+  if (!self->quiet)
+  {
+    fprintf(stderr,
+            "Graph: %u nodes, %u connections, %u summed inputs, "
+            "%u output channels\n",
+            self->n_nodes,
+            self->n_edges - n_outputs,
+            n_mixed + self->n_mixes,
+            n_out);
+  }
+
+  return 0;
+}
+
+/** Create the plugin's ports, buffers and events, and set up any chain. */
+static int
+setup_plugin(LV2Apply *self)
+{
+  /* Create port structures and the buffer arena */
+  if (init_features(self) || create_ports(self) || create_arena(self) ||
+      create_note_events(self, self->notes, self->n_notes) ||
+      (self->events_path && load_events(self, self->events_path)))
+  {
+    return 5;
+  }
+  sort_events(self);
+
+  /* Set control values, automation starts from them */
+  if (set_params(self))
+  {
+    return 7;
+  }
+  start_lanes(self);
+
+  /* Set up any chained plugins, the last one has the output channels */
+  self->n_out_channels = self->n_audio_out;
+  if (!self->n_stages)
+  {
+    return 0;
+  }
+
+  const int st = setup_chain(self);
+  return st ? st : self->n_pipe_groups ? setup_pipeline(self) : 0;
+}
+
+/**
+   Set up the plugin or graph, open the output file and instantiate.
+
+   In batch mode, only the lilv calls are made with the lilv lock held, so
+   jobs open and preallocate their files at the same time, and one that
+   blocks opening a FIFO does not hold up the others.
+*/
+static int
+setup(LV2Apply *self)
+{
+  const int st = self->n_nodes ? setup_graph(self) : setup_plugin(self);
+  if (st)
+  {
+    return st;
+  }
+
+  /* Check the input matches, frame mode reads it straight into the ports */
+  if (self->in_file && !self->n_audio_in)
+  {
+    return fatal(self, 8, "Plugin has no audio inputs for %s\n", self->in_path);
+  }
+  if (self->in_file && self->frame_mode &&
+      self->n_in_channels != self->n_audio_in)
+  {
+    return fatal(self, 8, "Frame mode needs an input with %u channels\n",
+                 self->n_audio_in);
+  }
+
+  /* Open output file, mapped or streamed if requested (block mode only) */
+  const uint32_t frame_size =
+      self->n_out_channels * pcm_sample_size(self->format);
+  if (self->raw_output && !self->frame_mode)
+  {
+    if (!(self->stream = pcm_stream_open(
+              self->out_path, frame_size, self->block_size)))
+    {
+      return fatal(self, 8, "Failed to open %s (%s)\n",
+                   self->out_path, strerror(errno));
+    }
+  }
+  else if (self->map_output && !self->frame_mode)
+  {
+    if (!(self->wav_map = wav_map_open(self->out_path,
+                                       self->n_out_channels,
+                                       self->sample_rate,
+                                       self->format,
+                                       self->n_frames)))
+    {
+      if (errno != EOPNOTSUPP)
+      {
+        return fatal(self, 8, "Failed to map %s (%s)\n",
+                     self->out_path, strerror(errno));
+      }
+
+      fprintf(stderr,
+              "warning: Can not preallocate %s, writing it with libsndfile\n",
+              self->out_path);
+    }
+  }
+
+  /* Otherwise use libsndfile, also where the file can not be preallocated */
+  if (!self->stream && !self->wav_map)
+  {
+    SF_INFO out_fmt = {0, 0, 0, 0, 0, 0};
+    const int subformat = self->format == PCM_S16   ? SF_FORMAT_PCM_16
+                          : self->format == PCM_S24 ? SF_FORMAT_PCM_24
+                          : self->format == PCM_S32 ? SF_FORMAT_PCM_32
+                                                    : SF_FORMAT_FLOAT;
+    out_fmt.format =
+        (self->raw_output ? SF_FORMAT_RAW : SF_FORMAT_WAV) | subformat;
+    out_fmt.samplerate = (int)self->sample_rate;
+    out_fmt.frames = self->n_frames;
+    out_fmt.channels = (int)self->n_out_channels;
+    if (!(self->out_file = sopen(self, self->out_path, SFM_WRITE, &out_fmt)))
+    {
+      return 8;
+    }
+  }
+
+  /* Instantiate plugin, graph nodes already are */
+  if (self->n_nodes)
+  {
+    return 0;
+  }
+
+  if (!instantiate(self))
+  {
+    return fatal(self, 6, "Failed to instantiate plugin\n");
+  }
+
+  return 0;
+}
+
+/** Activate or deactivate the plugin and every chained or graph plugin. */
+static void
+set_active(LV2Apply *self, bool active)
+{
+  LilvInstance *instance = self->instance;
+  if (instance && active != self->active)
+  {
+    const uint64_t t0 = trace_begin();
+    if (active)
+    {
+      lilv_instance_activate(instance);
+    }
+    else
+    {
+      lilv_instance_deactivate(instance);
+    }
+    self->active = active;
+    trace_end(t0, active ? "activate" : "deactivate", plugin_name(self));
+  }
+
+  for (unsigned s = 0; s < self->n_stages; ++s)
+  {
+    set_active(&self->stages[s], active);
+  }
+  for (unsigned n = 0; n < self->n_nodes; ++n)
+  {
+    set_active(&self->nodes[n], active);
+  }
+}
+
+/** Print the time spent in every graph node, and the critical path. */
+static void
+print_graph_stats(const LV2Apply *self)
+{
+  unsigned *path = (unsigned *)calloc(self->n_nodes, sizeof(unsigned));
+  if (!path)
+  {
+    return;
+  }
+
+  const unsigned *order = graph_order(self->graph);
+  double serial_ns = 0.0;
+  for (unsigned i = 0; i < self->n_nodes; ++i)
+  {
+    const GraphNodeStats *stats = graph_node_stats(self->graph, order[i]);
+    const double mean_ns =
+        stats->n_runs ? (double)stats->total_ns / stats->n_runs : 0.0;
+    serial_ns += mean_ns;
+    fprintf(stderr,
+            "  %-16s %9.1f us mean, %9.1f us max per block\n",
+            self->nodes[order[i]].name,
+            mean_ns / 1000.0,
+            (double)stats->max_ns / 1000.0);
+  }
+
+  double path_ns = 0.0;
+  const unsigned n_path = graph_critical_path(self->graph, path, &path_ns);
+  fprintf(stderr, "Critical path:");
+  for (unsigned i = 0; i < n_path; ++i)
+  {
+    fprintf(stderr, "%s %s", i ? " ->" : "", self->nodes[path[i]].name);
+  }
+  fprintf(stderr,
+          ", %.1f us of %.1f us serial per block (%.2fx parallelism)\n",
+          path_ns / 1000.0,
+          serial_ns / 1000.0,
+          path_ns > 0.0 ? serial_ns / path_ns : 1.0);
+  free(path);
+}
+
+/** Print how busy every group of a pipelined chain was. */
+static void
+print_pipeline_stats(const LV2Apply *self, double elapsed)
+{
+  const unsigned n_plugins = self->n_stages + 1;
+  for (unsigned g = 0; g < self->n_pipe_groups; ++g)
+  {
+    const PipelineGroupStats *stats =
+        pipeline_group_stats(self->pipeline, g);
+    fprintf(stderr,
+            "  group %u: plugins %u-%u, %.3f s busy (%.0f%%), %lu waits\n",
+            g,
+            g * n_plugins / self->n_pipe_groups + 1,
+            (g + 1) * n_plugins / self->n_pipe_groups,
+            (double)stats->busy_ns * 1e-9,
+            (double)stats->busy_ns * 1e-7 / elapsed,
+            (unsigned long)stats->n_waits);
+  }
+}
+
+/** Print the hardware event counts per run of one plugin. */
+static void
+print_perf_totals(const char *name, const PerfTotals *perf)
+{
+  const uint64_t *counts = perf->counts;
+  const unsigned ipc_mask = (1u << PERF_CYCLES) | (1u << PERF_INSTRUCTIONS);
+  fprintf(stderr, "  %s: %lu runs", name, (unsigned long)perf->n_runs);
+  if ((perf->available & ipc_mask) == ipc_mask && counts[PERF_CYCLES])
+  {
+    fprintf(stderr,
+            ", %.2f IPC",
+            (double)counts[PERF_INSTRUCTIONS] / counts[PERF_CYCLES]);
+  }
+  for (unsigned i = 0; perf->n_runs && i < PERF_N_COUNTERS; ++i)
+  {
+    if (perf->available & (1u << i))
+    {
+      fprintf(stderr,
+              ", %.0f %s",
+              (double)counts[i] / perf->n_runs,
+              perf_counter_name(i));
+    }
+  }
+  if (perf->n_scaled || perf->n_unmeasured)
+  {
+    fprintf(stderr,
+            " (multiplexed: %lu runs scaled, %lu not counted)",
+            (unsigned long)perf->n_scaled,
+            (unsigned long)perf->n_unmeasured);
+  }
+  fprintf(stderr, "\n");
+}
+
+/** Print the hardware event counts of the plugin and every chained one. */
+static void
+print_perf_stats(const LV2Apply *self)
+{
+  const char *reason = perf_unavailable_reason();
+  if (reason)
+  {
+    fprintf(stderr, "Perf counters unavailable (%s)\n", reason);
+    return;
+  }
+
+  fprintf(stderr, "Perf counters per run:\n");
+  if (self->instance)
+  {
+    print_perf_totals(plugin_name(self), &self->perf);
+  }
+  for (unsigned s = 0; s < self->n_stages; ++s)
+  {
+    print_perf_totals(plugin_name(&self->stages[s]), &self->stages[s].perf);
+  }
+  for (unsigned n = 0; n < self->n_nodes; ++n)
+  {
+    print_perf_totals(plugin_name(&self->nodes[n]), &self->nodes[n].perf);
+  }
+}
+
+/** Print a summary of the run timing, and write it all to a JSON file. */
+static int
+report_timing(const RunTimer *timer, const char *path)
+{
+  RunSummary sum;
+  run_timer_summary(timer, &sum);
+  fprintf(stderr,
+          "Runs: %lu, %.1f us p50, %.1f us p99, %.1f us p99.9, %.1f us max; "
+          "DSP load %.1f%% p50, %.1f%% p99, %.1f%% max\n",
+          (unsigned long)sum.n_runs,
+          (double)sum.ns.p50 * 1e-3,
+          (double)sum.ns.p99 * 1e-3,
+          (double)sum.ns.p999 * 1e-3,
+          (double)sum.ns.max * 1e-3,
+          (double)sum.load.p50 * 1e-4,
+          (double)sum.load.p99 * 1e-4,
+          (double)sum.load.max * 1e-4);
+
+  FILE *fd = fopen(path, "w");
+  if (!fd || run_timer_write_json(timer, fd) | fclose(fd))
+  {
+    return fatal(NULL, 9, "Failed to write timing to %s\n", path);
+  }
+
+  return 0;
+}
+
+/**
+   Render the plugin of `self` to its output file and clean up.
+
+   Returns zero on success, otherwise an exit status, and in both cases all
+   of the render's resources have been freed.
+*/
+static int
+render(LV2Apply *self)
+{
+  const int setup_st = setup(self);
+  if (setup_st)
+  {
+    return setup_st;
+  }
+
+  if (!self->frame_mode)
+  {
+    connect_block_buffers(self);
+    for (unsigned s = 0; s < self->n_stages; ++s)
+    {
+      connect_block_buffers(&self->stages[s]);
+    }
+    for (unsigned n = 0; n < self->n_nodes; ++n)
+    {
+      connect_block_buffers(&self->nodes[n]);
+    }
+  }
+
+  /* Start the writer thread, which owns the output file from now on */
+  if (!self->frame_mode && self->out_file && self->n_slots &&
+      !(self->writer = block_writer_new(self->out_file,
+                                        self->n_out_channels *
+                                            pcm_sample_size(self->format),
+                                        self->block_size,
+                                        self->n_slots)))
+  {
+    return fatal(self, 10, "Failed to start writer thread\n");
+  }
+
+  /* Start reading ahead, the reader owns the input file from now on */
+  if (!self->frame_mode && self->in_file &&
+      !(self->reader = block_reader_new(self->in_file,
+                                        self->n_in_channels,
+                                        self->block_size,
+                                        READ_SLOTS,
+                                        self->n_frames)))
+  {
+    return fatal(self, 10, "Failed to start reader thread\n");
+  }
+
+  set_active(self, true);
+  if (self->preroll > 0.0)
+  {
+    /* Pre-roll runs start cold, so they are kept out of the run times */
+    RunTimer *const timer = self->timer;
+    set_timer(self, NULL);
+    warm_up(self);
+    set_timer(self, timer);
+  }
+
+  const double start = now();
+  const int st = self->frame_mode ? run_frames(self) : run_blocks(self);
+  if (st)
+  {
+    return st;
+  }
+  const double elapsed = now() - start;
+  finish_workers(self);
+  if (!self->pool)
+  {
+    /* A pooled instance is reset when it is returned, see pool_release() */
+    set_active(self, false);
+  }
+
+  if (!self->quiet)
+  {
+    fprintf(stderr,
+            "Rendered %ld frames (%u per call) in %.3f s, "
+            "%.0f frames/s, %.1fx realtime\n",
+            (long)self->n_frames,
+            self->frame_mode ? 1U : self->block_size,
+            elapsed,
+            (double)self->n_frames / elapsed,
+            (double)self->n_frames / self->sample_rate / elapsed);
+    if (self->graph)
+    {
+      print_graph_stats(self);
+    }
+    if (self->pipeline)
+    {
+      print_pipeline_stats(self, elapsed);
+    }
+    if (self->worker)
+    {
+      PluginWorkerStats stats;
+      plugin_worker_finish(self->worker, &stats);
+      fprintf(stderr,
+              "Worker: %lu requests, %lu responses, %lu dropped (%s)\n",
+              (unsigned long)stats.n_requests,
+              (unsigned long)stats.n_responses,
+              (unsigned long)stats.n_dropped,
+              self->sync_worker ? "synchronous" : "threaded");
+    }
+    if (self->count_perf)
+    {
+      print_perf_stats(self);
+    }
+  }
+
+  unsigned n_dropped = self->n_dropped_events;
+  for (unsigned n = 0; n < self->n_nodes; ++n)
+  {
+    n_dropped += self->nodes[n].n_dropped_events;
+  }
+  if (n_dropped)
+  {
+    fprintf(stderr,
+            "warning: Dropped %u events that overflowed event buffers\n",
+            n_dropped);
+  }
+
+  /* Batch jobs share a timer, which the batch reports */
+  if (self->timer && !self->shared)
+  {
+    return cleanup(report_timing(self->timer, self->timing_path), self);
+  }
+
+  return cleanup(0, self);
+}
+
+/** A batch of render jobs shared by a pool of worker threads */
+typedef struct
+{
+  LV2Apply *jobs;                 ///< Jobs, rendered in any order
+  unsigned n_jobs;                ///< Number of jobs
+  std::atomic<unsigned> next;     ///< Index of the next job to take
+  std::atomic<unsigned> n_failed; ///< Number of jobs that failed
+} Batch;
+
+static void *
+batch_worker(void *data)
+{
+  Batch *batch = (Batch *)data;
+  trace_thread_name("batch worker");
+  for (unsigned i; (i = batch->next.fetch_add(1)) < batch->n_jobs;)
+  {
+    if (render(&batch->jobs[i]))
+    {
+      batch->n_failed.fetch_add(1);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+   Parse the rest of a line as note=NOTE, events=PATH and SYMBOL=VALUE
+   settings for `job`, continuing the strtok_r() split with `save`.
+
+   Errors are reported as being on line `lineno` of a `what`.
+*/
+static int
+parse_settings(LV2Apply *job, char **save, const char *what, unsigned lineno)
+{
+  for (char *arg; (arg = strtok_r(NULL, " \t\n", save));)
+  {
+    char *eq = strchr(arg, '=');
+    if (!eq)
+    {
+      fprintf(stderr, "error: %s %u: Expected KEY=VALUE, not %s\n",
+              what, lineno, arg);
+      return 1;
+    }
+
+    *eq = '\0';
+    const char *value = eq + 1;
+    if (!strcmp(arg, "note"))
+    {
+      char *end = NULL;
+      const long note = strtol(value, &end, 10);
+      if (end == value || *end || note < 0 || note > 127 ||
+          job->n_notes == MAX_NOTES)
+      {
+        fprintf(stderr, "error: %s %u: Invalid note or more than %d notes\n",
+                what, lineno, MAX_NOTES);
+        return 1;
+      }
+      job->notes[job->n_notes++] = (uint8_t)note;
+    }
+    else if (!strcmp(arg, "events"))
+    {
+      job->events_path = value;
+    }
+    else
+    {
+      Param *params = (Param *)realloc(job->params,
+                                       (job->n_params + 1) * sizeof(Param));
+      if (!params)
+      {
+        return 1;
+      }
+
+      job->params = params;
+      job->params[job->n_params].sym = arg;
+      job->params[job->n_params++].value = (float)atof(value);
+    }
+  }
+
+  return 0;
+}
+
+/**
+   Parse one job line into `job`, which has been initialised from defaults.
+
+   A job is a plugin URI, output path and duration in seconds, followed by
+   any number of note=NOTE, events=PATH, and SYMBOL=VALUE control settings:
+
+     http://tytel.org/helm clip1.wav 2.5 note=60 note=64 volume=0.5
+
+   Returns zero on success.
+*/
+static int
+parse_job(LV2Apply *job, const char *line, unsigned lineno)
+{
+  if (!(job->job_line = strdup(line)))
+  {
+    return 1;
+  }
+
+  char *save = NULL;
+  const char *uri_str = strtok_r(job->job_line, " \t\n", &save);
+  const char *out_path = strtok_r(NULL, " \t\n", &save);
+  const char *seconds = strtok_r(NULL, " \t\n", &save);
+  if (!uri_str || !out_path || !seconds || atof(seconds) <= 0.0)
+  {
+    fprintf(stderr, "error: Job %u: Expected URI OUT_FILE SECONDS\n", lineno);
+    return 1;
+  }
+
+  LilvNode *uri = lilv_new_uri(job->world, uri_str);
+  job->plugin =
+      lilv_plugins_get_by_uri(lilv_world_get_all_plugins(job->world), uri);
+  lilv_node_free(uri);
+  if (!job->plugin)
+  {
+    fprintf(stderr, "error: Job %u: Plugin <%s> not found\n", lineno, uri_str);
+    return 1;
+  }
+
+  job->out_path = out_path;
+  job->n_frames = (int64_t)(atof(seconds) * job->sample_rate);
+  return parse_settings(job, &save, "Job", lineno);
+}
+
+/**
+   Render every job in a job list on `n_threads` worker threads.
+
+   The world is discovered once by the caller and shared by every job, and
+   each job gets its own instance.  If `n_pooled` is not zero, that many
+   instances are made for the first jobs before rendering, and jobs take
+   instances from this pool and return them when done instead of
+   instantiating and freeing their own.  Blank lines and lines starting with
+   '#' are ignored, see parse_job() for the job syntax.
+*/
+static int
+run_batch(LV2Apply *defaults,
+          const char *path,
+          unsigned n_threads,
+          unsigned n_pooled)
+{
+  FILE *fd = fopen(path, "r");
+  if (!fd)
+  {
+    return fatal(defaults, 11, "Failed to open job list %s\n", path);
+  }
+
+  Batch batch;
+  batch.jobs = NULL;
+  batch.n_jobs = 0;
+  batch.next.store(0);
+  batch.n_failed.store(0);
+
+  pthread_mutexattr_t attr;
+  pthread_mutex_t lock;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  SnapshotCache snapshots;
+  memset(&snapshots, 0, sizeof(snapshots));
+
+  InstancePool pool;
+  pool_init(&pool, defaults->urid_map, n_pooled);
+
+  /* Parse all jobs up front, so errors are reported before rendering */
+  int st = 0;
+  char line[4096];
+  for (unsigned l = 1; !st && fgets(line, sizeof(line), fd); ++l)
+  {
+    const char *s = line + strspn(line, " \t");
+    if (*s == '#' || *s == '\n' || !*s)
+    {
+      continue;
+    }
+
+    LV2Apply *jobs = (LV2Apply *)realloc(
+        batch.jobs, (batch.n_jobs + 1) * sizeof(LV2Apply));
+    if (!jobs)
+    {
+      st = 10;
+      break;
+    }
+
+    LV2Apply *job = &(batch.jobs = jobs)[batch.n_jobs++];
+    memcpy(job, defaults, sizeof(LV2Apply));
+    job->shared = true;
+    job->quiet = true;
+    job->lock = &lock;
+    job->snapshots = job->preroll > 0.0 ? &snapshots : NULL;
+    job->pool = n_pooled ? &pool : NULL;
+    if (parse_job(job, line, l))
+    {
+      st = 11;
+    }
+    else if (!job->n_notes && !job->events_path)
+    {
+      job->notes[job->n_notes++] = 60;
+    }
+  }
+  fclose(fd);
+
+  double audio_seconds = 0.0;
+  for (unsigned i = 0; i < batch.n_jobs; ++i)
+  {
+    audio_seconds +=
+        (double)batch.jobs[i].n_frames / batch.jobs[i].sample_rate;
+  }
+
+  if (!st && n_pooled)
+  {
+    pool_fill(&pool, batch.jobs, batch.n_jobs);
+  }
+
+  /* Render on the worker threads */
+  const double start = now();
+  if (!st)
+  {
+    pthread_t threads[MAX_BATCH_THREADS];
+    unsigned n_started = 0;
+    for (; n_started + 1 < n_threads; ++n_started)
+    {
+      if (pthread_create(&threads[n_started], NULL, batch_worker, &batch))
+      {
+        break;
+      }
+    }
+
+    /* The main thread is one of the workers */
+    batch_worker(&batch);
+    for (unsigned t = 0; t < n_started; ++t)
+    {
+      pthread_join(threads[t], NULL);
+    }
+  }
+  else
+  {
+    /* Only the strings of jobs that were not rendered need to be freed */
+    for (unsigned i = 0; i < batch.n_jobs; ++i)
+    {
+      free(batch.jobs[i].job_line);
+      free(batch.jobs[i].params);
+    }
+  }
+  const double elapsed = now() - start;
+
+  if (!st)
+  {
+    fprintf(stderr,
+            "Batch: %u jobs (%u failed) on %u threads in %.3f s, "
+            "%.1f jobs/s, %.1fx realtime\n",
+            batch.n_jobs,
+            batch.n_failed.load(),
+            n_threads,
+            elapsed,
+            batch.n_jobs / elapsed,
+            audio_seconds / elapsed);
+  }
+  if (!st && defaults->count_perf)
+  {
+    PerfTotals perf;
+    memset(&perf, 0, sizeof(perf));
+    for (unsigned i = 0; i < batch.n_jobs; ++i)
+    {
+      perf_totals_add(&perf, &batch.jobs[i].perf);
+    }
+
+    const char *reason = perf_unavailable_reason();
+    if (reason)
+    {
+      fprintf(stderr, "Perf counters unavailable (%s)\n", reason);
+    }
+    else
+    {
+      fprintf(stderr, "Perf counters per run:\n");
+      print_perf_totals("all jobs", &perf);
+    }
+  }
+  if (!st && snapshots.n_snapshots)
+  {
+    const unsigned n_restored = snapshots.n_restored;
+    fprintf(stderr,
+            "Snapshots: %u taken, %u jobs restored one in %.3f ms "
+            "instead of pre-rolling, %.3f s saved\n",
+            snapshots.n_snapshots,
+            n_restored,
+            n_restored ? snapshots.restore_time * 1e3 / n_restored : 0.0,
+            snapshots.saved_time);
+  }
+
+  if (!st && n_pooled)
+  {
+    fprintf(stderr,
+            "Pool: %u hits, %u misses, %u instances made in %.3f ms each, "
+            "%u reset in %.3f ms each\n",
+            pool.n_hits,
+            pool.n_misses,
+            pool.n_created,
+            pool.n_created ? pool.create_time * 1e3 / pool.n_created : 0.0,
+            pool.n_resets,
+            pool.n_resets ? pool.reset_time * 1e3 / pool.n_resets : 0.0);
+  }
+
+  for (unsigned i = 0; i < pool.n_idle; ++i)
+  {
+    pool_destroy(&pool.idle[i]);
+  }
+  free(pool.idle);
+
+  for (unsigned i = 0; i < snapshots.n_snapshots; ++i)
+  {
+    lilv_state_free(snapshots.snapshots[i].state);
+    free(snapshots.snapshots[i].key);
+  }
+  free(snapshots.snapshots);
+  pthread_mutex_destroy(&lock);
+  free(batch.jobs);
+  if (!st && batch.n_failed.load())
+  {
+    st = 12;
+  }
+  if (!st && defaults->timer)
+  {
+    st = report_timing(defaults->timer, defaults->timing_path);
+  }
+
+  return cleanup(st, defaults);
+}
+
+/** Return the index of the graph node called `name`, or n_nodes if none. */
+static unsigned
+find_node(const LV2Apply *self, const char *name)
+{
+  unsigned n = 0;
+  while (n < self->n_nodes && strcmp(self->nodes[n].name, name))
+  {
+    ++n;
+  }
+  return n;
+}
+
+/** Add a graph node from the rest of a `node` line, see load_graph(). */
+static int
+add_node(LV2Apply *self, const char *line, unsigned lineno)
+{
+  LV2Apply *nodes =
+      (LV2Apply *)realloc(self->nodes, (self->n_nodes + 1) * sizeof(LV2Apply));
+  if (!nodes)
+  {
+    return 10;
+  }
+
+  LV2Apply *node = &(self->nodes = nodes)[self->n_nodes++];
+  memset(node, 0, sizeof(LV2Apply));
+  node->world = self->world;
+  node->block_size = self->block_size;
+  node->sample_rate = self->sample_rate;
+  node->n_frames = self->n_frames;
+  node->sync_worker = self->sync_worker;
+  node->timer = self->timer;
+  node->count_perf = self->count_perf;
+  node->shared = true;
+  node->quiet = true;
+  if (!(node->job_line = strdup(line)))
+  {
+    return 10;
+  }
+
+  char *save = NULL;
+  const char *name = strtok_r(node->job_line, " \t\n", &save);
+  const char *uri_str = strtok_r(NULL, " \t\n", &save);
+  if (!name || !uri_str)
+  {
+    fprintf(stderr, "error: Graph line %u: Expected node NAME URI\n", lineno);
+    return 11;
+  }
+
+  node->name = name;
+  if (find_node(self, name) != self->n_nodes - 1)
+  {
+    fprintf(stderr, "error: Graph line %u: Node `%s' exists\n", lineno, name);
+    return 11;
+  }
+
+  LilvNode *uri = lilv_new_uri(self->world, uri_str);
+  node->plugin =
+      lilv_plugins_get_by_uri(lilv_world_get_all_plugins(self->world), uri);
+  lilv_node_free(uri);
+  if (!node->plugin)
+  {
+    fprintf(stderr, "error: Graph line %u: Plugin <%s> not found\n",
+            lineno, uri_str);
+    return 11;
+  }
+
+  return parse_settings(node, &save, "Graph line", lineno) ? 11 : 0;
+}
+
+/**
+   Load a processing graph and compile its schedule for `n_threads` threads.
+
+   Each line adds a node, a connection between two nodes, or an output:
+
+     node synth http://tytel.org/helm note=60 volume=0.5
+     node delay http://example.org/delay time=0.25
+     connect synth delay
+     output delay
+
+   A node is a plugin with the same settings as a batch job, see
+   parse_job(), and must come before the lines that use its name.  A
+   connection feeds the outputs of the first node to the inputs of the
+   second, see connect_inputs(), and the output file gets the sum of the
+   output nodes.  Blank lines and lines starting with '#' are ignored.
+*/
+static int
+load_graph(LV2Apply *self, const char *path, unsigned n_threads)
+{
+  FILE *fd = fopen(path, "r");
+  if (!fd)
+  {
+    return fatal(self, 11, "Failed to open graph %s\n", path);
+  }
+
+  int st = 0;
+  unsigned n_outputs = 0;
+  char line[4096];
+  for (unsigned l = 1; !st && fgets(line, sizeof(line), fd); ++l)
+  {
+    char *save = NULL;
+    const char *end = line + strlen(line);
+    const char *key = strtok_r(line, " \t\n", &save);
+    if (!key || *key == '#')
+    {
+      continue;
+    }
+
+    if (!strcmp(key, "node"))
+    {
+      /* Only the delimiter after the keyword has been overwritten */
+      const char *rest = key + strlen(key);
+      st = add_node(self, rest < end ? rest + 1 : rest, l);
+      continue;
+    }
+
+    const bool output = !strcmp(key, "output");
+    if (!output && strcmp(key, "connect"))
+    {
+      fprintf(stderr, "error: Graph line %u: Unknown keyword `%s'\n", l, key);
+      st = 11;
+      continue;
+    }
+
+    const char *from_name = strtok_r(NULL, " \t\n", &save);
+    const char *to_name = output ? NULL : strtok_r(NULL, " \t\n", &save);
+    const unsigned from =
+        from_name ? find_node(self, from_name) : self->n_nodes;
+    const unsigned to = output    ? GRAPH_OUTPUT
+                        : to_name ? find_node(self, to_name)
+                                  : self->n_nodes;
+    if (from == self->n_nodes || to == self->n_nodes)
+    {
+      fprintf(stderr, "error: Graph line %u: Expected %s\n",
+              l, output ? "output NODE" : "connect NODE NODE");
+      st = 11;
+      continue;
+    }
+
+    /* A second edge would mix the same outputs into the input again */
+    bool duplicate = false;
+    for (unsigned e = 0; !duplicate && e < self->n_edges; ++e)
+    {
+      duplicate = self->edges[2 * e] == from && self->edges[2 * e + 1] == to;
+    }
+    if (duplicate)
+    {
+      fprintf(stderr, "error: Graph line %u: Duplicate %s\n",
+              l, output ? "output" : "connection");
+      st = 11;
+      continue;
+    }
+
+    unsigned *edges = (unsigned *)realloc(
+        self->edges, 2 * (self->n_edges + 1) * sizeof(unsigned));
+    if (!edges)
+    {
+      st = 10;
+      continue;
+    }
+
+    self->edges = edges;
+    self->edges[2 * self->n_edges] = from;
+    self->edges[2 * self->n_edges++ + 1] = to;
+    n_outputs += output;
+  }
+  fclose(fd);
+
+  if (st)
+  {
+    return cleanup(st, self);
+  }
+  if (!n_outputs)
+  {
+    return fatal(self, 11, "Graph %s has no output\n", path);
+  }
+
+  if (!(self->graph = graph_new(self->n_nodes, n_threads, run_node, self)))
+  {
+    return fatal(self, 10, "Failed to allocate graph\n");
+  }
+
+  for (unsigned e = 0; e < self->n_edges; ++e)
+  {
+    if (self->edges[2 * e + 1] != GRAPH_OUTPUT &&
+        graph_connect(self->graph, self->edges[2 * e], self->edges[2 * e + 1]))
+    {
+      return fatal(self, 10, "Failed to allocate graph\n");
+    }
+  }
+
+  if (graph_compile(self->graph))
+  {
+    return fatal(self, 11, "Graph %s has a cycle or failed to start\n", path);
+  }
+
+  return 0;
+}
+
+/** Load every bundle into the world. */
+static void
+load_world(LilvWorld *world)
+{
+  const uint64_t t0 = trace_begin();
+  lilv_world_load_all(world);
+  trace_end(t0, "load world", "all bundles");
+}
+
+/** Record the time since `start` as `phase` in `times`, return the time. */
+static double
+end_phase(double *times, StartupPhase phase, double start)
+{
+  const double end = now();
+  times[phase] = end - start;
+  return end;
+}
+
+/**
+   Go through startup once for the plugin at `uri` and time every phase.
+
+   This does what a render does up to activation, with a world of its own,
+   and then tears it all down again so the next run starts cold.  The output
+   is opened at `scratch_path`, so the real output file is left alone.  The
+   plugin binary is opened with dlopen() before instantiating, so that loading
+   it is timed apart from the plugin's instantiate().
+*/
+static int
+profile_startup_once(const LV2Apply *self,
+                     const char *uri,
+                     bool use_index,
+                     const char *scratch_path,
+                     double *times)
+{
+  LV2Apply run;
+  memset(&run, 0, sizeof(run));
+  run.sample_rate = self->sample_rate;
+  run.block_size = self->block_size;
+  run.sync_worker = self->sync_worker;
+  run.quiet = true;
+
+  double t = now();
+  run.world = lilv_world_new();
+  t = end_phase(times, PHASE_WORLD_NEW, t);
+
+  LilvNode *plugin_uri = lilv_new_uri(run.world, uri);
+  char *index_path = use_index ? plugin_index_default_path() : NULL;
+  t = now();
+  if (!index_path ||
+      !plugin_index_load_plugins(run.world, index_path, &uri, 1))
+  {
+    lilv_world_load_all(run.world);
+  }
+  t = end_phase(times, PHASE_LOAD_WORLD, t);
+  free(index_path);
+
+  run.plugin = lilv_plugins_get_by_uri(lilv_world_get_all_plugins(run.world),
+                                       plugin_uri);
+  t = end_phase(times, PHASE_FIND_PLUGIN, t);
+  lilv_node_free(plugin_uri);
+  if (!run.plugin)
+  {
+    return fatal(&run, 3, "Plugin <%s> not found\n", uri);
+  }
+
+  /* The plugin's data files are parsed the first time they are needed */
+  lilv_plugin_get_num_ports(run.plugin);
+  t = end_phase(times, PHASE_PLUGIN_DATA, t);
+
+  if (create_ports(&run))
+  {
+    return 5;
+  }
+  t = end_phase(times, PHASE_PORTS, t);
+
+  if (init_features(&run))
+  {
+    return 10;
+  }
+  t = end_phase(times, PHASE_FEATURES, t);
+
+  SF_INFO out_fmt = {0, 0, 0, 0, 0, 0};
+  out_fmt.format = SF_FORMAT_WAV | SF_FORMAT_FLOAT;
+  out_fmt.samplerate = (int)run.sample_rate;
+  out_fmt.channels = run.n_audio_out ? (int)run.n_audio_out : 1;
+  run.out_path = scratch_path;
+  if (!(run.out_file = sopen(&run, run.out_path, SFM_WRITE, &out_fmt)))
+  {
+    return 8;
+  }
+  t = end_phase(times, PHASE_OPEN_OUTPUT, t);
+
+  const LilvNode *lib_uri = lilv_plugin_get_library_uri(run.plugin);
+  char *lib_path =
+      lib_uri ? lilv_file_uri_parse(lilv_node_as_uri(lib_uri), NULL) : NULL;
+  void *lib = lib_path ? dlopen(lib_path, RTLD_NOW) : NULL;
+  t = end_phase(times, PHASE_DLOPEN, t);
+  if (!lib)
+  {
+    /* Otherwise the loading would be timed as part of instantiating */
+    fatal(&run,
+          6,
+          "Failed to open plugin library %s (%s)\n",
+          lib_path ? lib_path : "",
+          lib_path ? dlerror() : "no library URI");
+    lilv_free(lib_path);
+    return 6;
+  }
+  lilv_free(lib_path);
+
+  if (!instantiate(&run))
+  {
+    dlclose(lib);
+    return fatal(&run, 6, "Failed to instantiate plugin\n");
+  }
+  t = end_phase(times, PHASE_INSTANTIATE, t);
+
+  set_active(&run, true);
+  t = end_phase(times, PHASE_ACTIVATE, t);
+
+  cleanup(0, &run);
+  dlclose(lib);
+  end_phase(times, PHASE_TEARDOWN, t);
+  return 0;
+}
+
+/**
+   Time every phase of startup `n_runs` times and print a breakdown.
+
+   The first run is shown on its own, since only it pays for cold caches,
+   and the others give the minimum, mean and maximum.
+*/
+static int
+profile_startup(const LV2Apply *self,
+                const char *uri,
+                bool use_index,
+                unsigned n_runs)
+{
+  static const char *const names[N_PHASES] = {"world new",
+                                              "load world",
+                                              "find plugin",
+                                              "plugin data",
+                                              "create ports",
+                                              "init features",
+                                              "open output",
+                                              "dlopen",
+                                              "instantiate",
+                                              "activate",
+                                              "teardown"};
+
+  /* Every run opens a scratch file, which is as costly as the real one */
+  char scratch_path[] = "/tmp/demo-profile-XXXXXX";
+  const int scratch_fd = mkstemp(scratch_path);
+  if (scratch_fd < 0)
+  {
+    return fatal(NULL, 8, "Failed to create %s (%s)\n", scratch_path,
+                 strerror(errno));
+  }
+  close(scratch_fd);
+
+  double first[N_PHASES];
+  double min[N_PHASES];
+  double max[N_PHASES];
+  double sum[N_PHASES];
+  for (unsigned r = 0; r < n_runs; ++r)
+  {
+    double times[N_PHASES];
+    const int st =
+        profile_startup_once(self, uri, use_index, scratch_path, times);
+    if (st)
+    {
+      unlink(scratch_path);
+      return st;
+    }
+
+    for (unsigned p = 0; p < N_PHASES; ++p)
+    {
+      if (!r)
+      {
+        first[p] = min[p] = max[p] = sum[p] = times[p];
+      }
+      else
+      {
+        min[p] = std::min(min[p], times[p]);
+        max[p] = std::max(max[p], times[p]);
+        sum[p] += times[p];
+      }
+    }
+  }
+  unlink(scratch_path);
+
+  double totals[4] = {0.0, 0.0, 0.0, 0.0};
+  fprintf(stderr,
+          "Startup of <%s>, %u runs (ms):\n"
+          "  %-14s %9s %9s %9s %9s\n",
+          uri,
+          n_runs,
+          "phase",
+          "first",
+          "min",
+          "mean",
+          "max");
+  for (unsigned p = 0; p < N_PHASES; ++p)
+  {
+    const double mean = sum[p] / n_runs;
+    fprintf(stderr,
+            "  %-14s %9.3f %9.3f %9.3f %9.3f\n",
+            names[p],
+            first[p] * 1e3,
+            min[p] * 1e3,
+            mean * 1e3,
+            max[p] * 1e3);
+    totals[0] += first[p];
+    totals[1] += min[p];
+    totals[2] += mean;
+    totals[3] += max[p];
+  }
+  fprintf(stderr,
+          "  %-14s %9.3f %9.3f %9.3f %9.3f\n",
+          "total",
+          totals[0] * 1e3,
+          totals[1] * 1e3,
+          totals[2] * 1e3,
+          totals[3] * 1e3);
+  return 0;
+}
+
+static int
+finish_trace(const char *path, int status)
+{
+  if (!path)
+  {
+    return status;
+  }
+
+  const int st = trace_write(path);
+  trace_stop();
+  if (st)
+  {
+    return fatal(NULL, 9, "Failed to write trace to %s\n", path);
+  }
+
+  fprintf(stderr, "Wrote trace to %s\n", path);
+  return status;
+}
+
+static int
+print_usage(int status)
+{
+  fprintf(status ? stderr : stdout,
+          "Usage: demo [OPTION]... [PLUGIN_URI]...\n"
+          "Render an instance of PLUGIN_URI (default Helm) to a file.\n"
+          "Several plugins are run as a chain, each feeding the next.\n\n"
+          "  -o OUT_FILE    Output file (default out.wav)\n"
+          "  -d SECONDS     Duration to render (default 4, or all of IN_FILE)\n"
+          "  -i IN_FILE     Stream IN_FILE through the plugin's audio inputs\n"
+          "  -b FRAMES      Block size, %d to %d (default %d)\n"
+          "  -f             Run one frame per call (slow, for comparison)\n"
+          "  -F FORMAT      Output sample format, s16, s24, s32 or f32 "
+          "(default s24)\n"
+          "  -m             Write the output through a memory-mapped file\n"
+          "  -r             Write raw PCM to OUT_FILE, a pipe or `-' for "
+          "stdout\n"
+          "  -n NOTE        MIDI note to play, may be repeated (default 60)\n"
+          "  -e EVENTS      Play time-stamped events from a file\n"
+          "  -L             Print the port buffer arena layout\n"
+          "  -I             Ignore the plugin index and load all bundles\n"
+          "  -s             Do plugin worker jobs synchronously in run(), so "
+          "renders\n"
+          "                 are deterministic\n"
+          "  -p SECONDS     Pre-roll the plugin for SECONDS before rendering, "
+          "once\n"
+          "                 per plugin and control values in a batch\n"
+          "  -q SLOTS       Writer ring depth in blocks, 0 to write inline "
+          "(default %d)\n"
+          "  -B JOBS        Render every job in the file JOBS (one per line:\n"
+          "                 URI OUT_FILE SECONDS [note=N] [events=F] [SYM=VAL])\n"
+          "  -G GRAPH       Render the plugin graph in the file GRAPH (lines:\n"
+          "                 node NAME URI [SETTINGS], connect NAME NAME,\n"
+          "                 output NAME)\n"
+          "  -j THREADS     Number of batch or graph threads (default 1)\n"
+          "  -c             Count cycles, instructions, cache and branch "
+          "misses of\n"
+          "                 every plugin run with perf_event_open()\n"
+          "  -t FILE        Time every plugin run, and write histograms of "
+          "the times\n"
+          "                 and DSP load to FILE as JSON\n"
+          "  -S RUNS        Time every phase of startup RUNS times, print a "
+          "breakdown\n"
+          "                 and exit\n"
+          "  -T FILE        Write a trace of every thread to FILE, for "
+          "chrome://tracing\n"
+          "                 or Perfetto\n"
+          "  -k INSTANCES   Keep INSTANCES activated plugin instances ready "
+          "for\n"
+          "                 batch jobs, and reuse them between jobs\n"
+          "  -P THREADS     Pipeline a chain over THREADS threads, each "
+          "running a\n"
+          "                 group of plugins on a different block\n"
+          "  -h             Display this help and exit\n",
+          MIN_BLOCK_SIZE,
+          MAX_BLOCK_SIZE,
+          DEFAULT_BLOCK_SIZE,
+          DEFAULT_WRITE_SLOTS);
+  return status;
+}
+
+int main(int argc, char **argv)
+{
+  LV2Apply self;
+  memset(&self, 0, sizeof(self));
+
+  /* Parse command line arguments */
+  const char *plugin_uri = "http://tytel.org/helm";
+  double seconds = 4.0;
+  bool have_seconds = false;
+  bool use_index = true;
+  const char *batch_path = NULL;
+  const char *graph_path = NULL;
+  unsigned n_threads = 1;
+  unsigned n_pooled = 0;
+  const char *trace_path = NULL;
+  unsigned n_profile_runs = 0;
+  self.out_path = "out.wav";
+  self.block_size = DEFAULT_BLOCK_SIZE;
+  self.n_slots = DEFAULT_WRITE_SLOTS;
+  self.format = PCM_S24;
+
+  int a = 1;
+  for (; a < argc && argv[a][0] == '-'; ++a)
+  {
+    if (!strcmp(argv[a], "-h") || !strcmp(argv[a], "--help"))
+    {
+      return print_usage(0);
+    }
+    else if (!strcmp(argv[a], "-f"))
+    {
+      self.frame_mode = true;
+    }
+    else if (!strcmp(argv[a], "-L"))
+    {
+      self.print_layout = true;
+    }
+    else if (!strcmp(argv[a], "-m"))
+    {
+      self.map_output = true;
+    }
+    else if (!strcmp(argv[a], "-r"))
+    {
+      self.raw_output = true;
+    }
+    else if (!strcmp(argv[a], "-I"))
+    {
+      use_index = false;
+    }
+    else if (!strcmp(argv[a], "-s"))
+    {
+      self.sync_worker = true;
+    }
+    else if (a + 1 == argc)
+    {
+      return print_usage(1);
+    }
+    else if (!strcmp(argv[a], "-o"))
+    {
+      self.out_path = argv[++a];
+    }
+    else if (!strcmp(argv[a], "-d"))
+    {
+      seconds = atof(argv[++a]);
+      have_seconds = true;
+    }
+    else if (!strcmp(argv[a], "-p"))
+    {
+      self.preroll = atof(argv[++a]);
+      if (self.preroll < 0.0)
+      {
+        return print_usage(1);
+      }
+    }
+    else if (!strcmp(argv[a], "-i"))
+    {
+      self.in_path = argv[++a];
+    }
+    else if (!strcmp(argv[a], "-b"))
+    {
+      const long n = strtol(argv[++a], NULL, 10);
+      if (n < MIN_BLOCK_SIZE || n > MAX_BLOCK_SIZE)
+      {
+        return fatal(NULL, 1, "Block size must be %d to %d frames\n",
+                     MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+      }
+      self.block_size = (uint32_t)n;
+    }
+    else if (!strcmp(argv[a], "-F"))
+    {
+      const char *name = argv[++a];
+      if (!strcmp(name, "s16"))
+      {
+        self.format = PCM_S16;
+      }
+      else if (!strcmp(name, "s24"))
+      {
+        self.format = PCM_S24;
+      }
+      else if (!strcmp(name, "s32"))
+      {
+        self.format = PCM_S32;
+      }
+      else if (!strcmp(name, "f32"))
+      {
+        self.format = PCM_F32;
+      }
+      else
+      {
+        return fatal(NULL, 1, "Unknown sample format `%s'\n", name);
+      }
+    }
+    else if (!strcmp(argv[a], "-n"))
+    {
+      const long note = strtol(argv[++a], NULL, 10);
+      if (note < 0 || note > 127 || self.n_notes == MAX_NOTES)
+      {
+        return fatal(NULL, 1, "Invalid note or more than %d notes\n",
+                     MAX_NOTES);
+      }
+      self.notes[self.n_notes++] = (uint8_t)note;
+    }
+    else if (!strcmp(argv[a], "-e"))
+    {
+      self.events_path = argv[++a];
+    }
+    else if (!strcmp(argv[a], "-B"))
+    {
+      batch_path = argv[++a];
+    }
+    else if (!strcmp(argv[a], "-G"))
+    {
+      graph_path = argv[++a];
+    }
+    else if (!strcmp(argv[a], "-j"))
+    {
+      n_threads = (unsigned)strtoul(argv[++a], NULL, 10);
+      if (n_threads < 1 || n_threads > MAX_BATCH_THREADS)
+      {
+        return fatal(NULL, 1, "Thread count must be 1 to %d\n",
+                     MAX_BATCH_THREADS);
+      }
+    }
+    else if (!strcmp(argv[a], "-P"))
+    {
+      self.n_pipe_groups = (unsigned)strtoul(argv[++a], NULL, 10);
+      if (self.n_pipe_groups < 1 || self.n_pipe_groups > MAX_BATCH_THREADS)
+      {
+        return fatal(NULL, 1, "Thread count must be 1 to %d\n",
+                     MAX_BATCH_THREADS);
+      }
+    }
+    else if (!strcmp(argv[a], "-c"))
+    {
+      self.count_perf = true;
+    }
+    else if (!strcmp(argv[a], "-t"))
+    {
+      self.timing_path = argv[++a];
+    }
+    else if (!strcmp(argv[a], "-S"))
+    {
+      n_profile_runs = (unsigned)strtoul(argv[++a], NULL, 10);
+      if (!n_profile_runs)
+      {
+        return print_usage(1);
+      }
+    }
+    else if (!strcmp(argv[a], "-T"))
+    {
+      trace_path = argv[++a];
+    }
+    else if (!strcmp(argv[a], "-k"))
+    {
+      n_pooled = (unsigned)strtoul(argv[++a], NULL, 10);
+    }
+    else if (!strcmp(argv[a], "-q"))
+    {
+      self.n_slots = (uint32_t)strtoul(argv[++a], NULL, 10);
+    }
+    else
+    {
+      return print_usage(1);
+    }
+  }
+
+  if (graph_path && (batch_path || self.frame_mode || self.in_path || a < argc))
+  {
+    return fatal(NULL, 1, "A graph can not be used with -B, -f, -i or URIs\n");
+  }
+  if (n_profile_runs && (batch_path || graph_path))
+  {
+    return fatal(NULL, 1, "A startup profile can not be used with -B or -G\n");
+  }
+  if (n_pooled && !batch_path)
+  {
+    return print_usage(1);
+  }
+  if (a < argc)
+  {
+    plugin_uri = argv[a++];
+  }
+  if (seconds <= 0.0)
+  {
+    return print_usage(1);
+  }
+
+  /* Any further plugins are chained after the first */
+  const char *const *chain_uris = (const char *const *)argv + a;
+  const unsigned n_chain = (unsigned)(argc - a);
+  if (n_chain && (batch_path || self.frame_mode))
+  {
+    return fatal(NULL, 1, "A chain can not be used with -B or -f\n");
+  }
+  if (self.n_pipe_groups && !n_chain)
+  {
+    return print_usage(1);
+  }
+  if (self.preroll > 0.0 && self.frame_mode)
+  {
+    return fatal(NULL, 1, "A pre-roll can not be used with -f\n");
+  }
+
+  /* Open the input, which sets the rate and by default the length */
+  self.sample_rate = SAMPLE_RATE;
+  self.n_frames = (int64_t)(seconds * SAMPLE_RATE);
+  if (self.in_path)
+  {
+    if (batch_path)
+    {
+      return fatal(NULL, 1, "An input file can not be used with -B\n");
+    }
+
+    SF_INFO in_fmt = {0, 0, 0, 0, 0, 0};
+    if (!(self.in_file = sopen(NULL, self.in_path, SFM_READ, &in_fmt)))
+    {
+      return 8;
+    }
+
+    self.sample_rate = (uint32_t)in_fmt.samplerate;
+    self.n_in_channels = (unsigned)in_fmt.channels;
+    self.n_frames = have_seconds ? (int64_t)(seconds * self.sample_rate)
+                                 : (int64_t)in_fmt.frames;
+  }
+
+  /* Report a reader that goes away as a write error instead of dying */
+  if (self.raw_output)
+  {
+    signal(SIGPIPE, SIG_IGN);
+  }
+
+  if (trace_path)
+  {
+    trace_start(TRACE_SPANS);
+    trace_thread_name("main");
+  }
+  if (self.timing_path && !(self.timer = run_timer_new()))
+  {
+    return fatal(NULL, 10, "Failed to allocate timer\n");
+  }
+
+  /* Profile startup instead of rendering, with worlds of its own */
+  if (n_profile_runs)
+  {
+    const int st =
+        profile_startup(&self, plugin_uri, use_index, n_profile_runs);
+    return finish_trace(trace_path, cleanup(st, &self));
+  }
+
+  /* Create world and plugin URI */
+  const double startup = now();
+  self.world = lilv_world_new();
+  LilvNode *uri = lilv_new_uri(self.world, plugin_uri);
+  if (!uri)
+  {
+    return fatal(&self, 2, "Invalid plugin URI <%s>\n", plugin_uri);
+  }
+
+  /* A batch may use any plugin, so it needs the whole world */
+  if (batch_path)
+  {
+    lilv_node_free(uri);
+    load_world(self.world);
+    if (init_features(&self))
+    {
+      return 10;
+    }
+
+    return finish_trace(trace_path,
+                        run_batch(&self, batch_path, n_threads, n_pooled));
+  }
+
+  /* So may a graph, whose nodes are given in a file */
+  if (graph_path)
+  {
+    lilv_node_free(uri);
+    load_world(self.world);
+    const int st = load_graph(&self, graph_path, n_threads);
+    return st ? st : finish_trace(trace_path, render(&self));
+  }
+
+  /* Discover world, only loading the plugins' bundles if all are indexed */
+  const uint64_t load_start = trace_begin();
+  char *index_path = use_index ? plugin_index_default_path() : NULL;
+  const char **all_uris =
+      (const char **)malloc((n_chain + 1) * sizeof(const char *));
+  bool indexed = false;
+  if (index_path && all_uris)
+  {
+    all_uris[0] = plugin_uri;
+    memcpy(all_uris + 1, chain_uris, n_chain * sizeof(const char *));
+    indexed = plugin_index_load_plugins(
+        self.world, index_path, all_uris, n_chain + 1);
+  }
+  free(all_uris);
+  if (!indexed)
+  {
+    lilv_world_load_all(self.world);
+  }
+  trace_end(load_start, "load world", indexed ? "index" : "all bundles");
+
+  /* Get plugin */
+  const LilvPlugins *plugins = lilv_world_get_all_plugins(self.world);
+  const LilvPlugin *plugin = lilv_plugins_get_by_uri(plugins, uri);
+  lilv_node_free(uri);
+  if (!indexed && index_path && plugin_index_save(self.world, index_path))
+  {
+    fprintf(stderr, "warning: Failed to write plugin index %s\n", index_path);
+  }
+  free(index_path);
+  if (!(self.plugin = plugin))
+  {
+    return fatal(&self, 3, "Plugin <%s> not found\n", plugin_uri);
+  }
+
+  /* Chained plugins share everything but their instance and buffers */
+  if (n_chain)
+  {
+    self.stages = (LV2Apply *)calloc(n_chain, sizeof(LV2Apply));
+    if (!self.stages)
+    {
+      return fatal(&self, 10, "Failed to allocate chain\n");
+    }
+
+    for (unsigned i = 0; i < n_chain; ++i)
+    {
+      LV2Apply *stage = &self.stages[self.n_stages++];
+      LilvNode *stage_uri = lilv_new_uri(self.world, chain_uris[i]);
+      stage->plugin = stage_uri ? lilv_plugins_get_by_uri(plugins, stage_uri)
+                                : NULL;
+      lilv_node_free(stage_uri);
+      if (!stage->plugin)
+      {
+        return fatal(&self, 3, "Plugin <%s> not found\n", chain_uris[i]);
+      }
+
+      stage->world = self.world;
+      stage->block_size = self.block_size;
+      stage->sample_rate = self.sample_rate;
+      stage->n_frames = self.n_frames;
+      stage->sync_worker = self.sync_worker;
+      stage->timer = self.timer;
+      stage->count_perf = self.count_perf;
+      stage->shared = true;
+      stage->quiet = true;
+    }
+  }
+
+  fprintf(stderr,
+          "Found plugin in %.2f ms (%s)\n",
+          (now() - startup) * 1000.0,
+          !use_index ? "index disabled"
+          : indexed  ? "index hit"
+                     : "index miss, rebuilt");
+
+  if (!self.n_notes && !self.events_path)
+  {
+    self.notes[self.n_notes++] = 60;
+  }
+
+  return finish_trace(trace_path, render(&self));
 }
@@ -0,0 +1,555 @@
+// SPDX-License-Identifier: ISC
+
+#include "graph.h"
+
+#include "trace.h"
+
+#include <atomic>
+#include <new>
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define NO_NODE ((unsigned)-1)
+
+/**
+   Chase-Lev work-stealing deque.
+
+   The owner pushes and pops at the bottom, thieves take from the top.  Every
+   node is queued once per run, so a capacity of n_nodes never overflows and
+   the array is never resized.
+*/
+typedef struct
+{
+  std::atomic<int64_t> top;
+  std::atomic<int64_t> bottom;
+  std::atomic<unsigned> *items;
+  int64_t mask;
+} Deque;
+
+struct GraphImpl;
+
+/** A thread of the pool, worker 0 is the thread calling graph_run() */
+typedef struct
+{
+  struct GraphImpl *graph;
+  unsigned index;
+  Deque deque;
+  sem_t start; ///< Posted to start a run
+  pthread_t thread;
+  bool started;
+  unsigned seed; ///< For choosing a victim to steal from
+} Worker;
+
+struct GraphImpl
+{
+  unsigned n_nodes;
+  unsigned n_threads;
+  GraphRunFunc run;
+  void *data;
+  unsigned *n_succs;               ///< Number of successors of each node
+  unsigned **succs;                ///< Successors of each node
+  unsigned *n_preds;               ///< Number of dependencies of each node
+  unsigned *order;                 ///< Nodes in topological order
+  std::atomic<unsigned> *pending;  ///< Unfinished dependencies in this run
+  std::atomic<unsigned> remaining; ///< Nodes left in this run
+  std::atomic<unsigned> n_busy;    ///< Threads still in this run
+  std::atomic<unsigned> n_idle;    ///< Threads asleep on wake
+  std::atomic<bool> exit;          ///< Threads should exit
+  sem_t wake;                      ///< Posted once for each idle thread woken
+  sem_t done;                      ///< Posted when the last thread leaves
+  GraphNodeStats *stats;
+  Worker *workers;
+};
+
+static uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void
+deque_push(Deque *d, unsigned node)
+{
+  const int64_t b = d->bottom.load(std::memory_order_relaxed);
+  d->items[b & d->mask].store(node, std::memory_order_relaxed);
+  d->bottom.store(b + 1, std::memory_order_release);
+}
+
+static unsigned
+deque_pop(Deque *d)
+{
+  const int64_t b = d->bottom.load(std::memory_order_relaxed) - 1;
+  d->bottom.store(b, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int64_t t = d->top.load(std::memory_order_relaxed);
+  if (t > b)
+  {
+    d->bottom.store(b + 1, std::memory_order_relaxed);
+    return NO_NODE;
+  }
+
+  unsigned node = d->items[b & d->mask].load(std::memory_order_relaxed);
+  if (t == b)
+  {
+    /* Last item, race any thief for it */
+    if (!d->top.compare_exchange_strong(
+            t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+    {
+      node = NO_NODE;
+    }
+    d->bottom.store(b + 1, std::memory_order_relaxed);
+  }
+
+  return node;
+}
+
+static unsigned
+deque_steal(Deque *d)
+{
+  int64_t t = d->top.load(std::memory_order_acquire);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  const int64_t b = d->bottom.load(std::memory_order_acquire);
+  if (t >= b)
+  {
+    return NO_NODE;
+  }
+
+  const unsigned node = d->items[t & d->mask].load(std::memory_order_relaxed);
+  if (!d->top.compare_exchange_strong(
+          t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+  {
+    return NO_NODE;
+  }
+
+  return node;
+}
+
+/** Wake up to `n` idle threads, each of them taken off n_idle by this. */
+static void
+wake_idle(Graph *g, unsigned n)
+{
+  /* Order the queueing before the check, see sleep_idle() */
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  unsigned n_idle = g->n_idle.load(std::memory_order_seq_cst);
+  while (n && n_idle)
+  {
+    const unsigned n_woken = n < n_idle ? n : n_idle;
+    if (g->n_idle.compare_exchange_weak(n_idle, n_idle - n_woken))
+    {
+      for (unsigned i = 0; i < n_woken; ++i)
+      {
+        sem_post(&g->wake);
+      }
+      return;
+    }
+  }
+}
+
+/** Return true if any deque has a node to take. */
+static bool
+have_work(Graph *g)
+{
+  for (unsigned i = 0; i < g->n_threads; ++i)
+  {
+    const Deque *d = &g->workers[i].deque;
+    if (d->top.load(std::memory_order_seq_cst) <
+        d->bottom.load(std::memory_order_seq_cst))
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/**
+   Sleep until there may be work or the run has finished.
+
+   The thread counts itself idle before it checks for work one last time,
+   and whoever queues a node or finishes the run checks for idle threads
+   after doing so, so one of them always sees the other.  If the thread
+   finds work but can no longer take itself off n_idle, someone has already
+   posted for it, and it takes that post instead.
+*/
+static void
+sleep_idle(Graph *g)
+{
+  g->n_idle.fetch_add(1, std::memory_order_seq_cst);
+  if (have_work(g) || !g->remaining.load(std::memory_order_seq_cst))
+  {
+    unsigned n_idle = g->n_idle.load(std::memory_order_seq_cst);
+    while (n_idle && !g->n_idle.compare_exchange_weak(n_idle, n_idle - 1))
+    {
+    }
+    if (n_idle)
+    {
+      return;
+    }
+  }
+
+  while (sem_wait(&g->wake))
+  {
+  }
+}
+
+/** Run a node, then queue every successor it was the last dependency of. */
+static void
+execute(Graph *g, Worker *w, unsigned node)
+{
+  const uint64_t t0 = now_ns();
+  g->run(g->data, node);
+  const uint64_t dt = now_ns() - t0;
+
+  GraphNodeStats *stats = &g->stats[node];
+  ++stats->n_runs;
+  stats->total_ns += dt;
+  if (dt > stats->max_ns)
+  {
+    stats->max_ns = dt;
+  }
+
+  unsigned n_ready = 0;
+  for (unsigned s = 0; s < g->n_succs[node]; ++s)
+  {
+    const unsigned succ = g->succs[node][s];
+    if (g->pending[succ].fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+      deque_push(&w->deque, succ);
+      ++n_ready;
+    }
+  }
+
+  /* This thread takes one of the ready nodes itself, idle ones the rest */
+  if (g->remaining.fetch_sub(1, std::memory_order_seq_cst) == 1)
+  {
+    wake_idle(g, g->n_threads);
+  }
+  else if (n_ready > 1)
+  {
+    wake_idle(g, n_ready - 1);
+  }
+}
+
+/** Take part in a run until every node has finished. */
+static void
+work(Graph *g, Worker *w)
+{
+  while (g->remaining.load(std::memory_order_acquire))
+  {
+    unsigned node = deque_pop(&w->deque);
+    for (unsigned i = 1; node == NO_NODE && i < g->n_threads; ++i)
+    {
+      const unsigned victim = (w->index + i + w->seed) % g->n_threads;
+      if (victim != w->index)
+      {
+        node = deque_steal(&g->workers[victim].deque);
+      }
+    }
+
+    if (node != NO_NODE)
+    {
+      execute(g, w, node);
+    }
+    else
+    {
+      w->seed = w->seed * 1103515245u + 12345u;
+      sleep_idle(g);
+    }
+  }
+}
+
+static void *
+worker_thread(void *data)
+{
+  Worker *w = (Worker *)data;
+  Graph *g = w->graph;
+  char name[32];
+  snprintf(name, sizeof(name), "graph worker %u", w->index);
+  trace_thread_name(name);
+  for (;;)
+  {
+    sem_wait(&w->start);
+    if (g->exit.load(std::memory_order_acquire))
+    {
+      break;
+    }
+
+    work(g, w);
+    if (g->n_busy.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+      sem_post(&g->done);
+    }
+  }
+
+  return NULL;
+}
+
+Graph *
+graph_new(unsigned n_nodes, unsigned n_threads, GraphRunFunc run, void *data)
+{
+  Graph *g = new (std::nothrow) Graph();
+  if (!g)
+  {
+    return NULL;
+  }
+
+  g->n_nodes = n_nodes;
+  g->n_threads = n_threads ? n_threads : 1;
+  g->run = run;
+  g->data = data;
+  g->n_succs = new (std::nothrow) unsigned[n_nodes]();
+  g->succs = new (std::nothrow) unsigned *[n_nodes]();
+  g->n_preds = new (std::nothrow) unsigned[n_nodes]();
+  g->order = new (std::nothrow) unsigned[n_nodes]();
+  g->pending = new (std::nothrow) std::atomic<unsigned>[n_nodes]();
+  g->stats = new (std::nothrow) GraphNodeStats[n_nodes]();
+  g->workers = new (std::nothrow) Worker[g->n_threads]();
+  sem_init(&g->wake, 0, 0);
+  sem_init(&g->done, 0, 0);
+
+  int64_t capacity = 1;
+  while (capacity < (int64_t)n_nodes)
+  {
+    capacity *= 2;
+  }
+
+  bool ok = g->n_succs && g->succs && g->n_preds && g->order && g->pending &&
+            g->stats && g->workers;
+  for (unsigned i = 0; g->workers && i < g->n_threads; ++i)
+  {
+    Worker *w = &g->workers[i];
+    w->graph = g;
+    w->index = i;
+    w->seed = i;
+    w->deque.items = new (std::nothrow) std::atomic<unsigned>[capacity]();
+    w->deque.mask = capacity - 1;
+    sem_init(&w->start, 0, 0);
+    ok = ok && w->deque.items;
+  }
+
+  if (!ok)
+  {
+    graph_free(g);
+    return NULL;
+  }
+
+  return g;
+}
+
+int
+graph_connect(Graph *g, unsigned from, unsigned to)
+{
+  if (from >= g->n_nodes || to >= g->n_nodes)
+  {
+    return 1;
+  }
+
+  unsigned *succs = (unsigned *)realloc(
+      g->succs[from], (g->n_succs[from] + 1) * sizeof(unsigned));
+  if (!succs)
+  {
+    return 1;
+  }
+
+  g->succs[from] = succs;
+  g->succs[from][g->n_succs[from]++] = to;
+  ++g->n_preds[to];
+  return 0;
+}
+
+int
+graph_compile(Graph *g)
+{
+  /* Kahn's algorithm, using order as the queue */
+  unsigned *n_left = (unsigned *)calloc(g->n_nodes, sizeof(unsigned));
+  if (!n_left)
+  {
+    return 1;
+  }
+
+  unsigned n_ordered = 0;
+  for (unsigned i = 0; i < g->n_nodes; ++i)
+  {
+    if (!(n_left[i] = g->n_preds[i]))
+    {
+      g->order[n_ordered++] = i;
+    }
+  }
+
+  for (unsigned i = 0; i < n_ordered; ++i)
+  {
+    const unsigned node = g->order[i];
+    for (unsigned s = 0; s < g->n_succs[node]; ++s)
+    {
+      if (!--n_left[g->succs[node][s]])
+      {
+        g->order[n_ordered++] = g->succs[node][s];
+      }
+    }
+  }
+
+  free(n_left);
+  if (n_ordered != g->n_nodes)
+  {
+    return 1;
+  }
+
+  for (unsigned i = 1; i < g->n_threads; ++i)
+  {
+    Worker *w = &g->workers[i];
+    if (pthread_create(&w->thread, NULL, worker_thread, w))
+    {
+      return 1;
+    }
+    w->started = true;
+  }
+
+  return 0;
+}
+
+void
+graph_run(Graph *g)
+{
+  if (!g->n_nodes)
+  {
+    return;
+  }
+
+  /* Every thread has left the last run, so the counters can be reset */
+  Worker *self = &g->workers[0];
+  for (unsigned i = 0; i < g->n_nodes; ++i)
+  {
+    g->pending[i].store(g->n_preds[i], std::memory_order_relaxed);
+  }
+  g->remaining.store(g->n_nodes, std::memory_order_relaxed);
+  for (unsigned i = 0; i < g->n_nodes && !g->n_preds[g->order[i]]; ++i)
+  {
+    deque_push(&self->deque, g->order[i]);
+  }
+
+  g->n_busy.store(g->n_threads - 1, std::memory_order_release);
+  for (unsigned i = 1; i < g->n_threads; ++i)
+  {
+    sem_post(&g->workers[i].start);
+  }
+
+  work(g, self);
+  while (g->n_threads > 1 && sem_wait(&g->done))
+  {
+  }
+}
+
+const unsigned *
+graph_order(const Graph *g)
+{
+  return g->order;
+}
+
+const GraphNodeStats *
+graph_node_stats(const Graph *g, unsigned node)
+{
+  return &g->stats[node];
+}
+
+unsigned
+graph_critical_path(const Graph *g, unsigned *path, double *path_ns)
+{
+  double *dist = (double *)calloc(g->n_nodes, sizeof(double));
+  unsigned *from = (unsigned *)calloc(g->n_nodes, sizeof(unsigned));
+  if (!dist || !from || !g->n_nodes)
+  {
+    free(from);
+    free(dist);
+    *path_ns = 0.0;
+    return 0;
+  }
+
+  /* Longest path to the end of each node, in topological order */
+  unsigned end = g->order[0];
+  for (unsigned i = 0; i < g->n_nodes; ++i)
+  {
+    from[i] = NO_NODE;
+  }
+  for (unsigned i = 0; i < g->n_nodes; ++i)
+  {
+    const unsigned node = g->order[i];
+    const GraphNodeStats *st = &g->stats[node];
+    dist[node] += st->n_runs ? (double)st->total_ns / st->n_runs : 0.0;
+    if (dist[node] > dist[end])
+    {
+      end = node;
+    }
+
+    for (unsigned s = 0; s < g->n_succs[node]; ++s)
+    {
+      const unsigned succ = g->succs[node][s];
+      if (from[succ] == NO_NODE || dist[node] > dist[succ])
+      {
+        dist[succ] = dist[node];
+        from[succ] = node;
+      }
+    }
+  }
+
+  /* Walk back from the end, then reverse */
+  unsigned n = 0;
+  for (unsigned node = end; node != NO_NODE; node = from[node])
+  {
+    path[n++] = node;
+  }
+  for (unsigned i = 0; i < n / 2; ++i)
+  {
+    const unsigned tmp = path[i];
+    path[i] = path[n - 1 - i];
+    path[n - 1 - i] = tmp;
+  }
+
+  *path_ns = dist[end];
+  free(from);
+  free(dist);
+  return n;
+}
+
+void
+graph_free(Graph *g)
+{
+  if (!g)
+  {
+    return;
+  }
+
+  g->exit.store(true, std::memory_order_release);
+  for (unsigned i = 0; g->workers && i < g->n_threads; ++i)
+  {
+    Worker *w = &g->workers[i];
+    if (w->started)
+    {
+      sem_post(&w->start);
+      pthread_join(w->thread, NULL);
+    }
+    sem_destroy(&w->start);
+    delete[] w->deque.items;
+  }
+
+  for (unsigned i = 0; g->succs && i < g->n_nodes; ++i)
+  {
+    free(g->succs[i]);
+  }
+
+  sem_destroy(&g->done);
+  sem_destroy(&g->wake);
+  delete[] g->workers;
+  delete[] g->stats;
+  delete[] g->pending;
+  delete[] g->order;
+  delete[] g->n_preds;
+  delete[] g->succs;
+  delete[] g->n_succs;
+  delete g;
+}
@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: ISC
+
+#ifndef GRAPH_H
+#define GRAPH_H
+
+#include <stdint.h>
+
+/**
+   Static dependency graph run by a work-stealing thread pool.
+
+   Nodes are numbered from 0, and edges say a node must finish before
+   another starts.  graph_compile() checks for cycles and fixes the
+   topological order once.  Each graph_run() then runs every node exactly
+   once: the sources are queued on the calling thread, and every node that
+   finishes queues the successors it was the last dependency of on its own
+   thread's deque.  Idle threads steal from the other end of the other
+   deques, so independent branches run on separate cores, and sleep on a
+   semaphore when there is nothing to steal until more nodes are queued.
+   Each node is timed, for finding the critical path.
+*/
+typedef struct GraphImpl Graph;
+
+/** Function that processes one node, called from any thread. */
+typedef void (*GraphRunFunc)(void *data, unsigned node);
+
+/** Timing of one node, accumulated over every run. */
+typedef struct
+{
+  uint64_t n_runs;   ///< Number of times the node ran
+  uint64_t total_ns; ///< Total time spent in the node
+  uint64_t max_ns;   ///< Longest single run of the node
+} GraphNodeStats;
+
+/**
+   Create a graph of n_nodes nodes run by n_threads threads in total.
+
+   The thread that calls graph_run() is one of them, so one thread means no
+   extra threads are started.
+*/
+Graph *
+graph_new(unsigned n_nodes, unsigned n_threads, GraphRunFunc run, void *data);
+
+/** Add an edge so that `to` only runs after `from` in every run. */
+int
+graph_connect(Graph *graph, unsigned from, unsigned to);
+
+/**
+   Compute the schedule and start the threads.
+
+   Returns non-zero if the graph has a cycle or the threads failed to start.
+*/
+int
+graph_compile(Graph *graph);
+
+/** Run every node once, returning when they have all finished. */
+void
+graph_run(Graph *graph);
+
+/** Return the nodes in topological order, valid after graph_compile(). */
+const unsigned *
+graph_order(const Graph *graph);
+
+/** Return the timing of a node. */
+const GraphNodeStats *
+graph_node_stats(const Graph *graph, unsigned node);
+
+/**
+   Find the path through the graph with the longest mean run time.
+
+   Stores the nodes of the path in `path`, which must have room for every
+   node, and returns their number.  The mean time of the path is stored in
+   `path_ns`.
+*/
+unsigned
+graph_critical_path(const Graph *graph, unsigned *path, double *path_ns);
+
+/** Stop the threads and free a graph. */
+void
+graph_free(Graph *graph);
+
+#endif // GRAPH_H
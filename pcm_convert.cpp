@@ -0,0 +1,710 @@
+// SPDX-License-Identifier: ISC
+
+#include "pcm_convert.h"
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PCM_X86 1
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define PCM_NEON 1
+#endif
+
+/** Frames interleaved at a time, so the scratch buffer stays in L1 */
+#define CHUNK_SAMPLES 2048
+
+typedef void (*ConvertFunc)(const float *, size_t, PcmFormat, uint8_t *);
+
+/** Interleave and convert as many frames as a kernel can, return how many */
+typedef uint32_t (*InterleaveFunc)(const float *const *,
+                                   uint32_t,
+                                   uint32_t,
+                                   PcmFormat,
+                                   uint8_t *);
+
+/** Return the scale of a format, the largest positive sample. */
+static inline float
+pcm_scale(PcmFormat format)
+{
+  return format == PCM_S16   ? (float)0x7FFF
+         : format == PCM_S24 ? (float)0x7FFFFF
+                             : (float)0x7FFFFFFF;
+}
+
+/** Return the lower clipping bound of a format, as a scaled float. */
+static inline float
+pcm_min(PcmFormat format)
+{
+  return -pcm_scale(format) - 1.0f;
+}
+
+/** Return the upper clipping bound of a format, as a scaled float. */
+static inline float
+pcm_max(PcmFormat format)
+{
+  /* 0x7FFFFFFF is not a float, it is caught by the overflow check instead */
+  return format == PCM_S32 ? 2147483648.0f : pcm_scale(format);
+}
+
+/** Scale, round and clip a single sample. */
+static inline int32_t
+convert_sample(float x, PcmFormat format)
+{
+  const float scaled = x * pcm_scale(format);
+  const double max = format == PCM_S16   ? 0x7FFF
+                     : format == PCM_S24 ? 0x7FFFFF
+                                         : 0x7FFFFFFF;
+  if (scaled >= max)
+  {
+    return (int32_t)max;
+  }
+  if (scaled <= -max - 1.0)
+  {
+    return (int32_t)(-max - 1.0);
+  }
+  return (int32_t)lrintf(scaled);
+}
+
+/** Store a sample in the size of an integer `format`, little-endian. */
+static inline void
+store_sample(uint8_t *out, int32_t s, PcmFormat format)
+{
+  const uint32_t u = (uint32_t)s;
+  out[0] = (uint8_t)u;
+  out[1] = (uint8_t)(u >> 8);
+  if (format != PCM_S16)
+  {
+    out[2] = (uint8_t)(u >> 16);
+    if (format == PCM_S32)
+    {
+      out[3] = (uint8_t)(u >> 24);
+    }
+  }
+}
+
+static void
+convert_scalar(const float *in, size_t n, PcmFormat format, uint8_t *out)
+{
+  for (size_t i = 0; i < n; ++i)
+  {
+    store_sample(out + i * pcm_sample_size(format),
+                 convert_sample(in[i], format),
+                 format);
+  }
+}
+
+/** Copy floats unchanged, for PCM_F32 which needs no conversion. */
+static void
+copy_float(const float *in, size_t n, PcmFormat, uint8_t *out)
+{
+  memcpy(out, in, n * sizeof(float));
+}
+
+/** Interleave nothing, for kernels that leave it all to the caller. */
+static uint32_t
+interleave_none(const float *const *, uint32_t, uint32_t, PcmFormat, uint8_t *)
+{
+  return 0;
+}
+
+#ifdef PCM_X86
+
+/**
+   Scale, clip and round 4 samples.
+
+   Conversion of a float at or above 2^31 gives 0x80000000, so those lanes
+   are flipped to 0x7FFFFFFF, which only happens for PCM_S32.
+*/
+__attribute__((target("ssse3"))) static inline __m128i
+to_int_ssse3(__m128 in, __m128 scale, __m128 lo, __m128 hi)
+{
+  const __m128 x = _mm_min_ps(_mm_max_ps(_mm_mul_ps(in, scale), lo), hi);
+  const __m128 overflow = _mm_cmpge_ps(x, _mm_set1_ps(2147483648.0f));
+  return _mm_xor_si128(_mm_cvtps_epi32(x), _mm_castps_si128(overflow));
+}
+
+__attribute__((target("ssse3"))) static void
+convert_ssse3(const float *in, size_t n, PcmFormat format, uint8_t *out)
+{
+  const __m128 scale = _mm_set1_ps(pcm_scale(format));
+  const __m128 lo = _mm_set1_ps(pcm_min(format));
+  const __m128 hi = _mm_set1_ps(pcm_max(format));
+  const __m128i pack24 =
+      _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+  size_t i = 0;
+  if (format == PCM_S16)
+  {
+    for (; i + 8 <= n; i += 8)
+    {
+      const __m128i a = to_int_ssse3(_mm_loadu_ps(in + i), scale, lo, hi);
+      const __m128i b = to_int_ssse3(_mm_loadu_ps(in + i + 4), scale, lo, hi);
+      _mm_storeu_si128((__m128i *)(out + i * 2), _mm_packs_epi32(a, b));
+    }
+  }
+  else if (format == PCM_S24)
+  {
+    /* Each store writes 4 bytes past the 12 it fills, so stop early */
+    for (; i + 8 <= n; i += 4)
+    {
+      const __m128i a = to_int_ssse3(_mm_loadu_ps(in + i), scale, lo, hi);
+      _mm_storeu_si128((__m128i *)(out + i * 3), _mm_shuffle_epi8(a, pack24));
+    }
+  }
+  else
+  {
+    for (; i + 4 <= n; i += 4)
+    {
+      _mm_storeu_si128((__m128i *)(out + i * 4),
+                       to_int_ssse3(_mm_loadu_ps(in + i), scale, lo, hi));
+    }
+  }
+
+  convert_scalar(in + i, n - i, format, out + i * pcm_sample_size(format));
+}
+
+/** Convert 4 interleaved samples and store exactly 4 samples of `format`. */
+__attribute__((target("ssse3"))) static inline void
+store_ssse3(__m128 x, PcmFormat format, __m128 scale, __m128 lo, __m128 hi,
+            uint8_t *out)
+{
+  if (format == PCM_F32)
+  {
+    _mm_storeu_ps((float *)out, x);
+    return;
+  }
+
+  const __m128i s = to_int_ssse3(x, scale, lo, hi);
+  if (format == PCM_S16)
+  {
+    _mm_storel_epi64((__m128i *)out, _mm_packs_epi32(s, s));
+  }
+  else if (format == PCM_S24)
+  {
+    const __m128i p = _mm_shuffle_epi8(
+        s, _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1,
+                         -1));
+    const int32_t last = _mm_cvtsi128_si32(_mm_srli_si128(p, 8));
+    _mm_storel_epi64((__m128i *)out, p);
+    memcpy(out + 8, &last, sizeof(last));
+  }
+  else
+  {
+    _mm_storeu_si128((__m128i *)out, s);
+  }
+}
+
+/**
+   Interleave and convert 2 or 8 channels, 4 frames at a time.
+
+   The channels are interleaved in registers, with unpacks for 2 channels
+   and two 4x4 transposes for 8, and converted before they are stored.
+*/
+__attribute__((target("ssse3"))) static uint32_t
+interleave_ssse3(const float *const *planar,
+                 uint32_t n_channels,
+                 uint32_t n_frames,
+                 PcmFormat format,
+                 uint8_t *out)
+{
+  const __m128 scale = _mm_set1_ps(pcm_scale(format));
+  const __m128 lo = _mm_set1_ps(pcm_min(format));
+  const __m128 hi = _mm_set1_ps(pcm_max(format));
+  const uint32_t size = pcm_sample_size(format);
+
+  uint32_t f = 0;
+  if (n_channels == 2)
+  {
+    for (; f + 4 <= n_frames; f += 4)
+    {
+      const __m128 l = _mm_loadu_ps(planar[0] + f);
+      const __m128 r = _mm_loadu_ps(planar[1] + f);
+      uint8_t *dst = out + (size_t)f * 2 * size;
+      store_ssse3(_mm_unpacklo_ps(l, r), format, scale, lo, hi, dst);
+      store_ssse3(_mm_unpackhi_ps(l, r), format, scale, lo, hi, dst + 4 * size);
+    }
+  }
+  else if (n_channels == 8)
+  {
+    for (; f + 4 <= n_frames; f += 4)
+    {
+      __m128 a0 = _mm_loadu_ps(planar[0] + f);
+      __m128 a1 = _mm_loadu_ps(planar[1] + f);
+      __m128 a2 = _mm_loadu_ps(planar[2] + f);
+      __m128 a3 = _mm_loadu_ps(planar[3] + f);
+      __m128 b0 = _mm_loadu_ps(planar[4] + f);
+      __m128 b1 = _mm_loadu_ps(planar[5] + f);
+      __m128 b2 = _mm_loadu_ps(planar[6] + f);
+      __m128 b3 = _mm_loadu_ps(planar[7] + f);
+      _MM_TRANSPOSE4_PS(a0, a1, a2, a3);
+      _MM_TRANSPOSE4_PS(b0, b1, b2, b3);
+
+      /* Now a holds channels 0 to 3 and b channels 4 to 7 of each frame */
+      uint8_t *dst = out + (size_t)f * 8 * size;
+      store_ssse3(a0, format, scale, lo, hi, dst);
+      store_ssse3(b0, format, scale, lo, hi, dst + 4 * size);
+      store_ssse3(a1, format, scale, lo, hi, dst + 8 * size);
+      store_ssse3(b1, format, scale, lo, hi, dst + 12 * size);
+      store_ssse3(a2, format, scale, lo, hi, dst + 16 * size);
+      store_ssse3(b2, format, scale, lo, hi, dst + 20 * size);
+      store_ssse3(a3, format, scale, lo, hi, dst + 24 * size);
+      store_ssse3(b3, format, scale, lo, hi, dst + 28 * size);
+    }
+  }
+
+  return f;
+}
+
+/** Scale, clip and round 8 samples, see to_int_ssse3(). */
+__attribute__((target("avx2"))) static inline __m256i
+to_int_avx2(__m256 in, __m256 scale, __m256 lo, __m256 hi)
+{
+  const __m256 x =
+      _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(in, scale), lo), hi);
+  const __m256 overflow =
+      _mm256_cmp_ps(x, _mm256_set1_ps(2147483648.0f), _CMP_GE_OQ);
+  return _mm256_xor_si256(_mm256_cvtps_epi32(x), _mm256_castps_si256(overflow));
+}
+
+__attribute__((target("avx2"))) static void
+convert_avx2(const float *in, size_t n, PcmFormat format, uint8_t *out)
+{
+  const __m256 scale = _mm256_set1_ps(pcm_scale(format));
+  const __m256 lo = _mm256_set1_ps(pcm_min(format));
+  const __m256 hi = _mm256_set1_ps(pcm_max(format));
+  const __m256i pack24 = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13,
+                                          14, -1, -1, -1, -1, 0, 1, 2, 4, 5,
+                                          6, 8, 9, 10, 12, 13, 14, -1, -1, -1,
+                                          -1);
+  const __m256i join24 = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+
+  size_t i = 0;
+  if (format == PCM_S16)
+  {
+    for (; i + 16 <= n; i += 16)
+    {
+      const __m256i a = to_int_avx2(_mm256_loadu_ps(in + i), scale, lo, hi);
+      const __m256i b = to_int_avx2(_mm256_loadu_ps(in + i + 8), scale, lo, hi);
+      _mm256_storeu_si256(
+          (__m256i *)(out + i * 2),
+          _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8));
+    }
+  }
+  else if (format == PCM_S24)
+  {
+    /* Each store writes 8 bytes past the 24 it fills, so stop early */
+    for (; i + 16 <= n; i += 8)
+    {
+      const __m256i a = to_int_avx2(_mm256_loadu_ps(in + i), scale, lo, hi);
+      _mm256_storeu_si256(
+          (__m256i *)(out + i * 3),
+          _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(a, pack24), join24));
+    }
+  }
+  else
+  {
+    for (; i + 8 <= n; i += 8)
+    {
+      _mm256_storeu_si256((__m256i *)(out + i * 4),
+                          to_int_avx2(_mm256_loadu_ps(in + i), scale, lo, hi));
+    }
+  }
+
+  convert_scalar(in + i, n - i, format, out + i * pcm_sample_size(format));
+}
+
+/** Convert 8 interleaved samples and store exactly 8 samples of `format`. */
+__attribute__((target("avx2"))) static inline void
+store_avx2(__m256 x, PcmFormat format, __m256 scale, __m256 lo, __m256 hi,
+           uint8_t *out)
+{
+  if (format == PCM_F32)
+  {
+    _mm256_storeu_ps((float *)out, x);
+    return;
+  }
+
+  const __m256i s = to_int_avx2(x, scale, lo, hi);
+  if (format == PCM_S16)
+  {
+    _mm_storeu_si128((__m128i *)out,
+                     _mm_packs_epi32(_mm256_castsi256_si128(s),
+                                     _mm256_extracti128_si256(s, 1)));
+  }
+  else if (format == PCM_S24)
+  {
+    const __m256i pack24 = _mm256_setr_epi8(
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1, 0, 1, 2, 4,
+        5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    const __m256i p = _mm256_permutevar8x32_epi32(
+        _mm256_shuffle_epi8(s, pack24), _mm256_setr_epi32(0, 1, 2, 4, 5, 6,
+                                                          7, 7));
+    _mm_storeu_si128((__m128i *)out, _mm256_castsi256_si128(p));
+    _mm_storel_epi64((__m128i *)(out + 16), _mm256_extracti128_si256(p, 1));
+  }
+  else
+  {
+    _mm256_storeu_si256((__m256i *)out, s);
+  }
+}
+
+/**
+   Interleave and convert 2 or 8 channels, 8 frames at a time.
+
+   The channels are interleaved in registers, with unpacks and a lane
+   permute for 2 channels and an 8x8 transpose for 8, and converted before
+   they are stored.
+*/
+__attribute__((target("avx2"))) static uint32_t
+interleave_avx2(const float *const *planar,
+                uint32_t n_channels,
+                uint32_t n_frames,
+                PcmFormat format,
+                uint8_t *out)
+{
+  const __m256 scale = _mm256_set1_ps(pcm_scale(format));
+  const __m256 lo = _mm256_set1_ps(pcm_min(format));
+  const __m256 hi = _mm256_set1_ps(pcm_max(format));
+  const uint32_t size = pcm_sample_size(format);
+
+  uint32_t f = 0;
+  if (n_channels == 2)
+  {
+    for (; f + 8 <= n_frames; f += 8)
+    {
+      const __m256 l = _mm256_loadu_ps(planar[0] + f);
+      const __m256 r = _mm256_loadu_ps(planar[1] + f);
+      const __m256 a = _mm256_unpacklo_ps(l, r); // Frames 0, 1 | 4, 5
+      const __m256 b = _mm256_unpackhi_ps(l, r); // Frames 2, 3 | 6, 7
+      uint8_t *dst = out + (size_t)f * 2 * size;
+      store_avx2(_mm256_permute2f128_ps(a, b, 0x20), format, scale, lo, hi,
+                 dst);
+      store_avx2(_mm256_permute2f128_ps(a, b, 0x31), format, scale, lo, hi,
+                 dst + 8 * size);
+    }
+  }
+  else if (n_channels == 8)
+  {
+    for (; f + 8 <= n_frames; f += 8)
+    {
+      __m256 r[8];
+      for (unsigned c = 0; c < 8; ++c)
+      {
+        r[c] = _mm256_loadu_ps(planar[c] + f);
+      }
+
+      /* Transpose, so that each register holds every channel of a frame */
+      __m256 t[8];
+      for (unsigned c = 0; c < 8; c += 2)
+      {
+        t[c] = _mm256_unpacklo_ps(r[c], r[c + 1]);
+        t[c + 1] = _mm256_unpackhi_ps(r[c], r[c + 1]);
+      }
+      for (unsigned c = 0; c < 8; c += 4)
+      {
+        r[c] = _mm256_shuffle_ps(t[c], t[c + 2], 0x44);
+        r[c + 1] = _mm256_shuffle_ps(t[c], t[c + 2], 0xEE);
+        r[c + 2] = _mm256_shuffle_ps(t[c + 1], t[c + 3], 0x44);
+        r[c + 3] = _mm256_shuffle_ps(t[c + 1], t[c + 3], 0xEE);
+      }
+      uint8_t *dst = out + (size_t)f * 8 * size;
+      for (unsigned i = 0; i < 4; ++i)
+      {
+        store_avx2(_mm256_permute2f128_ps(r[i], r[i + 4], 0x20), format,
+                   scale, lo, hi, dst + i * 8 * size);
+        store_avx2(_mm256_permute2f128_ps(r[i], r[i + 4], 0x31), format,
+                   scale, lo, hi, dst + (i + 4) * 8 * size);
+      }
+    }
+  }
+
+  return f;
+}
+
+#endif // PCM_X86
+
+#ifdef PCM_NEON
+
+/** Scale, clip and round 4 samples (NEON conversion saturates). */
+static inline int32x4_t
+to_int_neon(float32x4_t in, float32x4_t scale, float32x4_t lo, float32x4_t hi)
+{
+  return vcvtnq_s32_f32(vminq_f32(vmaxq_f32(vmulq_f32(in, scale), lo), hi));
+}
+
+static void
+convert_neon(const float *in, size_t n, PcmFormat format, uint8_t *out)
+{
+  const float32x4_t scale = vdupq_n_f32(pcm_scale(format));
+  const float32x4_t lo = vdupq_n_f32(pcm_min(format));
+  const float32x4_t hi = vdupq_n_f32(pcm_max(format));
+
+  size_t i = 0;
+  if (format == PCM_S16)
+  {
+    for (; i + 8 <= n; i += 8)
+    {
+      const int32x4_t a = to_int_neon(vld1q_f32(in + i), scale, lo, hi);
+      const int32x4_t b = to_int_neon(vld1q_f32(in + i + 4), scale, lo, hi);
+      vst1q_s16((int16_t *)(out + i * 2),
+                vcombine_s16(vqmovn_s32(a), vqmovn_s32(b)));
+    }
+  }
+  else if (format == PCM_S24)
+  {
+    /* Pack the low 3 bytes of 16 samples with a table lookup */
+    static const uint8_t pack24[16] = {0, 1, 2, 4, 5, 6, 8, 9,
+                                       10, 12, 13, 14, 0, 0, 0, 0};
+    const uint8x16_t table = vld1q_u8(pack24);
+    for (; i + 8 <= n; i += 4)
+    {
+      const uint8x16_t a =
+          vreinterpretq_u8_s32(to_int_neon(vld1q_f32(in + i), scale, lo, hi));
+      vst1q_u8(out + i * 3, vqtbl1q_u8(a, table));
+    }
+  }
+  else
+  {
+    for (; i + 4 <= n; i += 4)
+    {
+      vst1q_s32((int32_t *)(out + i * 4),
+                to_int_neon(vld1q_f32(in + i), scale, lo, hi));
+    }
+  }
+
+  convert_scalar(in + i, n - i, format, out + i * pcm_sample_size(format));
+}
+
+/** Convert 4 interleaved samples and store exactly 4 samples of `format`. */
+static inline void
+store_neon(float32x4_t x,
+           PcmFormat format,
+           float32x4_t scale,
+           float32x4_t lo,
+           float32x4_t hi,
+           uint8_t *out)
+{
+  if (format == PCM_F32)
+  {
+    vst1q_f32((float *)out, x);
+    return;
+  }
+
+  const int32x4_t s = to_int_neon(x, scale, lo, hi);
+  if (format == PCM_S16)
+  {
+    vst1_s16((int16_t *)out, vqmovn_s32(s));
+  }
+  else if (format == PCM_S24)
+  {
+    static const uint8_t pack24[16] = {0, 1, 2, 4, 5, 6, 8, 9,
+                                       10, 12, 13, 14, 0, 0, 0, 0};
+    const uint8x16_t p = vqtbl1q_u8(vreinterpretq_u8_s32(s), vld1q_u8(pack24));
+    const uint32_t last = vgetq_lane_u32(vreinterpretq_u32_u8(p), 2);
+    vst1_u8(out, vget_low_u8(p));
+    memcpy(out + 8, &last, sizeof(last));
+  }
+  else
+  {
+    vst1q_s32((int32_t *)out, s);
+  }
+}
+
+/** Transpose 4 registers of 4 floats in place. */
+static inline void
+transpose_neon(float32x4_t *r)
+{
+  const float64x2_t t0 = vreinterpretq_f64_f32(vtrn1q_f32(r[0], r[1]));
+  const float64x2_t t1 = vreinterpretq_f64_f32(vtrn2q_f32(r[0], r[1]));
+  const float64x2_t t2 = vreinterpretq_f64_f32(vtrn1q_f32(r[2], r[3]));
+  const float64x2_t t3 = vreinterpretq_f64_f32(vtrn2q_f32(r[2], r[3]));
+  r[0] = vreinterpretq_f32_f64(vtrn1q_f64(t0, t2));
+  r[1] = vreinterpretq_f32_f64(vtrn1q_f64(t1, t3));
+  r[2] = vreinterpretq_f32_f64(vtrn2q_f64(t0, t2));
+  r[3] = vreinterpretq_f32_f64(vtrn2q_f64(t1, t3));
+}
+
+/** Interleave and convert 2 or 8 channels, see interleave_ssse3(). */
+static uint32_t
+interleave_neon(const float *const *planar,
+                uint32_t n_channels,
+                uint32_t n_frames,
+                PcmFormat format,
+                uint8_t *out)
+{
+  const float32x4_t scale = vdupq_n_f32(pcm_scale(format));
+  const float32x4_t lo = vdupq_n_f32(pcm_min(format));
+  const float32x4_t hi = vdupq_n_f32(pcm_max(format));
+  const uint32_t size = pcm_sample_size(format);
+
+  uint32_t f = 0;
+  if (n_channels == 2)
+  {
+    for (; f + 4 <= n_frames; f += 4)
+    {
+      const float32x4_t l = vld1q_f32(planar[0] + f);
+      const float32x4_t r = vld1q_f32(planar[1] + f);
+      uint8_t *dst = out + (size_t)f * 2 * size;
+      store_neon(vzip1q_f32(l, r), format, scale, lo, hi, dst);
+      store_neon(vzip2q_f32(l, r), format, scale, lo, hi, dst + 4 * size);
+    }
+  }
+  else if (n_channels == 8)
+  {
+    for (; f + 4 <= n_frames; f += 4)
+    {
+      float32x4_t a[4];
+      float32x4_t b[4];
+      for (unsigned c = 0; c < 4; ++c)
+      {
+        a[c] = vld1q_f32(planar[c] + f);
+        b[c] = vld1q_f32(planar[c + 4] + f);
+      }
+      transpose_neon(a);
+      transpose_neon(b);
+
+      uint8_t *dst = out + (size_t)f * 8 * size;
+      for (unsigned i = 0; i < 4; ++i)
+      {
+        store_neon(a[i], format, scale, lo, hi, dst + i * 8 * size);
+        store_neon(b[i], format, scale, lo, hi, dst + (i * 8 + 4) * size);
+      }
+    }
+  }
+
+  return f;
+}
+
+#endif // PCM_NEON
+
+/** The best conversion kernel for this CPU, and its name. */
+typedef struct
+{
+  ConvertFunc convert;
+  InterleaveFunc interleave;
+  const char *name;
+} Kernel;
+
+static Kernel
+select_kernel(void)
+{
+#if defined(PCM_X86)
+  if (__builtin_cpu_supports("avx2"))
+  {
+    return Kernel{convert_avx2, interleave_avx2, "avx2"};
+  }
+  if (__builtin_cpu_supports("ssse3"))
+  {
+    return Kernel{convert_ssse3, interleave_ssse3, "ssse3"};
+  }
+#elif defined(PCM_NEON)
+  return Kernel{convert_neon, interleave_neon, "neon"};
+#endif
+  return Kernel{convert_scalar, interleave_none, "scalar"};
+}
+
+static const Kernel &
+kernel(void)
+{
+  static const Kernel k = select_kernel();
+  return k;
+}
+
+const char *
+pcm_kernel_name(void)
+{
+  return kernel().name;
+}
+
+void
+pcm_convert(const float *in, size_t n_samples, PcmFormat format, void *out)
+{
+  const ConvertFunc convert =
+      format == PCM_F32 ? copy_float : kernel().convert;
+  convert(in, n_samples, format, (uint8_t *)out);
+}
+
+void
+pcm_interleave(const float *const *planar,
+               uint32_t n_channels,
+               uint32_t n_frames,
+               PcmFormat format,
+               void *out)
+{
+  const ConvertFunc convert =
+      format == PCM_F32 ? copy_float : kernel().convert;
+  const uint32_t size = pcm_sample_size(format);
+  if (!n_channels)
+  {
+    return;
+  }
+  if (n_channels > CHUNK_SAMPLES)
+  {
+    for (uint32_t f = 0; f < n_frames; ++f)
+    {
+      for (uint32_t c = 0; c < n_channels; ++c)
+      {
+        convert(planar[c] + f,
+                1,
+                format,
+                (uint8_t *)out + ((size_t)f * n_channels + c) * size);
+      }
+    }
+    return;
+  }
+
+  /* Common layouts are interleaved in registers, in one pass */
+  uint32_t f = 0;
+  if (n_channels == 2 || n_channels == 8)
+  {
+    f = kernel().interleave(planar, n_channels, n_frames, format,
+                            (uint8_t *)out);
+  }
+
+  /* Anything else goes through a scratch buffer that stays in L1 */
+  const uint32_t chunk_frames = CHUNK_SAMPLES / n_channels;
+
+  float scratch[CHUNK_SAMPLES];
+  uint8_t *dst = (uint8_t *)out + (size_t)f * n_channels * size;
+  for (; f < n_frames; f += chunk_frames)
+  {
+    const uint32_t n =
+        n_frames - f < chunk_frames ? n_frames - f : chunk_frames;
+
+    if (n_channels == 1)
+    {
+      convert(planar[0] + f, n, format, dst);
+    }
+    else
+    {
+      if (n_channels == 2)
+      {
+        const float *l = planar[0] + f;
+        const float *r = planar[1] + f;
+        for (uint32_t i = 0; i < n; ++i)
+        {
+          scratch[2 * i] = l[i];
+          scratch[2 * i + 1] = r[i];
+        }
+      }
+      else
+      {
+        for (uint32_t c = 0; c < n_channels; ++c)
+        {
+          const float *src = planar[c] + f;
+          for (uint32_t i = 0; i < n; ++i)
+          {
+            scratch[(size_t)i * n_channels + c] = src[i];
+          }
+        }
+      }
+
+      convert(scratch, (size_t)n * n_channels, format, dst);
+    }
+
+    dst += (size_t)n * n_channels * size;
+  }
+}
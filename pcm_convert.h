@@ -0,0 +1,58 @@
+// SPDX-License-Identifier: ISC
+
+#ifndef PCM_CONVERT_H
+#define PCM_CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Little-endian PCM sample format */
+typedef enum
+{
+  PCM_S16, ///< 16-bit signed integer
+  PCM_S24, ///< 24-bit signed integer, packed in 3 bytes
+  PCM_S32, ///< 32-bit signed integer
+  PCM_F32  ///< 32-bit float, copied unchanged
+} PcmFormat;
+
+/** Return the size of a sample of `format` in bytes. */
+static inline uint32_t
+pcm_sample_size(PcmFormat format)
+{
+  return format == PCM_S16 ? 2 : format == PCM_S24 ? 3 : 4;
+}
+
+/** Return the name of the kernel selected for this CPU ("avx2", ...). */
+const char *
+pcm_kernel_name(void);
+
+/**
+   Interleave and convert planar float channels to little-endian PCM.
+
+   Writes n_frames * n_channels samples of `format` to `out`, which needs no
+   particular alignment.  Integer samples are scaled by 0x7FFF, 0x7FFFFF or
+   0x7FFFFFFF, rounded to nearest, and clipped instead of wrapping.  This is
+   not bit-exact with libsndfile, which scales 24-bit samples as 32-bit ones
+   and truncates.  Stereo and 8 channels are interleaved in vector registers
+   and converted in the same pass.  Other channel counts are interleaved in
+   chunks small enough to stay in L1 and then converted, so the planar
+   buffers and the output are still each touched only once.  The kernel is
+   chosen at runtime from AVX2, SSSE3 and NEON.
+*/
+void
+pcm_interleave(const float *const *planar,
+               uint32_t n_channels,
+               uint32_t n_frames,
+               PcmFormat format,
+               void *out);
+
+/**
+   Convert already interleaved floats to PCM, with the same kernel.
+
+   This is pcm_interleave() without the interleaving step, for sources
+   that are already interleaved.
+*/
+void
+pcm_convert(const float *in, size_t n_samples, PcmFormat format, void *out);
+
+#endif // PCM_CONVERT_H
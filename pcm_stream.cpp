@@ -0,0 +1,203 @@
+// SPDX-License-Identifier: ISC
+
+#include "pcm_stream.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/** Pipe capacity to ask for, larger pipes mean fewer wakeups */
+#define PIPE_SIZE ((size_t)1 << 20)
+
+struct PcmStreamImpl
+{
+  int fd;
+  bool close_fd;      ///< The stream opened fd (it is not stdout)
+  bool is_pipe;       ///< Pages are spliced rather than written
+  size_t page;        ///< Page size
+  uint8_t *ring;      ///< Page-aligned ring of ring_size bytes
+  size_t ring_size;
+  uint8_t *scratch;   ///< Block that wraps around the end of the ring
+  uint32_t frame_size;
+  size_t block_bytes; ///< Size of a full block
+  uint64_t head;      ///< Total bytes committed to the ring
+  uint64_t sent;      ///< Total bytes sent to the output
+  bool finished;
+  bool failed;
+  PcmStreamStats stats;
+};
+
+/** Wait until the pipe has room again. */
+static bool
+wait_writable(PcmStream *s)
+{
+  ++s->stats.n_stalls;
+
+  struct pollfd pfd = {s->fd, POLLOUT, 0};
+  while (poll(&pfd, 1, -1) < 0)
+  {
+    if (errno != EINTR)
+    {
+      return false;
+    }
+  }
+
+  return !(pfd.revents & (POLLERR | POLLHUP));
+}
+
+/** Send the ring bytes from `sent` up to `end` (absolute offsets). */
+static int
+send_to(PcmStream *s, uint64_t end)
+{
+  while (!s->failed && s->sent < end)
+  {
+    /* At most up to the end of the ring, the rest on the next pass */
+    const size_t offset = (size_t)(s->sent % s->ring_size);
+    size_t n = (size_t)(end - s->sent);
+    if (offset + n > s->ring_size)
+    {
+      n = s->ring_size - offset;
+    }
+
+    struct iovec iov = {s->ring + offset, n};
+    const ssize_t r =
+        s->is_pipe ? vmsplice(s->fd, &iov, 1, SPLICE_F_NONBLOCK)
+                   : write(s->fd, iov.iov_base, iov.iov_len);
+    if (r > 0)
+    {
+      s->sent += (uint64_t)r;
+    }
+    else if (r < 0 && errno == EAGAIN && s->is_pipe)
+    {
+      s->failed = !wait_writable(s);
+    }
+    else if (r == 0 || errno != EINTR)
+    {
+      s->failed = true;
+    }
+  }
+
+  return s->failed ? 1 : 0;
+}
+
+PcmStream *
+pcm_stream_open(const char *path, uint32_t frame_size, uint32_t block_size)
+{
+  const bool is_stdout = !strcmp(path, "-");
+  const int fd = is_stdout ? STDOUT_FILENO
+                           : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+  {
+    return NULL;
+  }
+
+  PcmStream *s = (PcmStream *)calloc(1, sizeof(PcmStream));
+  if (!s)
+  {
+    if (!is_stdout)
+    {
+      close(fd);
+    }
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  struct stat st;
+  s->fd = fd;
+  s->close_fd = !is_stdout;
+  s->is_pipe = !fstat(fd, &st) && S_ISFIFO(st.st_mode);
+  s->page = (size_t)sysconf(_SC_PAGESIZE);
+  s->frame_size = frame_size;
+  s->block_bytes = (size_t)block_size * frame_size;
+
+  /* A pipe holds one page per slot, so a page can be reused once as many
+     pages as the pipe has slots have been spliced after it.  The ring needs
+     room for that, plus the block being filled and the partial page before
+     it that is still waiting to be sent. */
+  size_t n_pages = (s->block_bytes + s->page - 1) / s->page + 2;
+  if (s->is_pipe)
+  {
+    fcntl(fd, F_SETPIPE_SZ, (int)PIPE_SIZE);
+    const int pipe_size = fcntl(fd, F_GETPIPE_SZ);
+    s->stats.pipe_size = pipe_size > 0 ? (size_t)pipe_size : PIPE_SIZE;
+    n_pages += (s->stats.pipe_size + s->page - 1) / s->page;
+  }
+
+  s->ring_size = n_pages * s->page;
+  s->stats.ring_size = s->ring_size;
+  if (posix_memalign((void **)&s->ring, s->page, s->ring_size) ||
+      !(s->scratch = (uint8_t *)malloc(s->block_bytes)))
+  {
+    pcm_stream_free(s);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  return s;
+}
+
+void *
+pcm_stream_acquire(PcmStream *s)
+{
+  const size_t offset = (size_t)(s->head % s->ring_size);
+  return offset + s->block_bytes <= s->ring_size ? s->ring + offset
+                                                 : s->scratch;
+}
+
+int
+pcm_stream_commit(PcmStream *s, uint32_t n_frames)
+{
+  const size_t n = (size_t)n_frames * s->frame_size;
+  const size_t offset = (size_t)(s->head % s->ring_size);
+  if (offset + s->block_bytes > s->ring_size)
+  {
+    /* The block went to scratch, copy it around the end of the ring */
+    const size_t first = n < s->ring_size - offset ? n : s->ring_size - offset;
+    memcpy(s->ring + offset, s->scratch, first);
+    memcpy(s->ring, s->scratch + first, n - first);
+  }
+
+  s->head += n;
+  s->stats.n_bytes += n;
+
+  /* Only send whole pages, the partial one is still being filled */
+  return send_to(s, s->head / s->page * s->page);
+}
+
+int
+pcm_stream_finish(PcmStream *s, PcmStreamStats *stats)
+{
+  if (!s->finished)
+  {
+    send_to(s, s->head);
+    if (s->close_fd && close(s->fd))
+    {
+      s->failed = true;
+    }
+    s->finished = true;
+  }
+
+  if (stats)
+  {
+    *stats = s->stats;
+  }
+
+  return s->failed ? 1 : 0;
+}
+
+void
+pcm_stream_free(PcmStream *s)
+{
+  if (s)
+  {
+    pcm_stream_finish(s, NULL);
+    free(s->scratch);
+    free(s->ring);
+    free(s);
+  }
+}
@@ -0,0 +1,67 @@
+// SPDX-License-Identifier: ISC
+
+#ifndef PCM_STREAM_H
+#define PCM_STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+   Raw PCM stream writer, for feeding encoders and analysis tools.
+
+   Blocks are converted into a page-aligned ring, and when the output is a
+   pipe, full pages are handed to it with vmsplice() instead of being
+   copied.  Since the pipe then refers to the ring pages themselves, the
+   ring is sized so that a page is only reused after enough later pages
+   have been spliced to have pushed it out of the pipe.  A slow consumer
+   makes the render wait, so nothing is ever buffered beyond the ring and
+   the pipe.  Other outputs are written with write().
+*/
+typedef struct PcmStreamImpl PcmStream;
+
+/** Stream statistics, valid after pcm_stream_finish(). */
+typedef struct
+{
+  uint64_t n_bytes;   ///< Total number of bytes written
+  uint64_t n_stalls;  ///< Times the pipe was full
+  size_t ring_size;   ///< Size of the ring in bytes
+  size_t pipe_size;   ///< Capacity of the pipe, or 0 if not a pipe
+} PcmStreamStats;
+
+/**
+   Open a stream to `path`, or to stdout if it is "-".
+
+   A FIFO is opened for writing, which waits for a reader.  Blocks are at
+   most block_size frames of frame_size bytes.  Returns NULL and sets errno
+   on failure.
+*/
+PcmStream *
+pcm_stream_open(const char *path, uint32_t frame_size, uint32_t block_size);
+
+/** Return where to put the next block of up to block_size frames. */
+void *
+pcm_stream_acquire(PcmStream *stream);
+
+/**
+   Send the n_frames frames written to the last acquired block.
+
+   This waits while the consumer is behind.  Returns zero on success, or
+   non-zero if the output failed, for example because the reader went away.
+*/
+int
+pcm_stream_commit(PcmStream *stream, uint32_t n_frames);
+
+/**
+   Send any remaining partial page and close the output.
+
+   Returns zero on success, or non-zero if anything failed to be written.
+*/
+int
+pcm_stream_finish(PcmStream *stream, PcmStreamStats *stats);
+
+/** Free a stream, finishing it first if necessary. */
+void
+pcm_stream_free(PcmStream *stream);
+
+#endif // PCM_STREAM_H
@@ -0,0 +1,199 @@
+// SPDX-License-Identifier: ISC
+
+#include "perf_counters.h"
+
+#include <atomic>
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/** Counter group of one thread, closed when the thread exits */
+struct ThreadCounters
+{
+  bool opened;                     ///< Opening has been tried
+  int leader;                      ///< Group leader, or -1 if none opened
+  int fds[PERF_N_COUNTERS];        ///< Descriptor of each counter, or -1
+  unsigned slots[PERF_N_COUNTERS]; ///< Position of each counter in a read
+  unsigned available;              ///< Bit mask of the opened counters
+  unsigned n_open;                 ///< Number of opened counters
+
+  ~ThreadCounters()
+  {
+    for (unsigned i = 0; opened && i < PERF_N_COUNTERS; ++i)
+    {
+      if (fds[i] >= 0)
+      {
+        close(fds[i]);
+      }
+    }
+  }
+};
+
+static thread_local ThreadCounters counters;
+
+/** Error of the first thread that could not open any counter */
+static std::atomic<int> open_error(0);
+
+static const char *const names[PERF_N_COUNTERS] = {
+    "cycles",
+    "instructions",
+    "L1D misses",
+    "LLC misses",
+    "branch misses",
+};
+
+/** Set the perf event type and config of a counter in `attr`. */
+static void
+set_event(struct perf_event_attr *attr, unsigned counter)
+{
+  attr->type = PERF_TYPE_HARDWARE;
+  switch (counter)
+  {
+  case PERF_CYCLES:
+    attr->config = PERF_COUNT_HW_CPU_CYCLES;
+    break;
+  case PERF_INSTRUCTIONS:
+    attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+    break;
+  case PERF_L1D_MISSES:
+    attr->type = PERF_TYPE_HW_CACHE;
+    attr->config = PERF_COUNT_HW_CACHE_L1D |
+                   (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    break;
+  case PERF_LLC_MISSES:
+    attr->config = PERF_COUNT_HW_CACHE_MISSES;
+    break;
+  default:
+    attr->config = PERF_COUNT_HW_BRANCH_MISSES;
+    break;
+  }
+}
+
+/** Open every counter this thread may use, as one group. */
+static void
+open_counters(ThreadCounters *c)
+{
+  c->opened = true;
+  c->leader = -1;
+  c->available = 0;
+  c->n_open = 0;
+
+  int error = 0;
+  for (unsigned i = 0; i < PERF_N_COUNTERS; ++i)
+  {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    set_event(&attr, i);
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    c->fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, c->leader, 0);
+    if (c->fds[i] < 0)
+    {
+      error = errno;
+      continue;
+    }
+
+    if (c->leader < 0)
+    {
+      c->leader = c->fds[i];
+    }
+    c->slots[i] = c->n_open++;
+    c->available |= 1u << i;
+  }
+
+  if (c->leader < 0)
+  {
+    int expected = 0;
+    open_error.compare_exchange_strong(expected, error ? error : ENOSYS);
+  }
+}
+
+const char *
+perf_counter_name(unsigned counter)
+{
+  return counter < PERF_N_COUNTERS ? names[counter] : "unknown";
+}
+
+bool
+perf_sample(PerfSample *sample)
+{
+  ThreadCounters *c = &counters;
+  if (!c->opened)
+  {
+    open_counters(c);
+  }
+
+  /* The number of counters, the enabled and running times, then values */
+  uint64_t buf[3 + PERF_N_COUNTERS];
+  if (c->leader < 0 || read(c->leader, buf, sizeof(buf)) <
+                           (ssize_t)((3 + c->n_open) * sizeof(uint64_t)))
+  {
+    return false;
+  }
+
+  for (unsigned i = 0; i < PERF_N_COUNTERS; ++i)
+  {
+    sample->values[i] = (c->available & (1u << i)) ? buf[3 + c->slots[i]] : 0;
+  }
+  sample->time_enabled = buf[1];
+  sample->time_running = buf[2];
+  sample->available = c->available;
+  return true;
+}
+
+void
+perf_count(PerfTotals *totals, const PerfSample *start)
+{
+  PerfSample end;
+  if (!perf_sample(&end) || end.available != start->available)
+  {
+    return;
+  }
+
+  const uint64_t enabled = end.time_enabled - start->time_enabled;
+  const uint64_t running = end.time_running - start->time_running;
+  if (!running)
+  {
+    ++totals->n_unmeasured;
+    return;
+  }
+
+  const bool scaled = running < enabled;
+  for (unsigned i = 0; i < PERF_N_COUNTERS; ++i)
+  {
+    const uint64_t count = end.values[i] - start->values[i];
+    totals->counts[i] +=
+        scaled ? (uint64_t)((double)count * enabled / running + 0.5) : count;
+  }
+  totals->n_scaled += scaled;
+  totals->available |= end.available;
+  ++totals->n_runs;
+}
+
+void
+perf_totals_add(PerfTotals *to, const PerfTotals *from)
+{
+  for (unsigned i = 0; i < PERF_N_COUNTERS; ++i)
+  {
+    to->counts[i] += from->counts[i];
+  }
+  to->available |= from->available;
+  to->n_runs += from->n_runs;
+  to->n_scaled += from->n_scaled;
+  to->n_unmeasured += from->n_unmeasured;
+}
+
+const char *
+perf_unavailable_reason(void)
+{
+  const int error = open_error.load();
+  return error ? strerror(error) : NULL;
+}
@@ -0,0 +1,84 @@
+// SPDX-License-Identifier: ISC
+
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+   Hardware performance counters around plugin runs, with perf_event_open().
+
+   The kernel counts events for a single thread, so every thread that runs
+   plugins opens a group of counters of its own the first time it takes a
+   sample, and reads the whole group with one read().  A run is counted by
+   taking a sample before it and adding the difference after it to the
+   totals of the instance that ran, so an instance may move between threads.
+
+   Counters that the CPU, the kernel or the container do not allow are left
+   out of the group, and if none can be opened, samples fail and nothing is
+   counted, see perf_unavailable_reason().
+
+   When the group needs more hardware counters than are free, for example
+   because another perf user holds some, the kernel multiplexes it and it
+   only counts for part of the time.  The counts of such a run are scaled up
+   by the time the group was enabled over the time it was counting, and the
+   run is counted as scaled.  A run during which the group never counted is
+   left out, and only counted as unmeasured.
+*/
+
+/** Events that are counted */
+typedef enum
+{
+  PERF_CYCLES,        ///< CPU cycles
+  PERF_INSTRUCTIONS,  ///< Instructions retired
+  PERF_L1D_MISSES,    ///< Level 1 data cache read misses
+  PERF_LLC_MISSES,    ///< Last level cache misses
+  PERF_BRANCH_MISSES, ///< Mispredicted branches
+  PERF_N_COUNTERS
+} PerfCounter;
+
+/** Counter values of the calling thread at one point in time */
+typedef struct
+{
+  uint64_t values[PERF_N_COUNTERS]; ///< Value of each counter
+  uint64_t time_enabled;            ///< Time the group was enabled in ns
+  uint64_t time_running;            ///< Time the group was counting in ns
+  unsigned available;               ///< Bit mask of the counters read
+} PerfSample;
+
+/** Counts of every run of one plugin instance */
+typedef struct
+{
+  uint64_t n_runs;                  ///< Number of runs counted
+  uint64_t n_scaled;                ///< Runs multiplexed, with counts scaled
+  uint64_t n_unmeasured;            ///< Runs multiplexed out, not counted
+  uint64_t counts[PERF_N_COUNTERS]; ///< Total count of each event
+  unsigned available;               ///< Bit mask of the counters counted
+} PerfTotals;
+
+/** Return the name of a counter, for reports. */
+const char *
+perf_counter_name(unsigned counter);
+
+/**
+   Read the counters of the calling thread, opening them on the first call.
+
+   Returns false if no counter is available on this thread.
+*/
+bool
+perf_sample(PerfSample *sample);
+
+/** Add the counts since `start`, taken on this thread, to `totals`. */
+void
+perf_count(PerfTotals *totals, const PerfSample *start);
+
+/** Add the counts of `from` to `to`. */
+void
+perf_totals_add(PerfTotals *to, const PerfTotals *from);
+
+/** Return why no counter could be opened, or NULL if one could. */
+const char *
+perf_unavailable_reason(void);
+
+#endif // PERF_COUNTERS_H
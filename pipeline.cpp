@@ -0,0 +1,251 @@
+// SPDX-License-Identifier: ISC
+
+#include "pipeline.h"
+
+#include "trace.h"
+
+#include <atomic>
+#include <new>
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <time.h>
+
+#define STOP_TOKEN ((unsigned)-1)
+
+/**
+   Single-producer/single-consumer ring of tokens.
+
+   No more tokens than there are slots are ever in flight, so a push never
+   finds the ring full.  The semaphore only counts filled slots, so the
+   consumer can sleep when the ring is empty.
+*/
+typedef struct
+{
+  unsigned *items;            ///< n_tokens + 1 slots, room for the stop token
+  uint32_t n_slots;
+  std::atomic<uint32_t> head; ///< Next slot to fill (producer)
+  std::atomic<uint32_t> tail; ///< Next slot to take (consumer)
+  sem_t filled;               ///< Posted for every pushed token
+} Queue;
+
+/** The thread of a stage group after the first */
+typedef struct
+{
+  struct PipelineImpl *pipeline;
+  unsigned group;
+  pthread_t thread;
+  bool started;
+} Stage;
+
+struct PipelineImpl
+{
+  unsigned n_groups;
+  unsigned n_tokens;
+  PipelineRunFunc run;
+  void *data;
+  unsigned n_in_flight;       ///< Tokens run but not popped (caller)
+  Queue *queues;              ///< Output of each group, the last is done
+  unsigned n_queues;          ///< Queues initialised, to tear down
+  Stage *stages;              ///< Threads of the groups after the first
+  PipelineGroupStats *stats;
+};
+
+static uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void
+queue_push(Queue *q, unsigned token)
+{
+  const uint32_t head = q->head.load(std::memory_order_relaxed);
+  q->items[head % q->n_slots] = token;
+  q->head.store(head + 1, std::memory_order_release);
+  sem_post(&q->filled);
+}
+
+static bool
+queue_pop(Queue *q, unsigned *token, bool wait, uint64_t *n_waits)
+{
+  if (sem_trywait(&q->filled))
+  {
+    if (!wait)
+    {
+      return false;
+    }
+
+    const uint64_t t0 = trace_begin();
+    ++*n_waits;
+    sem_wait(&q->filled);
+    trace_end(t0, "wait for block", NULL);
+  }
+
+  const uint32_t tail = q->tail.load(std::memory_order_relaxed);
+  *token = q->items[tail % q->n_slots];
+  q->tail.store(tail + 1, std::memory_order_release);
+  return true;
+}
+
+/** Run a group for a token and time it. */
+static void
+run_group(Pipeline *p, unsigned group, unsigned token)
+{
+  PipelineGroupStats *stats = &p->stats[group];
+  const uint64_t t0 = now_ns();
+  p->run(p->data, group, token);
+  stats->busy_ns += now_ns() - t0;
+  ++stats->n_blocks;
+}
+
+static void *
+stage_thread(void *data)
+{
+  Stage *stage = (Stage *)data;
+  Pipeline *p = stage->pipeline;
+  Queue *in = &p->queues[stage->group - 1];
+  Queue *out = &p->queues[stage->group];
+  char name[32];
+  snprintf(name, sizeof(name), "pipeline group %u", stage->group);
+  trace_thread_name(name);
+  for (;;)
+  {
+    unsigned token = 0;
+    queue_pop(in, &token, true, &p->stats[stage->group].n_waits);
+    if (token == STOP_TOKEN)
+    {
+      queue_push(out, STOP_TOKEN);
+      break;
+    }
+
+    run_group(p, stage->group, token);
+    queue_push(out, token);
+  }
+
+  return NULL;
+}
+
+Pipeline *
+pipeline_new(unsigned n_groups,
+             unsigned n_tokens,
+             PipelineRunFunc run,
+             void *data)
+{
+  Pipeline *p = new (std::nothrow) Pipeline();
+  if (!p)
+  {
+    return NULL;
+  }
+
+  p->n_groups = n_groups ? n_groups : 1;
+  p->n_tokens = n_tokens ? n_tokens : 1;
+  p->run = run;
+  p->data = data;
+  p->queues = new (std::nothrow) Queue[p->n_groups]();
+  p->stages = new (std::nothrow) Stage[p->n_groups]();
+  p->stats = new (std::nothrow) PipelineGroupStats[p->n_groups]();
+  if (!p->queues || !p->stages || !p->stats)
+  {
+    pipeline_free(p);
+    return NULL;
+  }
+
+  for (unsigned g = 0; g < p->n_groups; ++g)
+  {
+    Queue *q = &p->queues[g];
+    q->n_slots = p->n_tokens + 1;
+    if (!(q->items = new (std::nothrow) unsigned[q->n_slots]()))
+    {
+      pipeline_free(p);
+      return NULL;
+    }
+
+    sem_init(&q->filled, 0, 0);
+    ++p->n_queues;
+  }
+
+  for (unsigned g = 1; g < p->n_groups; ++g)
+  {
+    Stage *stage = &p->stages[g];
+    stage->pipeline = p;
+    stage->group = g;
+    if (pthread_create(&stage->thread, NULL, stage_thread, stage))
+    {
+      pipeline_free(p);
+      return NULL;
+    }
+    stage->started = true;
+  }
+
+  return p;
+}
+
+bool
+pipeline_full(const Pipeline *p)
+{
+  return p->n_in_flight == p->n_tokens;
+}
+
+void
+pipeline_run(Pipeline *p, unsigned token)
+{
+  run_group(p, 0, token);
+  ++p->n_in_flight;
+  queue_push(&p->queues[0], token);
+}
+
+bool
+pipeline_pop(Pipeline *p, unsigned *token, bool wait)
+{
+  Queue *done = &p->queues[p->n_groups - 1];
+  if (!p->n_in_flight || !queue_pop(done, token, wait, &p->stats[0].n_waits))
+  {
+    return false;
+  }
+
+  --p->n_in_flight;
+  return true;
+}
+
+const PipelineGroupStats *
+pipeline_group_stats(const Pipeline *p, unsigned group)
+{
+  return &p->stats[group];
+}
+
+void
+pipeline_free(Pipeline *p)
+{
+  if (!p)
+  {
+    return;
+  }
+
+  /* The stop token is passed down the pipeline like any other */
+  if (p->stages && p->n_groups > 1 && p->stages[1].started)
+  {
+    queue_push(&p->queues[0], STOP_TOKEN);
+  }
+  for (unsigned g = 1; p->stages && g < p->n_groups; ++g)
+  {
+    if (p->stages[g].started)
+    {
+      pthread_join(p->stages[g].thread, NULL);
+    }
+  }
+
+  for (unsigned g = 0; g < p->n_queues; ++g)
+  {
+    sem_destroy(&p->queues[g].filled);
+    delete[] p->queues[g].items;
+  }
+
+  delete[] p->stats;
+  delete[] p->stages;
+  delete[] p->queues;
+  delete p;
+}
@@ -0,0 +1,71 @@
+// SPDX-License-Identifier: ISC
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+   Serial stages run as a pipeline, one thread per stage group.
+
+   Blocks are identified by tokens from 0 to n_tokens - 1, each standing for
+   a set of buffers owned by the caller.  The caller runs group 0 of a token
+   with pipeline_run(), which passes it down single-producer/single-consumer
+   queues to the thread of every later group in turn, so group k works on
+   one block while group k + 1 works on the one before.  Tokens come back
+   out of pipeline_pop() in the order they went in.  The queues are lock-free
+   rings that a thread only sleeps on when it finds its queue empty.
+*/
+typedef struct PipelineImpl Pipeline;
+
+/** Function that runs stage group `group` for block `token`. */
+typedef void (*PipelineRunFunc)(void *data, unsigned group, unsigned token);
+
+/** Statistics of one stage group. */
+typedef struct
+{
+  uint64_t n_blocks; ///< Number of blocks run
+  uint64_t busy_ns;  ///< Total time spent running blocks
+  uint64_t n_waits;  ///< Times the group had to wait for a block
+} PipelineGroupStats;
+
+/**
+   Create a pipeline of n_groups groups and start its threads.
+
+   Group 0 runs on the thread calling pipeline_run(), every other group on a
+   thread of its own.  At most n_tokens blocks may be in flight.
+*/
+Pipeline *
+pipeline_new(unsigned n_groups,
+             unsigned n_tokens,
+             PipelineRunFunc run,
+             void *data);
+
+/** Return true if every token is in flight, so one must be popped first. */
+bool
+pipeline_full(const Pipeline *pipeline);
+
+/** Run group 0 for a free token, and pass it on to the next group. */
+void
+pipeline_run(Pipeline *pipeline, unsigned token);
+
+/**
+   Get the next token that has been through every group.
+
+   If `wait` is true, this waits for the oldest token in flight, otherwise
+   it only returns one that is already done, and waiting counts as a wait
+   of group 0.  Returns false if there is no token to return.
+*/
+bool
+pipeline_pop(Pipeline *pipeline, unsigned *token, bool wait);
+
+/** Return the statistics of a group, valid when no token is in flight. */
+const PipelineGroupStats *
+pipeline_group_stats(const Pipeline *pipeline, unsigned group);
+
+/** Stop the threads and free a pipeline. */
+void
+pipeline_free(Pipeline *pipeline);
+
+#endif // PIPELINE_H
@@ -0,0 +1,364 @@
+// SPDX-License-Identifier: ISC
+
+#include "plugin_index.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define INDEX_MAGIC "lilv-plugin-index 2"
+
+/** Return the modification time of a bundle in nanoseconds, or -1. */
+static int64_t
+bundle_mtime(const char *bundle_path)
+{
+  struct stat st;
+  if (stat(bundle_path, &st))
+  {
+    return -1;
+  }
+
+  int64_t mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+
+  /* Editing manifest.ttl in place does not touch the directory */
+  char manifest[4096];
+  snprintf(manifest, sizeof(manifest), "%s/manifest.ttl", bundle_path);
+  if (!stat(manifest, &st))
+  {
+    const int64_t t =
+        (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    mtime = t > mtime ? t : mtime;
+  }
+
+  return mtime;
+}
+
+/** Load a bundle by path, which must end with a slash. */
+static void
+load_bundle(LilvWorld *world, const char *bundle_path)
+{
+  LilvNode *bundle = lilv_new_file_uri(world, NULL, bundle_path);
+  lilv_world_load_bundle(world, bundle);
+  lilv_node_free(bundle);
+}
+
+char *
+plugin_index_default_path(void)
+{
+  const char *cache = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  char path[4096];
+  if (cache && cache[0])
+  {
+    snprintf(path, sizeof(path), "%s/lilv-midi-example/plugins.idx", cache);
+  }
+  else if (home && home[0])
+  {
+    snprintf(path, sizeof(path), "%s/.cache/lilv-midi-example/plugins.idx",
+             home);
+  }
+  else
+  {
+    return NULL;
+  }
+
+  return strdup(path);
+}
+
+/** Append a copy of `path` to `*paths`, which holds `*n_paths`. */
+static bool
+append_path(char ***paths, unsigned *n_paths, const char *path)
+{
+  char **grown = (char **)realloc(*paths, (*n_paths + 1) * sizeof(char *));
+  if (!grown)
+  {
+    return false;
+  }
+
+  *paths = grown;
+  return ((*paths)[*n_paths] = strdup(path)) ? (++*n_paths, true) : false;
+}
+
+static void
+free_paths(char **paths, unsigned n_paths)
+{
+  for (unsigned i = 0; i < n_paths; ++i)
+  {
+    free(paths[i]);
+  }
+  free(paths);
+}
+
+bool
+plugin_index_load_plugins(LilvWorld *world,
+                          const char *index_path,
+                          const char *const *plugin_uris,
+                          unsigned n_uris)
+{
+  FILE *fd = fopen(index_path, "r");
+  if (!fd)
+  {
+    return false;
+  }
+
+  char line[8192];
+  if (!fgets(line, sizeof(line), fd) ||
+      strncmp(line, INDEX_MAGIC, strlen(INDEX_MAGIC)))
+  {
+    fclose(fd);
+    return false;
+  }
+
+  /* Find every bundle before loading anything, so a miss loads nothing */
+  char **specs = NULL;
+  unsigned n_specs = 0;
+  char **bundles = (char **)calloc(n_uris ? n_uris : 1, sizeof(char *));
+  bool ok = bundles != NULL;
+  while (ok && fgets(line, sizeof(line), fd))
+  {
+    line[strcspn(line, "\n")] = '\0';
+
+    /* Lines are KIND \t MTIME \t PATH [\t PLUGIN_URI] */
+    char *kind = strtok(line, "\t");
+    char *mtime = strtok(NULL, "\t");
+    char *path = strtok(NULL, "\t");
+    char *uri = strtok(NULL, "\t");
+    if (!kind || !mtime || !path)
+    {
+      continue;
+    }
+
+    /* Every search directory is checked, since new bundles change it */
+    const bool is_dir = !strcmp(kind, "D");
+    const bool is_spec = !strcmp(kind, "S");
+    bool wanted = is_dir || is_spec;
+    for (unsigned i = 0; !wanted && uri && i < n_uris; ++i)
+    {
+      wanted = !bundles[i] && !strcmp(uri, plugin_uris[i]);
+    }
+
+    if (!wanted)
+    {
+      continue;
+    }
+    if (bundle_mtime(path) != strtoll(mtime, NULL, 10))
+    {
+      ok = false;
+    }
+    else if (is_spec)
+    {
+      ok = append_path(&specs, &n_specs, path);
+    }
+    else if (!is_dir)
+    {
+      /* The same plugin may be given more than once */
+      for (unsigned i = 0; ok && i < n_uris; ++i)
+      {
+        if (!bundles[i] && !strcmp(uri, plugin_uris[i]))
+        {
+          ok = (bundles[i] = strdup(path)) != NULL;
+        }
+      }
+    }
+  }
+  fclose(fd);
+
+  for (unsigned i = 0; ok && i < n_uris; ++i)
+  {
+    ok = bundles[i] != NULL;
+  }
+
+  if (ok)
+  {
+    for (unsigned i = 0; i < n_specs; ++i)
+    {
+      load_bundle(world, specs[i]);
+    }
+    lilv_world_load_specifications(world);
+    lilv_world_load_plugin_classes(world);
+
+    /* Several of the plugins may live in one bundle, which is loaded once */
+    for (unsigned i = 0; i < n_uris; ++i)
+    {
+      bool loaded = false;
+      for (unsigned j = 0; !loaded && j < i; ++j)
+      {
+        loaded = !strcmp(bundles[i], bundles[j]);
+      }
+      if (!loaded)
+      {
+        load_bundle(world, bundles[i]);
+      }
+    }
+  }
+
+  free_paths(specs, n_specs);
+  free_paths(bundles, bundles ? n_uris : 0);
+  return ok;
+}
+
+/** Create all missing parent directories of `path`. */
+static int
+mkdir_parents(const char *path)
+{
+  char *dir = strdup(path);
+  for (char *s = dir + 1; *s; ++s)
+  {
+    if (*s == '/')
+    {
+      *s = '\0';
+      if (mkdir(dir, 0755) && errno != EEXIST)
+      {
+        free(dir);
+        return 1;
+      }
+      *s = '/';
+    }
+  }
+
+  free(dir);
+  return 0;
+}
+
+/** Compare two strings through pointers to them, for qsort() and bsearch() */
+static int
+compare_paths(const void *a, const void *b)
+{
+  return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/**
+   Write a line for every directory of the LV2 search path, and one for every
+   bundle in it without plugins.
+
+   These are the specifications, and presets and other data about plugins
+   in other bundles, which lilv_world_load_all() would load as well.  A
+   bundle is told apart from plugin bundles by its real path, since the
+   search path may reach one through a symbolic link.
+*/
+static int
+write_data_bundles(LilvWorld *world, FILE *fd)
+{
+  char **plugin_paths = NULL;
+  unsigned n_plugin_paths = 0;
+  const LilvPlugins *plugins = lilv_world_get_all_plugins(world);
+  LILV_FOREACH(plugins, i, plugins)
+  {
+    const LilvNode *bundle =
+        lilv_plugin_get_bundle_uri(lilv_plugins_get(plugins, i));
+    char *path = lilv_file_uri_parse(lilv_node_as_uri(bundle), NULL);
+    char *real = path ? realpath(path, NULL) : NULL;
+    lilv_free(path);
+    if (real && !append_path(&plugin_paths, &n_plugin_paths, real))
+    {
+      free(real);
+      free_paths(plugin_paths, n_plugin_paths);
+      return 1;
+    }
+    free(real);
+  }
+  if (n_plugin_paths)
+  {
+    qsort(plugin_paths, n_plugin_paths, sizeof(char *), compare_paths);
+  }
+
+  const char *env = getenv("LV2_PATH");
+  const char *home = getenv("HOME");
+  char search[8192];
+  if (env && env[0])
+  {
+    snprintf(search, sizeof(search), "%s", env);
+  }
+  else
+  {
+    snprintf(search, sizeof(search), "%s/.lv2:/usr/local/lib/lv2:/usr/lib/lv2",
+             home ? home : "");
+  }
+
+  for (char *dir = strtok(search, ":"); dir; dir = strtok(NULL, ":"))
+  {
+    fprintf(fd, "D\t%lld\t%s\n", (long long)bundle_mtime(dir), dir);
+
+    DIR *d = opendir(dir);
+    for (struct dirent *e = d ? readdir(d) : NULL; e; e = readdir(d))
+    {
+      if (e->d_name[0] == '.')
+      {
+        continue;
+      }
+
+      char path[4096];
+      char manifest[sizeof(path) + sizeof("manifest.ttl")];
+      snprintf(path, sizeof(path), "%s/%s/", dir, e->d_name);
+      snprintf(manifest, sizeof(manifest), "%smanifest.ttl", path);
+      char *real = access(manifest, R_OK) ? NULL : realpath(path, NULL);
+      if (real && (!n_plugin_paths || !bsearch(&real,
+                                               plugin_paths,
+                                               n_plugin_paths,
+                                               sizeof(char *),
+                                               compare_paths)))
+      {
+        fprintf(fd, "S\t%lld\t%s\n", (long long)bundle_mtime(path), path);
+      }
+      free(real);
+    }
+    if (d)
+    {
+      closedir(d);
+    }
+  }
+
+  free_paths(plugin_paths, n_plugin_paths);
+  return 0;
+}
+
+int
+plugin_index_save(LilvWorld *world, const char *index_path)
+{
+  char tmp_path[4096];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d", index_path, (int)getpid());
+
+  FILE *fd = NULL;
+  if (mkdir_parents(index_path) || !(fd = fopen(tmp_path, "w")))
+  {
+    return 1;
+  }
+
+  fprintf(fd, INDEX_MAGIC "\n");
+  if (write_data_bundles(world, fd))
+  {
+    fclose(fd);
+    unlink(tmp_path);
+    return 1;
+  }
+
+  const LilvPlugins *plugins = lilv_world_get_all_plugins(world);
+  LILV_FOREACH(plugins, i, plugins)
+  {
+    const LilvPlugin *plugin = lilv_plugins_get(plugins, i);
+    const LilvNode *bundle = lilv_plugin_get_bundle_uri(plugin);
+    char *path = lilv_file_uri_parse(lilv_node_as_uri(bundle), NULL);
+    if (path)
+    {
+      fprintf(fd,
+              "P\t%lld\t%s\t%s\n",
+              (long long)bundle_mtime(path),
+              path,
+              lilv_node_as_uri(lilv_plugin_get_uri(plugin)));
+      lilv_free(path);
+    }
+  }
+
+  if (fclose(fd) || rename(tmp_path, index_path))
+  {
+    unlink(tmp_path);
+    return 1;
+  }
+
+  return 0;
+}
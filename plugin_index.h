@@ -0,0 +1,52 @@
+// SPDX-License-Identifier: ISC
+
+#ifndef PLUGIN_INDEX_H
+#define PLUGIN_INDEX_H
+
+#include "lilv/lilv.h"
+
+#include <stdbool.h>
+
+/**
+   Persistent plugin URI to bundle path index.
+
+   lilv_world_load_all() parses the Turtle of every installed bundle just to
+   find one plugin.  The index remembers which bundle each plugin lives in,
+   along with the modification time of every bundle it was built from, so a
+   later run can load only those bundles and the ones without any plugins,
+   like specifications and presets.  An entry whose bundle has changed since
+   the index was written is stale and treated as missing.
+*/
+
+/**
+   Return the default index path, or NULL if there is no home directory.
+
+   This is $XDG_CACHE_HOME/lilv-midi-example/plugins.idx, falling back to
+   $HOME/.cache.  The returned string must be freed with free().
+*/
+char *
+plugin_index_default_path(void);
+
+/**
+   Load the bundles of `n_uris` plugins and all bundles without plugins.
+
+   Returns false, without loading anything, if the index does not exist or
+   lacks a fresh entry for any of `plugin_uris`, so that the caller can fall
+   back to lilv_world_load_all() on the same world.
+*/
+bool
+plugin_index_load_plugins(LilvWorld *world,
+                          const char *index_path,
+                          const char *const *plugin_uris,
+                          unsigned n_uris);
+
+/**
+   Write an index of every plugin in `world` to `index_path`.
+
+   The world must have been loaded with lilv_world_load_all().  Returns zero
+   on success.
+*/
+int
+plugin_index_save(LilvWorld *world, const char *index_path);
+
+#endif // PLUGIN_INDEX_H
@@ -0,0 +1,323 @@
+// SPDX-License-Identifier: ISC
+
+#include "plugin_worker.h"
+
+#include "trace.h"
+
+#include <atomic>
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+   Single-producer/single-consumer ring of messages.
+
+   Each message is its size followed by its body, and is only published once
+   it has been written completely, so the consumer never sees part of one.
+*/
+typedef struct
+{
+  uint8_t *buf;
+  uint32_t size;               ///< Capacity in bytes, a power of two
+  std::atomic<uint32_t> write; ///< Total bytes written (producer)
+  std::atomic<uint32_t> read;  ///< Total bytes read (consumer)
+} Ring;
+
+struct PluginWorkerImpl
+{
+  LV2_Worker_Schedule schedule;
+  LV2_Feature feature;
+  LV2_Handle handle;
+  const LV2_Worker_Interface *iface;
+  bool threaded;
+  Ring requests;                ///< Work for the worker thread
+  Ring responses;               ///< Responses for the next run
+  uint8_t *work_buf;            ///< Request being worked on
+  uint8_t *response_buf;        ///< Response being delivered
+  sem_t pending;                ///< Posted for every request
+  std::atomic<bool> exit;       ///< The worker thread should exit
+  pthread_t thread;
+  bool started;
+  uint64_t n_requests;
+  uint64_t n_responses;
+  uint64_t n_dropped_requests;  ///< Written by the run thread
+  uint64_t n_dropped_responses; ///< Written by the thread doing work
+};
+
+static int
+ring_init(Ring *r, uint32_t size)
+{
+  r->size = 1;
+  while (r->size < size)
+  {
+    r->size *= 2;
+  }
+
+  r->write.store(0);
+  r->read.store(0);
+  return (r->buf = (uint8_t *)malloc(r->size)) ? 0 : 1;
+}
+
+/** Copy `n` bytes into the ring at absolute offset `at`, wrapping. */
+static void
+ring_copy_in(Ring *r, uint32_t at, const void *data, uint32_t n)
+{
+  const uint32_t offset = at & (r->size - 1);
+  const uint32_t first = n < r->size - offset ? n : r->size - offset;
+  memcpy(r->buf + offset, data, first);
+  memcpy(r->buf, (const uint8_t *)data + first, n - first);
+}
+
+/** Copy `n` bytes out of the ring from absolute offset `at`, wrapping. */
+static void
+ring_copy_out(const Ring *r, uint32_t at, void *data, uint32_t n)
+{
+  const uint32_t offset = at & (r->size - 1);
+  const uint32_t first = n < r->size - offset ? n : r->size - offset;
+  memcpy(data, r->buf + offset, first);
+  memcpy((uint8_t *)data + first, r->buf, n - first);
+}
+
+/** Write a message, or return false if there is no room for it. */
+static bool
+ring_write(Ring *r, uint32_t size, const void *body)
+{
+  const uint32_t write = r->write.load(std::memory_order_relaxed);
+  const uint32_t read = r->read.load(std::memory_order_acquire);
+  if ((uint64_t)sizeof(size) + size > r->size - (write - read))
+  {
+    return false;
+  }
+
+  ring_copy_in(r, write, &size, sizeof(size));
+  ring_copy_in(r, write + sizeof(size), body, size);
+  r->write.store(write + sizeof(size) + size, std::memory_order_release);
+  return true;
+}
+
+/** Read the next message into `body`, or return false if there is none. */
+static bool
+ring_read(Ring *r, uint32_t *size, void *body)
+{
+  const uint32_t read = r->read.load(std::memory_order_relaxed);
+  const uint32_t write = r->write.load(std::memory_order_acquire);
+  if (write == read)
+  {
+    return false;
+  }
+
+  ring_copy_out(r, read, size, sizeof(*size));
+  ring_copy_out(r, read + sizeof(*size), body, *size);
+  r->read.store(read + sizeof(*size) + *size, std::memory_order_release);
+  return true;
+}
+
+/** LV2_Worker_Respond_Function, called by the plugin from work(). */
+static LV2_Worker_Status
+respond(LV2_Worker_Respond_Handle handle, uint32_t size, const void *data)
+{
+  PluginWorker *w = (PluginWorker *)handle;
+  if (!ring_write(&w->responses, size, data))
+  {
+    ++w->n_dropped_responses;
+    return LV2_WORKER_ERR_NO_SPACE;
+  }
+
+  return LV2_WORKER_SUCCESS;
+}
+
+/** LV2_Worker_Schedule::schedule_work, called by the plugin from run(). */
+static LV2_Worker_Status
+schedule_work(LV2_Worker_Schedule_Handle handle,
+              uint32_t size,
+              const void *data)
+{
+  PluginWorker *w = (PluginWorker *)handle;
+  if (!w->iface)
+  {
+    return LV2_WORKER_ERR_UNKNOWN;
+  }
+
+  ++w->n_requests;
+  if (!w->threaded)
+  {
+    return w->iface->work(w->handle, respond, w, size, data);
+  }
+
+  if (!ring_write(&w->requests, size, data))
+  {
+    ++w->n_dropped_requests;
+    return LV2_WORKER_ERR_NO_SPACE;
+  }
+
+  sem_post(&w->pending);
+  return LV2_WORKER_SUCCESS;
+}
+
+static void *
+worker_thread(void *data)
+{
+  PluginWorker *w = (PluginWorker *)data;
+  trace_thread_name("plugin worker");
+  for (;;)
+  {
+    sem_wait(&w->pending);
+    if (w->exit.load(std::memory_order_acquire))
+    {
+      break;
+    }
+
+    uint32_t size = 0;
+    if (ring_read(&w->requests, &size, w->work_buf))
+    {
+      const uint64_t t0 = trace_begin();
+      w->iface->work(w->handle, respond, w, size, w->work_buf);
+      trace_end(t0, "work", NULL);
+    }
+  }
+
+  return NULL;
+}
+
+PluginWorker *
+plugin_worker_new(uint32_t ring_size, bool threaded)
+{
+  PluginWorker *w = new PluginWorker();
+  w->schedule.handle = w;
+  w->schedule.schedule_work = schedule_work;
+  w->feature.URI = LV2_WORKER__schedule;
+  w->feature.data = &w->schedule;
+  w->threaded = threaded;
+  w->exit.store(false);
+  sem_init(&w->pending, 0, 0);
+  if (ring_init(&w->requests, ring_size) ||
+      ring_init(&w->responses, ring_size) ||
+      !(w->work_buf = (uint8_t *)malloc(w->requests.size)) ||
+      !(w->response_buf = (uint8_t *)malloc(w->responses.size)))
+  {
+    plugin_worker_free(w);
+    return NULL;
+  }
+
+  if (threaded)
+  {
+    if (pthread_create(&w->thread, NULL, worker_thread, w))
+    {
+      plugin_worker_free(w);
+      return NULL;
+    }
+    w->started = true;
+  }
+
+  return w;
+}
+
+const LV2_Feature *
+plugin_worker_feature(PluginWorker *w)
+{
+  return &w->feature;
+}
+
+void
+plugin_worker_attach(PluginWorker *w,
+                     LV2_Handle handle,
+                     const LV2_Worker_Interface *iface)
+{
+  w->handle = handle;
+  w->iface = iface && iface->work ? iface : NULL;
+}
+
+void
+plugin_worker_emit_responses(PluginWorker *w)
+{
+  uint32_t size = 0;
+  while (ring_read(&w->responses, &size, w->response_buf))
+  {
+    ++w->n_responses;
+    if (w->iface->work_response)
+    {
+      w->iface->work_response(w->handle, size, w->response_buf);
+    }
+  }
+}
+
+void
+plugin_worker_end_run(PluginWorker *w)
+{
+  if (w->iface && w->iface->end_run)
+  {
+    w->iface->end_run(w->handle);
+  }
+}
+
+void
+plugin_worker_finish(PluginWorker *w, PluginWorkerStats *stats)
+{
+  if (w->started)
+  {
+    w->exit.store(true, std::memory_order_release);
+    sem_post(&w->pending);
+    pthread_join(w->thread, NULL);
+    w->started = false;
+
+    /* Requests still queued when the thread exits are never done */
+    uint32_t size = 0;
+    while (ring_read(&w->requests, &size, w->work_buf))
+    {
+      ++w->n_dropped_requests;
+    }
+  }
+
+  if (stats)
+  {
+    stats->n_requests = w->n_requests;
+    stats->n_responses = w->n_responses;
+    stats->n_dropped = w->n_dropped_requests + w->n_dropped_responses;
+  }
+}
+
+int
+plugin_worker_reset(PluginWorker *w)
+{
+  plugin_worker_finish(w, NULL);
+  while (!sem_trywait(&w->pending))
+  {
+  }
+
+  w->requests.write.store(0);
+  w->requests.read.store(0);
+  w->responses.write.store(0);
+  w->responses.read.store(0);
+  w->n_requests = 0;
+  w->n_responses = 0;
+  w->n_dropped_requests = 0;
+  w->n_dropped_responses = 0;
+  w->exit.store(false);
+  if (w->threaded)
+  {
+    if (pthread_create(&w->thread, NULL, worker_thread, w))
+    {
+      return 1;
+    }
+    w->started = true;
+  }
+
+  return 0;
+}
+
+void
+plugin_worker_free(PluginWorker *w)
+{
+  if (w)
+  {
+    plugin_worker_finish(w, NULL);
+    sem_destroy(&w->pending);
+    free(w->response_buf);
+    free(w->work_buf);
+    free(w->responses.buf);
+    free(w->requests.buf);
+    delete w;
+  }
+}
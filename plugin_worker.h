@@ -0,0 +1,87 @@
+// SPDX-License-Identifier: ISC
+
+#ifndef PLUGIN_WORKER_H
+#define PLUGIN_WORKER_H
+
+#include "lv2/core/lv2.h"
+#include "lv2/worker/worker.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+   Host side of the LV2 Worker extension for one plugin instance.
+
+   Work the plugin schedules from run() is copied into a lock-free
+   single-producer/single-consumer ring and done by a dedicated thread,
+   whose responses come back through a second ring and are delivered at the
+   start of the next run, so run() never blocks.  A synchronous worker does
+   the work inside schedule_work() instead, which makes renders
+   deterministic, and still delivers responses at the start of the next run
+   as the extension requires.
+*/
+typedef struct PluginWorkerImpl PluginWorker;
+
+/** Worker statistics, valid after plugin_worker_finish(). */
+typedef struct
+{
+  uint64_t n_requests;  ///< Work requests scheduled
+  uint64_t n_responses; ///< Responses delivered to the plugin
+  uint64_t n_dropped;   ///< Requests or responses lost or never done
+} PluginWorkerStats;
+
+/**
+   Create a worker with rings of `ring_size` bytes.
+
+   If `threaded` is true, the worker thread is started now.
+*/
+PluginWorker *
+plugin_worker_new(uint32_t ring_size, bool threaded);
+
+/** Return the work:schedule feature to instantiate the plugin with. */
+const LV2_Feature *
+plugin_worker_feature(PluginWorker *worker);
+
+/**
+   Set the instance that work is done for, once it has been instantiated.
+
+   `iface` may be NULL if the plugin has no worker interface, then all work
+   it schedules fails.
+*/
+void
+plugin_worker_attach(PluginWorker *worker,
+                     LV2_Handle handle,
+                     const LV2_Worker_Interface *iface);
+
+/** Deliver every pending response, call before each run. */
+void
+plugin_worker_emit_responses(PluginWorker *worker);
+
+/** Tell the plugin the run is over, call after each run. */
+void
+plugin_worker_end_run(PluginWorker *worker);
+
+/**
+   Stop the worker thread and get statistics.
+
+   This must be called before the instance is deactivated, since work()
+   may not run at the same time as deactivate().  Requests the thread had
+   not started on are dropped.
+*/
+void
+plugin_worker_finish(PluginWorker *worker, PluginWorkerStats *stats);
+
+/**
+   Drop all pending work and responses, and start the worker again.
+
+   This is for moving a worker to the next user of its instance, which has
+   been reset since plugin_worker_finish().  Returns zero on success.
+*/
+int
+plugin_worker_reset(PluginWorker *worker);
+
+/** Free a worker (after plugin_worker_finish()). */
+void
+plugin_worker_free(PluginWorker *worker);
+
+#endif // PLUGIN_WORKER_H
@@ -0,0 +1,101 @@
+// SPDX-License-Identifier: ISC
+
+/** Test gain plugin, applies a gain in dB to its stereo input. */
+
+#include "lv2/core/lv2.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define GAIN_URI "https://github.com/apiel/lilv-midi-example/plugins/gain"
+
+typedef enum
+{
+  GAIN_GAIN = 0,
+  GAIN_IN_L = 1,
+  GAIN_IN_R = 2,
+  GAIN_OUT_L = 3,
+  GAIN_OUT_R = 4
+} PortIndex;
+
+typedef struct
+{
+  const float *gain;
+  const float *in[2];
+  float *out[2];
+  float last_db;   ///< Gain of the last run, in dB
+  float last_coef; ///< Gain of the last run, as a coefficient
+} Gain;
+
+static LV2_Handle
+instantiate(const LV2_Descriptor *descriptor,
+            double rate,
+            const char *bundle_path,
+            const LV2_Feature *const *features)
+{
+  Gain *self = (Gain *)calloc(1, sizeof(Gain));
+  if (self)
+  {
+    self->last_coef = 1.0f;
+  }
+
+  return (LV2_Handle)self;
+}
+
+static void
+connect_port(LV2_Handle instance, uint32_t port, void *data)
+{
+  Gain *self = (Gain *)instance;
+  if (port == GAIN_GAIN)
+  {
+    self->gain = (const float *)data;
+  }
+  else if (port <= GAIN_IN_R)
+  {
+    self->in[port - GAIN_IN_L] = (const float *)data;
+  }
+  else if (port <= GAIN_OUT_R)
+  {
+    self->out[port - GAIN_OUT_L] = (float *)data;
+  }
+}
+
+static void
+run(LV2_Handle instance, uint32_t n_samples)
+{
+  Gain *self = (Gain *)instance;
+
+  const float db = *self->gain;
+  if (db != self->last_db)
+  {
+    self->last_db = db;
+    self->last_coef = db > -90.0f ? powf(10.0f, db * 0.05f) : 0.0f;
+  }
+
+  const float coef = self->last_coef;
+  for (unsigned c = 0; c < 2; ++c)
+  {
+    const float *in = self->in[c];
+    float *out = self->out[c];
+    for (uint32_t i = 0; i < n_samples; ++i)
+    {
+      out[i] = in[i] * coef;
+    }
+  }
+}
+
+static void
+cleanup(LV2_Handle instance)
+{
+  free(instance);
+}
+
+static const LV2_Descriptor descriptor = {
+    GAIN_URI, instantiate, connect_port, NULL, run, NULL, cleanup, NULL};
+
+LV2_SYMBOL_EXPORT const LV2_Descriptor *
+lv2_descriptor(uint32_t index)
+{
+  return index == 0 ? &descriptor : NULL;
+}
@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: ISC
+
+/**
+   Test passthrough plugin.
+
+   Copies its stereo input to its output and does nothing else, so the time
+   spent running it is almost entirely host overhead.
+*/
+
+#include "lv2/core/lv2.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PASSTHROUGH_URI "https://github.com/apiel/lilv-midi-example/plugins/passthrough"
+
+typedef enum
+{
+  PASSTHROUGH_IN_L = 0,
+  PASSTHROUGH_IN_R = 1,
+  PASSTHROUGH_OUT_L = 2,
+  PASSTHROUGH_OUT_R = 3
+} PortIndex;
+
+typedef struct
+{
+  const float *in[2];
+  float *out[2];
+} Passthrough;
+
+static LV2_Handle
+instantiate(const LV2_Descriptor *descriptor,
+            double rate,
+            const char *bundle_path,
+            const LV2_Feature *const *features)
+{
+  return (LV2_Handle)calloc(1, sizeof(Passthrough));
+}
+
+static void
+connect_port(LV2_Handle instance, uint32_t port, void *data)
+{
+  Passthrough *self = (Passthrough *)instance;
+  if (port <= PASSTHROUGH_IN_R)
+  {
+    self->in[port - PASSTHROUGH_IN_L] = (const float *)data;
+  }
+  else if (port <= PASSTHROUGH_OUT_R)
+  {
+    self->out[port - PASSTHROUGH_OUT_L] = (float *)data;
+  }
+}
+
+static void
+run(LV2_Handle instance, uint32_t n_samples)
+{
+  Passthrough *self = (Passthrough *)instance;
+  for (unsigned c = 0; c < 2; ++c)
+  {
+    if (self->out[c] != self->in[c])
+    {
+      memcpy(self->out[c], self->in[c], n_samples * sizeof(float));
+    }
+  }
+}
+
+static void
+cleanup(LV2_Handle instance)
+{
+  free(instance);
+}
+
+static const LV2_Descriptor descriptor = {
+    PASSTHROUGH_URI, instantiate, connect_port, NULL, run, NULL, cleanup, NULL};
+
+LV2_SYMBOL_EXPORT const LV2_Descriptor *
+lv2_descriptor(uint32_t index)
+{
+  return index == 0 ? &descriptor : NULL;
+}
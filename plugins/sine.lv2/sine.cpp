@@ -0,0 +1,99 @@
+// SPDX-License-Identifier: ISC
+
+/** Test sine oscillator plugin. */
+
+#include "lv2/core/lv2.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define SINE_URI "https://github.com/apiel/lilv-midi-example/plugins/sine"
+
+typedef enum
+{
+  SINE_FREQUENCY = 0,
+  SINE_AMPLITUDE = 1,
+  SINE_OUT = 2
+} PortIndex;
+
+typedef struct
+{
+  const float *frequency;
+  const float *amplitude;
+  float *out;
+  double rate;  ///< Sample rate
+  double phase; ///< Current phase in cycles, [0, 1)
+} Sine;
+
+static LV2_Handle
+instantiate(const LV2_Descriptor *descriptor,
+            double rate,
+            const char *bundle_path,
+            const LV2_Feature *const *features)
+{
+  Sine *self = (Sine *)calloc(1, sizeof(Sine));
+  if (self)
+  {
+    self->rate = rate;
+  }
+
+  return (LV2_Handle)self;
+}
+
+static void
+connect_port(LV2_Handle instance, uint32_t port, void *data)
+{
+  Sine *self = (Sine *)instance;
+  switch ((PortIndex)port)
+  {
+  case SINE_FREQUENCY:
+    self->frequency = (const float *)data;
+    break;
+  case SINE_AMPLITUDE:
+    self->amplitude = (const float *)data;
+    break;
+  case SINE_OUT:
+    self->out = (float *)data;
+    break;
+  }
+}
+
+static void
+activate(LV2_Handle instance)
+{
+  ((Sine *)instance)->phase = 0.0;
+}
+
+static void
+run(LV2_Handle instance, uint32_t n_samples)
+{
+  Sine *self = (Sine *)instance;
+
+  const double step = *self->frequency / self->rate;
+  const float amplitude = *self->amplitude;
+  double phase = self->phase;
+  for (uint32_t i = 0; i < n_samples; ++i)
+  {
+    self->out[i] = amplitude * (float)sin(2.0 * M_PI * phase);
+    phase += step;
+    phase -= floor(phase);
+  }
+
+  self->phase = phase;
+}
+
+static void
+cleanup(LV2_Handle instance)
+{
+  free(instance);
+}
+
+static const LV2_Descriptor descriptor = {
+    SINE_URI, instantiate, connect_port, activate, run, NULL, cleanup, NULL};
+
+LV2_SYMBOL_EXPORT const LV2_Descriptor *
+lv2_descriptor(uint32_t index)
+{
+  return index == 0 ? &descriptor : NULL;
+}
@@ -0,0 +1,223 @@
+// SPDX-License-Identifier: ISC
+
+/**
+   Test synth plugin.
+
+   A polyphonic sine synth with a linear attack and release, played by MIDI
+   note on and off events.  Events are rendered at their exact frame, so the
+   output can be used to check the timing of the host's event delivery.
+*/
+
+#include "lv2/atom/atom.h"
+#include "lv2/atom/util.h"
+#include "lv2/core/lv2.h"
+#include "lv2/midi/midi.h"
+#include "lv2/urid/urid.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SYNTH_URI "https://github.com/apiel/lilv-midi-example/plugins/synth"
+#define N_VOICES 16
+#define ENVELOPE_SECONDS 0.005
+
+typedef enum
+{
+  SYNTH_CONTROL = 0,
+  SYNTH_LEVEL = 1,
+  SYNTH_OUT_L = 2,
+  SYNTH_OUT_R = 3
+} PortIndex;
+
+typedef struct
+{
+  uint8_t note; ///< MIDI note number
+  bool held;    ///< True until the note off
+  float gain;   ///< Current envelope gain
+  double step;  ///< Phase increment per frame, in cycles
+  double phase; ///< Current phase in cycles, [0, 1)
+} Voice;
+
+typedef struct
+{
+  const LV2_Atom_Sequence *control;
+  const float *level;
+  float *out[2];
+  LV2_URID midi_MidiEvent;
+  double rate;    ///< Sample rate
+  float env_step; ///< Envelope change per frame
+  Voice voices[N_VOICES];
+} Synth;
+
+static LV2_Handle
+instantiate(const LV2_Descriptor *descriptor,
+            double rate,
+            const char *bundle_path,
+            const LV2_Feature *const *features)
+{
+  const LV2_URID_Map *map = NULL;
+  for (unsigned i = 0; features && features[i]; ++i)
+  {
+    if (!strcmp(features[i]->URI, LV2_URID__map))
+    {
+      map = (const LV2_URID_Map *)features[i]->data;
+    }
+  }
+
+  Synth *self = NULL;
+  if (!map || !(self = (Synth *)calloc(1, sizeof(Synth))))
+  {
+    return NULL;
+  }
+
+  self->midi_MidiEvent = map->map(map->handle, LV2_MIDI__MidiEvent);
+  self->rate = rate;
+  self->env_step = (float)(1.0 / (ENVELOPE_SECONDS * rate));
+  return (LV2_Handle)self;
+}
+
+static void
+connect_port(LV2_Handle instance, uint32_t port, void *data)
+{
+  Synth *self = (Synth *)instance;
+  switch ((PortIndex)port)
+  {
+  case SYNTH_CONTROL:
+    self->control = (const LV2_Atom_Sequence *)data;
+    break;
+  case SYNTH_LEVEL:
+    self->level = (const float *)data;
+    break;
+  case SYNTH_OUT_L:
+  case SYNTH_OUT_R:
+    self->out[port - SYNTH_OUT_L] = (float *)data;
+    break;
+  }
+}
+
+static void
+activate(LV2_Handle instance)
+{
+  Synth *self = (Synth *)instance;
+  memset(self->voices, 0, sizeof(self->voices));
+}
+
+/** Start or stop a note. */
+static void
+handle_midi(Synth *self, const uint8_t *msg)
+{
+  const uint8_t type = msg[0] & 0xF0;
+  const bool on = type == LV2_MIDI_MSG_NOTE_ON && msg[2] > 0;
+  if (!on && type != LV2_MIDI_MSG_NOTE_ON && type != LV2_MIDI_MSG_NOTE_OFF)
+  {
+    return;
+  }
+
+  if (!on)
+  {
+    for (unsigned v = 0; v < N_VOICES; ++v)
+    {
+      if (self->voices[v].held && self->voices[v].note == msg[1])
+      {
+        self->voices[v].held = false;
+      }
+    }
+    return;
+  }
+
+  /* Take the quietest released voice, or steal the first if all are held */
+  Voice *voice = NULL;
+  for (unsigned v = 0; v < N_VOICES; ++v)
+  {
+    if (!self->voices[v].held && (!voice || self->voices[v].gain < voice->gain))
+    {
+      voice = &self->voices[v];
+    }
+  }
+  if (!voice)
+  {
+    voice = &self->voices[0];
+  }
+
+  voice->note = msg[1];
+  voice->held = true;
+  voice->step = 440.0 * pow(2.0, (msg[1] - 69) / 12.0) / self->rate;
+  if (voice->gain <= 0.0f)
+  {
+    voice->phase = 0.0;
+  }
+}
+
+/** Add every sounding voice to the output from frame `begin` to `end`. */
+static void
+render(Synth *self, uint32_t begin, uint32_t end)
+{
+  const float level = *self->level;
+  for (unsigned v = 0; v < N_VOICES; ++v)
+  {
+    Voice *voice = &self->voices[v];
+    if (!voice->held && voice->gain <= 0.0f)
+    {
+      continue;
+    }
+
+    for (uint32_t i = begin; i < end; ++i)
+    {
+      if (voice->held && voice->gain < 1.0f)
+      {
+        voice->gain = fminf(1.0f, voice->gain + self->env_step);
+      }
+      else if (!voice->held)
+      {
+        voice->gain = fmaxf(0.0f, voice->gain - self->env_step);
+      }
+
+      const float s =
+          level * voice->gain * (float)sin(2.0 * M_PI * voice->phase);
+      self->out[0][i] += s;
+      self->out[1][i] += s;
+      voice->phase += voice->step;
+      voice->phase -= floor(voice->phase);
+    }
+  }
+}
+
+static void
+run(LV2_Handle instance, uint32_t n_samples)
+{
+  Synth *self = (Synth *)instance;
+
+  memset(self->out[0], 0, n_samples * sizeof(float));
+  memset(self->out[1], 0, n_samples * sizeof(float));
+
+  uint32_t offset = 0;
+  LV2_ATOM_SEQUENCE_FOREACH(self->control, ev)
+  {
+    const uint32_t frame = (uint32_t)ev->time.frames;
+    if (ev->body.type == self->midi_MidiEvent)
+    {
+      render(self, offset, frame < n_samples ? frame : n_samples);
+      handle_midi(self, (const uint8_t *)LV2_ATOM_BODY_CONST(&ev->body));
+      offset = frame < n_samples ? frame : n_samples;
+    }
+  }
+
+  render(self, offset, n_samples);
+}
+
+static void
+cleanup(LV2_Handle instance)
+{
+  free(instance);
+}
+
+static const LV2_Descriptor descriptor = {
+    SYNTH_URI, instantiate, connect_port, activate, run, NULL, cleanup, NULL};
+
+LV2_SYMBOL_EXPORT const LV2_Descriptor *
+lv2_descriptor(uint32_t index)
+{
+  return index == 0 ? &descriptor : NULL;
+}
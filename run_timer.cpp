@@ -0,0 +1,244 @@
+// SPDX-License-Identifier: ISC
+
+#include "run_timer.h"
+
+#include <atomic>
+
+#include <stdlib.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define SUB_BITS 4
+#define N_SUBS (1u << SUB_BITS)
+#define N_BUCKETS ((64 - SUB_BITS + 1) * N_SUBS)
+
+/** Log-linear histogram that any number of threads may record into */
+typedef struct
+{
+  std::atomic<uint64_t> counts[N_BUCKETS];
+  std::atomic<uint64_t> n;
+  std::atomic<uint64_t> sum;
+  std::atomic<uint64_t> min;
+  std::atomic<uint64_t> max;
+} Histogram;
+
+struct RunTimerImpl
+{
+  Histogram ns;     ///< Wall time of each run in nanoseconds
+  Histogram cycles; ///< Time stamp counter ticks of each run
+  Histogram load;   ///< DSP load of each run in parts per million
+};
+
+/** Return the bucket of `value`, values below N_SUBS have their own. */
+static unsigned
+bucket_of(uint64_t value)
+{
+  if (value < N_SUBS)
+  {
+    return (unsigned)value;
+  }
+
+  const unsigned msb = 63u - (unsigned)__builtin_clzll(value);
+  return (msb - SUB_BITS + 1) * N_SUBS +
+         (unsigned)((value >> (msb - SUB_BITS)) & (N_SUBS - 1));
+}
+
+/** Return the highest value that falls into bucket `b`. */
+static uint64_t
+bucket_max(unsigned b)
+{
+  if (b < N_SUBS)
+  {
+    return b;
+  }
+
+  const unsigned shift = b / N_SUBS - 1;
+  const uint64_t low = (uint64_t)(N_SUBS + b % N_SUBS) << shift;
+  return low + ((uint64_t)1 << shift) - 1;
+}
+
+static void
+histogram_init(Histogram *h)
+{
+  for (unsigned b = 0; b < N_BUCKETS; ++b)
+  {
+    h->counts[b].store(0, std::memory_order_relaxed);
+  }
+
+  h->n.store(0, std::memory_order_relaxed);
+  h->sum.store(0, std::memory_order_relaxed);
+  h->min.store(UINT64_MAX, std::memory_order_relaxed);
+  h->max.store(0, std::memory_order_relaxed);
+}
+
+static void
+histogram_record(Histogram *h, uint64_t value)
+{
+  h->counts[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+  h->n.fetch_add(1, std::memory_order_relaxed);
+  h->sum.fetch_add(value, std::memory_order_relaxed);
+
+  /* Only new extremes, which soon become rare, need a compare and swap */
+  uint64_t min = h->min.load(std::memory_order_relaxed);
+  while (value < min && !h->min.compare_exchange_weak(
+                            min, value, std::memory_order_relaxed))
+  {
+  }
+  uint64_t max = h->max.load(std::memory_order_relaxed);
+  while (value > max && !h->max.compare_exchange_weak(
+                            max, value, std::memory_order_relaxed))
+  {
+  }
+}
+
+/** Return the value at quantile `q`, to the precision of a bucket. */
+static uint64_t
+histogram_quantile(const Histogram *h, double q)
+{
+  const uint64_t n = h->n.load(std::memory_order_relaxed);
+  const uint64_t min = h->min.load(std::memory_order_relaxed);
+  const uint64_t max = h->max.load(std::memory_order_relaxed);
+  const uint64_t rank = (uint64_t)(q * (double)n + 0.5);
+  uint64_t seen = 0;
+  for (unsigned b = 0; n && b < N_BUCKETS; ++b)
+  {
+    seen += h->counts[b].load(std::memory_order_relaxed);
+    if (seen >= rank && seen)
+    {
+      const uint64_t value = bucket_max(b);
+      return value < min ? min : value > max ? max : value;
+    }
+  }
+
+  return max;
+}
+
+static void
+histogram_summary(const Histogram *h, RunDistribution *d)
+{
+  const uint64_t n = h->n.load(std::memory_order_relaxed);
+  d->min = n ? h->min.load(std::memory_order_relaxed) : 0;
+  d->p50 = histogram_quantile(h, 0.5);
+  d->p99 = histogram_quantile(h, 0.99);
+  d->p999 = histogram_quantile(h, 0.999);
+  d->max = h->max.load(std::memory_order_relaxed);
+  d->mean = n ? (double)h->sum.load(std::memory_order_relaxed) / n : 0.0;
+}
+
+static void
+histogram_write_json(const Histogram *h,
+                     const char *name,
+                     double scale,
+                     FILE *stream)
+{
+  RunDistribution d;
+  histogram_summary(h, &d);
+  fprintf(stream,
+          "  \"%s\": {\n"
+          "    \"min\": %.9g,\n"
+          "    \"mean\": %.9g,\n"
+          "    \"p50\": %.9g,\n"
+          "    \"p99\": %.9g,\n"
+          "    \"p99.9\": %.9g,\n"
+          "    \"max\": %.9g,\n"
+          "    \"buckets\": [",
+          name,
+          (double)d.min * scale,
+          d.mean * scale,
+          (double)d.p50 * scale,
+          (double)d.p99 * scale,
+          (double)d.p999 * scale,
+          (double)d.max * scale);
+
+  /* Only buckets with values, as [highest value, count] pairs */
+  bool first = true;
+  for (unsigned b = 0; b < N_BUCKETS; ++b)
+  {
+    const uint64_t count = h->counts[b].load(std::memory_order_relaxed);
+    if (count)
+    {
+      fprintf(stream,
+              "%s[%.9g, %lu]",
+              first ? "" : ", ",
+              (double)bucket_max(b) * scale,
+              (unsigned long)count);
+      first = false;
+    }
+  }
+  fprintf(stream, "]\n  }");
+}
+
+RunTimer *
+run_timer_new(void)
+{
+  RunTimer *timer = new RunTimer();
+  histogram_init(&timer->ns);
+  histogram_init(&timer->cycles);
+  histogram_init(&timer->load);
+  return timer;
+}
+
+RunStamp
+run_timer_stamp(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  RunStamp stamp;
+  stamp.ns = (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#if defined(__x86_64__) || defined(__i386__)
+  stamp.cycles = __rdtsc();
+#elif defined(__aarch64__)
+  __asm__ volatile("mrs %0, cntvct_el0" : "=r"(stamp.cycles));
+#else
+  stamp.cycles = 0;
+#endif
+  return stamp;
+}
+
+void
+run_timer_record(RunTimer *timer,
+                 const RunStamp *start,
+                 uint32_t n_frames,
+                 uint32_t sample_rate)
+{
+  const RunStamp end = run_timer_stamp();
+  const uint64_t ns = end.ns - start->ns;
+  const uint64_t budget_ns = (uint64_t)n_frames * 1000000000u / sample_rate;
+  histogram_record(&timer->ns, ns);
+  histogram_record(&timer->cycles, end.cycles - start->cycles);
+  histogram_record(&timer->load,
+                   budget_ns ? ns * 1000000u / budget_ns : 0);
+}
+
+void
+run_timer_summary(const RunTimer *timer, RunSummary *summary)
+{
+  summary->n_runs = timer->ns.n.load(std::memory_order_relaxed);
+  histogram_summary(&timer->ns, &summary->ns);
+  histogram_summary(&timer->load, &summary->load);
+}
+
+int
+run_timer_write_json(const RunTimer *timer, FILE *stream)
+{
+  fprintf(stream,
+          "{\n  \"runs\": %lu,\n",
+          (unsigned long)timer->ns.n.load(std::memory_order_relaxed));
+  histogram_write_json(&timer->ns, "time_ns", 1.0, stream);
+  fprintf(stream, ",\n");
+  histogram_write_json(&timer->cycles, "cycles", 1.0, stream);
+  fprintf(stream, ",\n");
+  histogram_write_json(&timer->load, "dsp_load", 1e-6, stream);
+  fprintf(stream, "\n}\n");
+  return ferror(stream) ? 1 : 0;
+}
+
+void
+run_timer_free(RunTimer *timer)
+{
+  delete timer;
+}
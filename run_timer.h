@@ -0,0 +1,73 @@
+// SPDX-License-Identifier: ISC
+
+#ifndef RUN_TIMER_H
+#define RUN_TIMER_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+   Histograms of how long plugin runs take.
+
+   Every run records its wall time, its cycle count, and its DSP load, the
+   wall time as a fraction of the real time the run's frames last.  Values
+   go into log-linear buckets with 16 buckets per power of two, so any
+   value is known within about 6%, and recording is a few relaxed atomic
+   additions, so several threads may record into one timer without locks.
+*/
+typedef struct RunTimerImpl RunTimer;
+
+/** Start of a timed run, from run_timer_stamp(). */
+typedef struct
+{
+  uint64_t ns;     ///< Monotonic time in nanoseconds
+  uint64_t cycles; ///< Time stamp counter, or zero if there is none
+} RunStamp;
+
+/** Distribution of one measure, see run_timer_summary(). */
+typedef struct
+{
+  uint64_t min;
+  uint64_t p50;
+  uint64_t p99;
+  uint64_t p999;
+  uint64_t max;
+  double mean;
+} RunDistribution;
+
+/** Summary of every run recorded. */
+typedef struct
+{
+  uint64_t n_runs;      ///< Number of runs
+  RunDistribution ns;   ///< Wall time in nanoseconds
+  RunDistribution load; ///< DSP load in parts per million
+} RunSummary;
+
+/** Create an empty timer. */
+RunTimer *
+run_timer_new(void);
+
+/** Return the current time, to pass to run_timer_record() after a run. */
+RunStamp
+run_timer_stamp(void);
+
+/** Record a run of `n_frames` at `sample_rate` that started at `start`. */
+void
+run_timer_record(RunTimer *timer,
+                 const RunStamp *start,
+                 uint32_t n_frames,
+                 uint32_t sample_rate);
+
+/** Summarise the runs recorded so far. */
+void
+run_timer_summary(const RunTimer *timer, RunSummary *summary);
+
+/** Write every histogram as a JSON object to `stream`. */
+int
+run_timer_write_json(const RunTimer *timer, FILE *stream);
+
+/** Free a timer. */
+void
+run_timer_free(RunTimer *timer);
+
+#endif // RUN_TIMER_H
@@ -0,0 +1,253 @@
+// SPDX-License-Identifier: ISC
+
+#include "trace.h"
+
+#include <atomic>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DETAIL_SIZE 48
+#define THREAD_NAME_SIZE 32
+
+/** A span of time a thread spent on something */
+typedef struct
+{
+  uint64_t start;           ///< Start in nanoseconds
+  uint64_t end;             ///< End in nanoseconds
+  const char *name;         ///< What the thread did
+  char detail[DETAIL_SIZE]; ///< What it did it for, or empty
+} Span;
+
+/** The spans of one thread */
+typedef struct ThreadTraceImpl
+{
+  struct ThreadTraceImpl *next;  ///< Next buffer of the list of all
+  long tid;                      ///< Kernel thread ID
+  char name[THREAD_NAME_SIZE];   ///< Thread name, or empty
+  Span *spans;                   ///< Recorded spans
+  std::atomic<uint32_t> n_spans; ///< Number of recorded spans
+  uint32_t n_dropped;            ///< Spans that did not fit
+} ThreadTrace;
+
+/* Spans of threads without a buffer are only counted, in n_unnamed */
+static std::atomic<bool> enabled(false);
+static std::atomic<ThreadTrace *> threads(NULL);
+static std::atomic<unsigned> generation(0);
+static std::atomic<uint64_t> n_unnamed(0);
+static uint32_t capacity;
+static uint64_t epoch;
+
+static thread_local ThreadTrace *local;
+static thread_local unsigned local_generation;
+
+static uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/** Return the buffer of the calling thread in this trace, or NULL. */
+static ThreadTrace *
+thread_trace(void)
+{
+  const unsigned gen = generation.load(std::memory_order_acquire);
+  return local && local_generation == gen ? local : NULL;
+}
+
+/**
+   Create a buffer for the calling thread and add it to the list.
+
+   Every page of the spans is written here, so that recording them later
+   neither allocates nor takes page faults.
+*/
+static ThreadTrace *
+new_thread_trace(void)
+{
+  const unsigned gen = generation.load(std::memory_order_acquire);
+  ThreadTrace *t = new ThreadTrace();
+  if (!(t->spans = (Span *)malloc((size_t)capacity * sizeof(Span))))
+  {
+    delete t;
+    return NULL;
+  }
+  memset(t->spans, 0, (size_t)capacity * sizeof(Span));
+
+  t->tid = (long)syscall(SYS_gettid);
+  t->n_spans.store(0, std::memory_order_relaxed);
+  t->next = threads.load(std::memory_order_relaxed);
+  while (!threads.compare_exchange_weak(
+      t->next, t, std::memory_order_release, std::memory_order_relaxed))
+  {
+  }
+
+  local = t;
+  local_generation = gen;
+  return t;
+}
+
+/** Write `str` as the inside of a JSON string. */
+static void
+write_escaped(FILE *stream, const char *str)
+{
+  for (const char *c = str; *c; ++c)
+  {
+    if (*c == '"' || *c == '\\')
+    {
+      fprintf(stream, "\\%c", *c);
+    }
+    else if ((unsigned char)*c < 0x20)
+    {
+      fprintf(stream, "\\u%04x", (unsigned)*c);
+    }
+    else
+    {
+      fputc(*c, stream);
+    }
+  }
+}
+
+void
+trace_start(uint32_t n_spans)
+{
+  capacity = n_spans ? n_spans : 1;
+  epoch = now_ns();
+  n_unnamed.store(0, std::memory_order_relaxed);
+  generation.fetch_add(1, std::memory_order_release);
+  enabled.store(true, std::memory_order_release);
+}
+
+uint64_t
+trace_begin(void)
+{
+  return enabled.load(std::memory_order_relaxed) ? now_ns() : 0;
+}
+
+void
+trace_end(uint64_t start, const char *name, const char *detail)
+{
+  ThreadTrace *t = start ? thread_trace() : NULL;
+  if (!t)
+  {
+    if (start)
+    {
+      n_unnamed.fetch_add(1, std::memory_order_relaxed);
+    }
+    return;
+  }
+
+  const uint32_t n = t->n_spans.load(std::memory_order_relaxed);
+  if (n == capacity)
+  {
+    ++t->n_dropped;
+    return;
+  }
+
+  Span *span = &t->spans[n];
+  span->start = start;
+  span->end = now_ns();
+  span->name = name;
+  span->detail[0] = '\0';
+  if (detail)
+  {
+    strncat(span->detail, detail, DETAIL_SIZE - 1);
+  }
+
+  t->n_spans.store(n + 1, std::memory_order_release);
+}
+
+void
+trace_thread_name(const char *name)
+{
+  if (!enabled.load(std::memory_order_relaxed))
+  {
+    return;
+  }
+
+  ThreadTrace *t = thread_trace();
+  if (t || (t = new_thread_trace()))
+  {
+    t->name[0] = '\0';
+    strncat(t->name, name, THREAD_NAME_SIZE - 1);
+  }
+}
+
+int
+trace_write(const char *path)
+{
+  FILE *fd = fopen(path, "w");
+  if (!fd)
+  {
+    return 1;
+  }
+
+  const int pid = (int)getpid();
+  bool first = true;
+  uint64_t n_dropped = n_unnamed.load(std::memory_order_relaxed);
+  fprintf(fd, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+  for (ThreadTrace *t = threads.load(std::memory_order_acquire); t;
+       t = t->next)
+  {
+    if (t->name[0])
+    {
+      fprintf(fd,
+              "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, "
+              "\"tid\": %ld, \"args\": {\"name\": \"",
+              first ? "" : ",\n",
+              pid,
+              t->tid);
+      write_escaped(fd, t->name);
+      fprintf(fd, "\"}}");
+      first = false;
+    }
+
+    const uint32_t n = t->n_spans.load(std::memory_order_acquire);
+    for (uint32_t i = 0; i < n; ++i)
+    {
+      const Span *span = &t->spans[i];
+      fprintf(fd,
+              "%s{\"name\": \"%s\", \"cat\": \"host\", \"ph\": \"X\", "
+              "\"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %ld",
+              first ? "" : ",\n",
+              span->name,
+              (double)(span->start - epoch) * 1e-3,
+              (double)(span->end - span->start) * 1e-3,
+              pid,
+              t->tid);
+      if (span->detail[0])
+      {
+        fprintf(fd, ", \"args\": {\"detail\": \"");
+        write_escaped(fd, span->detail);
+        fprintf(fd, "\"}");
+      }
+      fprintf(fd, "}");
+      first = false;
+    }
+    n_dropped += t->n_dropped;
+  }
+  fprintf(fd,
+          "\n], \"otherData\": {\"dropped_spans\": %lu}}\n",
+          (unsigned long)n_dropped);
+
+  return (ferror(fd) | fclose(fd)) ? 1 : 0;
+}
+
+void
+trace_stop(void)
+{
+  enabled.store(false, std::memory_order_release);
+  generation.fetch_add(1, std::memory_order_release);
+  for (ThreadTrace *t = threads.exchange(NULL); t;)
+  {
+    ThreadTrace *next = t->next;
+    free(t->spans);
+    delete t;
+    t = next;
+  }
+}
@@ -0,0 +1,61 @@
+// SPDX-License-Identifier: ISC
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/**
+   Timeline of what every thread does, in the Chrome trace event format.
+
+   While tracing, each thread appends spans to a fixed buffer of its own,
+   never touched by another thread until the trace is written, so recording
+   takes no lock.  The buffer is allocated by trace_thread_name(), which a
+   thread calls when it starts, so that recording never allocates.  Spans
+   that do not fit in a full buffer, or come from a thread that has not
+   named itself, are dropped and counted.  After the render, trace_write()
+   writes every buffer to a JSON file that chrome://tracing or Perfetto
+   (ui.perfetto.dev) opens.
+
+   When tracing is off, a span costs one relaxed atomic load.
+*/
+
+/** Start tracing, with room for `capacity` spans per thread. */
+void
+trace_start(uint32_t capacity);
+
+/** Return the start time of a span, or 0 if tracing is off. */
+uint64_t
+trace_begin(void);
+
+/**
+   Record a span from `start` until now on the calling thread.
+
+   Does nothing if `start` is 0.  The `name` must be a string constant,
+   `detail` may be NULL and is copied, truncated if long.
+*/
+void
+trace_end(uint64_t start, const char *name, const char *detail);
+
+/**
+   Name the calling thread in the trace, if tracing is on.
+
+   This allocates the thread's buffer, so it must be called before the
+   thread records any span, outside of anything timed.
+*/
+void
+trace_thread_name(const char *name);
+
+/**
+   Write every span recorded so far to `path`.
+
+   No other thread may record while this runs.  Returns zero on success.
+*/
+int
+trace_write(const char *path);
+
+/** Stop tracing and free every buffer, with no other thread recording. */
+void
+trace_stop(void);
+
+#endif // TRACE_H
@@ -0,0 +1,141 @@
+// SPDX-License-Identifier: ISC
+
+/**
+   Microbenchmark of URID map lookups under contention.
+
+   Several threads repeatedly map a set of already interned URIs, once
+   through the lock-free map directly and once with every call serialised by
+   a global mutex, which is what a naive shared host map would do.
+*/
+
+#include "urid_map.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define N_URIS 256
+#define MAX_THREADS 64
+
+typedef struct
+{
+  URIDMap *map;
+  char **uris;
+  long n_lookups;
+  bool locked;
+  pthread_barrier_t *barrier;
+  unsigned long checksum;
+} Job;
+
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void *
+lookup_thread(void *data)
+{
+  Job *job = (Job *)data;
+  unsigned long sum = 0;
+
+  pthread_barrier_wait(job->barrier);
+  for (long i = 0; i < job->n_lookups; ++i)
+  {
+    const char *uri = job->uris[i % N_URIS];
+    if (job->locked)
+    {
+      pthread_mutex_lock(&global_lock);
+      sum += urid_map_uri(job->map, uri);
+      pthread_mutex_unlock(&global_lock);
+    }
+    else
+    {
+      sum += urid_map_uri(job->map, uri);
+    }
+  }
+
+  job->checksum = sum;
+  return NULL;
+}
+
+/** Run `n_threads` lookup threads and return the elapsed time. */
+static double
+run(URIDMap *map, char **uris, unsigned n_threads, long n_lookups, bool locked)
+{
+  pthread_t threads[MAX_THREADS];
+  Job jobs[MAX_THREADS];
+  pthread_barrier_t barrier;
+  pthread_barrier_init(&barrier, NULL, n_threads + 1);
+
+  for (unsigned t = 0; t < n_threads; ++t)
+  {
+    jobs[t].map = map;
+    jobs[t].uris = uris;
+    jobs[t].n_lookups = n_lookups;
+    jobs[t].locked = locked;
+    jobs[t].barrier = &barrier;
+    pthread_create(&threads[t], NULL, lookup_thread, &jobs[t]);
+  }
+
+  pthread_barrier_wait(&barrier);
+  const double start = now();
+  for (unsigned t = 0; t < n_threads; ++t)
+  {
+    pthread_join(threads[t], NULL);
+  }
+  const double elapsed = now() - start;
+
+  pthread_barrier_destroy(&barrier);
+  return elapsed;
+}
+
+int
+main(int argc, char **argv)
+{
+  const unsigned max_threads = argc > 1 ? (unsigned)atoi(argv[1]) : 8;
+  const long n_lookups = argc > 2 ? atol(argv[2]) : 1000000;
+  if (max_threads < 1 || max_threads > MAX_THREADS || n_lookups < 1)
+  {
+    fprintf(stderr, "Usage: urid_bench [MAX_THREADS] [LOOKUPS_PER_THREAD]\n");
+    return 1;
+  }
+
+  URIDMap *map = urid_map_new(4096);
+  char *uris[N_URIS];
+  for (unsigned i = 0; i < N_URIS; ++i)
+  {
+    uris[i] = (char *)malloc(64);
+    snprintf(uris[i], 64, "http://example.org/ns/urid-bench#uri%u", i);
+    urid_map_uri(map, uris[i]);
+  }
+
+  printf("threads,mode,lookups,seconds,ns_per_lookup,mlookups_per_sec\n");
+  for (unsigned n = 1; n <= max_threads; n *= 2)
+  {
+    for (int locked = 0; locked < 2; ++locked)
+    {
+      const double t = run(map, uris, n, n_lookups, locked);
+      const double total = (double)n * (double)n_lookups;
+      printf("%u,%s,%.0f,%.4f,%.2f,%.2f\n",
+             n,
+             locked ? "mutex" : "lock-free",
+             total,
+             t,
+             t * 1e9 / (double)n_lookups,
+             total / t * 1e-6);
+    }
+  }
+
+  for (unsigned i = 0; i < N_URIS; ++i)
+  {
+    free(uris[i]);
+  }
+  urid_map_free(map);
+  return 0;
+}
@@ -0,0 +1,109 @@
+// SPDX-License-Identifier: ISC
+
+#include "urid_map.h"
+
+#include <atomic>
+#include <new>
+
+#include <stdlib.h>
+#include <string.h>
+
+struct URIDMapImpl
+{
+  uint32_t mask;              ///< Number of slots minus one
+  std::atomic<char *> *slots; ///< Interned URI of each slot, or NULL
+};
+
+/** 32-bit FNV-1a hash. */
+static uint32_t
+hash_uri(const char *uri)
+{
+  uint32_t h = 2166136261U;
+  for (const unsigned char *s = (const unsigned char *)uri; *s; ++s)
+  {
+    h = (h ^ *s) * 16777619U;
+  }
+  return h;
+}
+
+URIDMap *
+urid_map_new(uint32_t capacity)
+{
+  uint32_t n_slots = 16;
+  while (n_slots < capacity)
+  {
+    n_slots <<= 1;
+  }
+
+  URIDMap *map = new (std::nothrow) URIDMap();
+  if (!map ||
+      !(map->slots = new (std::nothrow) std::atomic<char *>[n_slots]()))
+  {
+    delete map;
+    return NULL;
+  }
+
+  map->mask = n_slots - 1;
+  return map;
+}
+
+void
+urid_map_free(URIDMap *map)
+{
+  if (map)
+  {
+    for (uint32_t i = 0; i <= map->mask; ++i)
+    {
+      free(map->slots[i].load(std::memory_order_relaxed));
+    }
+    delete[] map->slots;
+    delete map;
+  }
+}
+
+LV2_URID
+urid_map_uri(LV2_URID_Map_Handle handle, const char *uri)
+{
+  URIDMap *map = (URIDMap *)handle;
+  char *copy = NULL;
+
+  uint32_t i = hash_uri(uri) & map->mask;
+  for (uint32_t n = 0; n <= map->mask; ++n, i = (i + 1) & map->mask)
+  {
+    char *slot = map->slots[i].load(std::memory_order_acquire);
+    if (!slot)
+    {
+      /* Claim the empty slot, unless another thread got there first */
+      if (!copy && !(copy = strdup(uri)))
+      {
+        return 0;
+      }
+      if (map->slots[i].compare_exchange_strong(
+              slot, copy, std::memory_order_acq_rel, std::memory_order_acquire))
+      {
+        return i + 1;
+      }
+    }
+
+    if (!strcmp(slot, uri))
+    {
+      free(copy);
+      return i + 1;
+    }
+  }
+
+  free(copy);
+  return 0;
+}
+
+const char *
+urid_unmap_uri(LV2_URID_Unmap_Handle handle, LV2_URID urid)
+{
+  const URIDMap *map = (const URIDMap *)handle;
+  if (urid == 0 || urid - 1 > map->mask)
+  {
+    return NULL;
+  }
+
+  return map->slots[urid - 1].load(std::memory_order_acquire);
+}
@@ -0,0 +1,43 @@
+// SPDX-License-Identifier: ISC
+
+#ifndef URID_MAP_H
+#define URID_MAP_H
+
+#include "lv2/urid/urid.h"
+
+#include <stdint.h>
+
+/**
+   Concurrent URI to URID map.
+
+   URIs are interned in a fixed-size open-addressing hash table whose slots
+   are only ever claimed with a compare-and-swap and never move, so the URID
+   of a URI is simply its slot index plus one.  Looking up a URI that is
+   already mapped, and unmapping any URID, is wait-free, and any number of
+   threads and plugin instances can share one map without a lock.
+*/
+typedef struct URIDMapImpl URIDMap;
+
+/**
+   Create a map with room for `capacity` URIs.
+
+   `capacity` is rounded up to a power of two.  Once the table is full,
+   mapping a new URI fails and returns zero.  Returns NULL if the map can
+   not be allocated.
+*/
+URIDMap *
+urid_map_new(uint32_t capacity);
+
+/** Free a map and every URI interned in it. */
+void
+urid_map_free(URIDMap *map);
+
+/** LV2_URID_Map::map implementation, `handle` is a URIDMap. */
+LV2_URID
+urid_map_uri(LV2_URID_Map_Handle handle, const char *uri);
+
+/** LV2_URID_Unmap::unmap implementation, `handle` is a URIDMap. */
+const char *
+urid_unmap_uri(LV2_URID_Unmap_Handle handle, LV2_URID urid);
+
+#endif // URID_MAP_H
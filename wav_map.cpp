@@ -0,0 +1,297 @@
+// SPDX-License-Identifier: ISC
+
+#include "wav_map.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/** Size of the header: RIFF, JUNK (or ds64), fmt and data chunk headers */
+#define HEADER_SIZE 80
+
+/** Extra fmt chunk size for WAVE_FORMAT_EXTENSIBLE, used past 2 channels */
+#define EXTENSIBLE_SIZE 24
+
+/** Bytes of data written back and dropped from the mapping at a time */
+#define FLUSH_BYTES ((size_t)32 << 20)
+
+
+struct WavMapImpl
+{
+  int fd;
+  uint8_t *base;        ///< Mapping of the whole file
+  size_t size;          ///< Size of the mapping
+  uint32_t n_channels;
+  uint32_t sample_rate;
+  PcmFormat format;
+  uint32_t frame_size;  ///< Bytes per interleaved frame
+  uint32_t header_size; ///< Bytes before the sample data
+  int64_t capacity;     ///< Frames the mapping has room for
+  int64_t n_frames;     ///< Frames committed so far
+  size_t flushed;       ///< Data bytes handed to writeback so far
+  uint64_t n_flushes;
+  bool finished;
+  bool failed;
+  WavMapStats stats;
+};
+
+static void
+put_u16(uint8_t *p, uint16_t v)
+{
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+}
+
+static void
+put_u32(uint8_t *p, uint32_t v)
+{
+  put_u16(p, (uint16_t)v);
+  put_u16(p + 2, (uint16_t)(v >> 16));
+}
+
+static void
+put_u64(uint8_t *p, uint64_t v)
+{
+  put_u32(p, (uint32_t)v);
+  put_u32(p + 4, (uint32_t)(v >> 32));
+}
+
+/** Return the size of the data chunk with its pad byte. */
+static uint64_t
+padded_size(uint64_t data_size)
+{
+  return data_size + (data_size & 1);
+}
+
+/**
+   Return the default speaker positions for n_channels, like libsndfile.
+
+   Layouts without a usual speaker arrangement are left unassigned.
+*/
+static uint32_t
+channel_mask(uint32_t n_channels)
+{
+  switch (n_channels)
+  {
+  case 4:
+    return 0x33; // Quad
+  case 6:
+    return 0x3F; // 5.1
+  case 8:
+    return 0xFF; // 7.1
+  default:
+    return 0;
+  }
+}
+
+/**
+   Write the header for data_size bytes of sample data.
+
+   Small files get a JUNK chunk that readers skip, large ones are RF64 with
+   the real sizes in the ds64 chunk that takes its place.  More than two
+   channels are written as WAVE_FORMAT_EXTENSIBLE with a channel mask, as
+   libsndfile does.
+*/
+static bool
+write_header(WavMap *w, uint64_t data_size)
+{
+  uint8_t *h = w->base;
+  const uint64_t riff_size = w->header_size - 8 + padded_size(data_size);
+  const bool rf64 = riff_size > 0xFFFFFFFFull;
+  const bool extensible = w->header_size > HEADER_SIZE;
+  const uint16_t tag = w->format == PCM_F32 ? 3 : 1; // IEEE_FLOAT or PCM
+  const uint16_t bits = (uint16_t)(pcm_sample_size(w->format) * 8);
+
+  memcpy(h, rf64 ? "RF64" : "RIFF", 4);
+  put_u32(h + 4, rf64 ? 0xFFFFFFFFu : (uint32_t)riff_size);
+  memcpy(h + 8, "WAVE", 4);
+
+  memcpy(h + 12, rf64 ? "ds64" : "JUNK", 4);
+  put_u32(h + 16, 28);
+  memset(h + 20, 0, 28);
+  if (rf64)
+  {
+    put_u64(h + 20, riff_size);
+    put_u64(h + 28, data_size);
+    put_u64(h + 36, (uint64_t)w->n_frames);
+  }
+
+  memcpy(h + 48, "fmt ", 4);
+  put_u32(h + 52, extensible ? 16 + EXTENSIBLE_SIZE : 16);
+  put_u16(h + 56, extensible ? 0xFFFE : tag);
+  put_u16(h + 58, (uint16_t)w->n_channels);
+  put_u32(h + 60, w->sample_rate);
+  put_u32(h + 64, w->sample_rate * w->frame_size);
+  put_u16(h + 68, (uint16_t)w->frame_size);
+  put_u16(h + 70, bits);
+  if (extensible)
+  {
+    /* cbSize, valid bits, channel mask and the sub-format GUID, which is
+       the format tag followed by the fixed KSDATAFORMAT_SUBTYPE tail */
+    static const uint8_t guid_tail[14] = {
+        0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80,
+        0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71};
+
+    put_u16(h + 72, EXTENSIBLE_SIZE - 2);
+    put_u16(h + 74, bits);
+    put_u32(h + 76, channel_mask(w->n_channels));
+    put_u16(h + 80, tag);
+    memcpy(h + 82, guid_tail, sizeof(guid_tail));
+  }
+
+  uint8_t *const data = h + w->header_size - 8;
+  memcpy(data, "data", 4);
+  put_u32(data + 4, rf64 ? 0xFFFFFFFFu : (uint32_t)data_size);
+  return rf64;
+}
+
+WavMap *
+wav_map_open(const char *path,
+             uint32_t n_channels,
+             uint32_t sample_rate,
+             PcmFormat format,
+             int64_t n_frames)
+{
+  if (!n_channels || n_frames < 0)
+  {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  const int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+  {
+    return NULL;
+  }
+
+  const uint32_t frame_size = n_channels * pcm_sample_size(format);
+  const uint32_t header_size =
+      n_channels > 2 ? HEADER_SIZE + EXTENSIBLE_SIZE : HEADER_SIZE;
+  const size_t data_size = (size_t)n_frames * frame_size;
+  const size_t size = header_size + (size_t)padded_size(data_size);
+
+  /* Reserve every block now, so running out of space is an error here and
+     not a SIGBUS in the middle of the render.  A sparse file would defer
+     that to the mapped writes, so filesystems without fallocate() fail */
+  if (fallocate(fd, 0, 0, (off_t)size))
+  {
+    const int err = errno == ENOSYS ? EOPNOTSUPP : errno;
+    close(fd);
+    unlink(path);
+    errno = err;
+    return NULL;
+  }
+
+  void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED)
+  {
+    const int err = errno;
+    close(fd);
+    unlink(path);
+    errno = err;
+    return NULL;
+  }
+  madvise(base, size, MADV_SEQUENTIAL);
+
+  WavMap *w = (WavMap *)calloc(1, sizeof(WavMap));
+  if (!w)
+  {
+    munmap(base, size);
+    close(fd);
+    unlink(path);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  w->fd = fd;
+  w->base = (uint8_t *)base;
+  w->size = size;
+  w->n_channels = n_channels;
+  w->sample_rate = sample_rate;
+  w->format = format;
+  w->frame_size = frame_size;
+  w->header_size = header_size;
+  w->capacity = n_frames;
+  write_header(w, data_size);
+  return w;
+}
+
+void *
+wav_map_acquire(WavMap *w, uint32_t n_frames)
+{
+  if (w->n_frames + n_frames > w->capacity)
+  {
+    return NULL;
+  }
+
+  return w->base + w->header_size + (size_t)w->n_frames * w->frame_size;
+}
+
+void
+wav_map_commit(WavMap *w, uint32_t n_frames)
+{
+  w->n_frames += n_frames;
+
+  /* Start writeback of every full window, and drop the pages of the one
+     before it from the mapping, since it is done with and mostly clean */
+  const size_t written = (size_t)w->n_frames * w->frame_size;
+  while (written - w->flushed >= FLUSH_BYTES)
+  {
+    sync_file_range(w->fd,
+                    w->header_size + (off_t)w->flushed,
+                    FLUSH_BYTES,
+                    SYNC_FILE_RANGE_WRITE);
+    if (w->flushed >= FLUSH_BYTES)
+    {
+      /* Page-align the start, which may cover some of the header */
+      const size_t start = w->header_size + w->flushed - FLUSH_BYTES;
+      const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+      const size_t aligned = start / page * page;
+      madvise(w->base + aligned, FLUSH_BYTES, MADV_DONTNEED);
+    }
+
+    w->flushed += FLUSH_BYTES;
+    ++w->n_flushes;
+  }
+}
+
+int
+wav_map_finish(WavMap *w, WavMapStats *stats)
+{
+  if (!w->finished)
+  {
+    const uint64_t data_size = (uint64_t)w->n_frames * w->frame_size;
+    const uint64_t size = w->header_size + padded_size(data_size);
+    if (data_size & 1)
+    {
+      w->base[w->header_size + data_size] = 0;
+    }
+
+    w->stats.rf64 = write_header(w, data_size);
+    w->stats.n_bytes = size;
+    w->stats.n_flushes = w->n_flushes;
+    w->failed = munmap(w->base, w->size) || ftruncate(w->fd, (off_t)size);
+    w->failed = close(w->fd) || w->failed;
+    w->finished = true;
+  }
+
+  if (stats)
+  {
+    *stats = w->stats;
+  }
+
+  return w->failed ? 1 : 0;
+}
+
+void
+wav_map_free(WavMap *w)
+{
+  if (w)
+  {
+    wav_map_finish(w, NULL);
+    free(w);
+  }
+}
@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: ISC
+
+#ifndef WAV_MAP_H
+#define WAV_MAP_H
+
+#include "pcm_convert.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+   Memory-mapped WAV file writer.
+
+   The whole file is preallocated with fallocate() and mapped, so samples
+   are converted straight into the page cache with no write() calls or
+   intermediate copies.  Writeback of the mapped data is started as it is
+   filled and the pages are dropped from the mapping, so a long render does
+   not pin gigabytes of dirty memory.  The header reserves room for an RF64
+   ds64 chunk, which replaces a JUNK chunk when the data exceeds 4 GiB.
+*/
+typedef struct WavMapImpl WavMap;
+
+/** Writer statistics, valid after wav_map_finish(). */
+typedef struct
+{
+  uint64_t n_bytes;   ///< Size of the finished file
+  uint64_t n_flushes; ///< Number of writeback windows started
+  bool rf64;          ///< The file was written as RF64
+} WavMapStats;
+
+/**
+   Create `path` with room for n_frames frames and map it.
+
+   Returns NULL and sets errno on failure, including when the filesystem
+   does not have room for the whole file.  A filesystem that can not
+   preallocate it fails with EOPNOTSUPP, so the caller can write the file
+   some other way.
+*/
+WavMap *
+wav_map_open(const char *path,
+             uint32_t n_channels,
+             uint32_t sample_rate,
+             PcmFormat format,
+             int64_t n_frames);
+
+/**
+   Return where the next n_frames frames go in the mapping.
+
+   Returns NULL if that would go past the size given to wav_map_open().
+*/
+void *
+wav_map_acquire(WavMap *map, uint32_t n_frames);
+
+/** Mark the n_frames frames written to the last acquired region as done. */
+void
+wav_map_commit(WavMap *map, uint32_t n_frames);
+
+/**
+   Write the final header, unmap and truncate the file to what was written.
+
+   Returns zero on success, or non-zero if the file could not be finished.
+*/
+int
+wav_map_finish(WavMap *map, WavMapStats *stats);
+
+/** Free a writer, finishing it first if necessary. */
+void
+wav_map_free(WavMap *map);
+
+#endif // WAV_MAP_H